@@ -0,0 +1,440 @@
+﻿module;
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <iterator>
+
+export module BlockCompressor;
+
+/// <summary>
+/// CPU encoders of BC1, BC3 and BC7 (mode 6 only) blocks from RGBA8 pixels.
+/// Endpoints are fitted along the principal axis of the block colors.
+/// </summary>
+export namespace BlockCompressor
+{
+    enum class Format
+    {
+        BC1, // RGB, 4 bits per pixel
+        BC3, // RGB + interpolated alpha, 8 bits per pixel
+        BC7, // RGBA, mode 6, 8 bits per pixel
+    };
+
+    size_t GetBlockSize(Format format)
+    {
+        return format == Format::BC1 ? 8 : 16;
+    }
+
+    size_t GetNumBlocks(size_t numPixels)
+    {
+        return (numPixels + 3) / 4;
+    }
+
+    size_t GetRowPitch(Format format, size_t width)
+    {
+        return GetNumBlocks(width) * GetBlockSize(format);
+    }
+
+    void CompressRow(Format format, const uint32_t* pSource, size_t width, size_t height, size_t blockRow, void* pDest);
+}
+
+namespace BlockCompressor
+{
+    typedef uint8_t Block[16][4];
+
+    /// <summary>
+    /// Fits a line through the pixels with use[i] set, returns its ends clamped to the colors of the block
+    /// </summary>
+    void FitEndpoints(const Block& block, const bool(&use)[16], const int numChannels, float(&end0)[4], float(&end1)[4])
+    {
+        float mean[4] = {};
+        int numUsed = 0;
+        for (int i = 0; i < 16; ++i)
+        {
+            if (!use[i])
+                continue;
+            for (int c = 0; c < numChannels; ++c)
+                mean[c] += block[i][c];
+            numUsed++;
+        }
+
+        if (numUsed == 0)
+        {
+            std::fill(std::begin(end0), std::end(end0), 0.0f);
+            std::fill(std::begin(end1), std::end(end1), 0.0f);
+            return;
+        }
+
+        for (int c = 0; c < numChannels; ++c)
+            mean[c] /= numUsed;
+
+        float covariance[4][4] = {};
+        for (int i = 0; i < 16; ++i)
+        {
+            if (!use[i])
+                continue;
+            for (int c0 = 0; c0 < numChannels; ++c0)
+                for (int c1 = c0; c1 < numChannels; ++c1)
+                    covariance[c0][c1] += (block[i][c0] - mean[c0]) * (block[i][c1] - mean[c1]);
+        }
+        for (int c0 = 0; c0 < numChannels; ++c0)
+            for (int c1 = 0; c1 < c0; ++c1)
+                covariance[c0][c1] = covariance[c1][c0];
+
+        // Power iteration, starting from the channel with the largest variance
+        int largest = 0;
+        for (int c = 1; c < numChannels; ++c)
+            if (covariance[c][c] > covariance[largest][largest])
+                largest = c;
+
+        float axis[4] = {};
+        for (int c = 0; c < numChannels; ++c)
+            axis[c] = covariance[largest][c];
+
+        for (int iteration = 0; iteration < 8; ++iteration)
+        {
+            float next[4] = {};
+            float length = 0.0f;
+            for (int c0 = 0; c0 < numChannels; ++c0)
+            {
+                for (int c1 = 0; c1 < numChannels; ++c1)
+                    next[c0] += covariance[c0][c1] * axis[c1];
+                length = std::max(length, std::abs(next[c0]));
+            }
+
+            if (length < 1e-6f)
+                break;
+
+            for (int c = 0; c < numChannels; ++c)
+                axis[c] = next[c] / length;
+        }
+
+        float axisLengthSq = 0.0f;
+        for (int c = 0; c < numChannels; ++c)
+            axisLengthSq += axis[c] * axis[c];
+
+        float minT = 0.0f;
+        float maxT = 0.0f;
+        if (axisLengthSq > 1e-6f)
+        {
+            minT = FLT_MAX;
+            maxT = -FLT_MAX;
+            for (int i = 0; i < 16; ++i)
+            {
+                if (!use[i])
+                    continue;
+                float t = 0.0f;
+                for (int c = 0; c < numChannels; ++c)
+                    t += (block[i][c] - mean[c]) * axis[c];
+                t /= axisLengthSq;
+                minT = std::min(minT, t);
+                maxT = std::max(maxT, t);
+            }
+        }
+
+        for (int c = 0; c < 4; ++c)
+        {
+            end0[c] = c < numChannels ? std::clamp(mean[c] + minT * axis[c], 0.0f, 255.0f) : 255.0f;
+            end1[c] = c < numChannels ? std::clamp(mean[c] + maxT * axis[c], 0.0f, 255.0f) : 255.0f;
+        }
+    }
+
+    int DistanceSq(const uint8_t* p, const int* q, const int numChannels)
+    {
+        int distance = 0;
+        for (int c = 0; c < numChannels; ++c)
+            distance += (p[c] - q[c]) * (p[c] - q[c]);
+        return distance;
+    }
+
+    uint16_t To565(const float(&color)[4])
+    {
+        const int r = static_cast<int>(color[0] * 31.0f / 255.0f + 0.5f);
+        const int g = static_cast<int>(color[1] * 63.0f / 255.0f + 0.5f);
+        const int b = static_cast<int>(color[2] * 31.0f / 255.0f + 0.5f);
+        return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+    }
+
+    void From565(const uint16_t color, int(&out)[4])
+    {
+        const int r = (color >> 11) & 31;
+        const int g = (color >> 5) & 63;
+        const int b = color & 31;
+        out[0] = (r << 3) | (r >> 2);
+        out[1] = (g << 2) | (g >> 4);
+        out[2] = (b << 3) | (b >> 2);
+        out[3] = 255;
+    }
+
+    /// <summary>
+    /// Color block of BC1 and BC3, always in 4 color mode; pixels without use[i] don't affect the endpoints
+    /// </summary>
+    void CompressColorBlock(const Block& block, const bool(&use)[16], uint8_t* pDest)
+    {
+        float end0[4], end1[4];
+        FitEndpoints(block, use, 3, end0, end1);
+
+        // Inset the ends a bit, extremes are rarely worth an index of their own
+        for (int c = 0; c < 3; ++c)
+        {
+            const float inset = (end1[c] - end0[c]) / 16.0f;
+            end0[c] += inset;
+            end1[c] -= inset;
+        }
+
+        uint16_t color0 = To565(end1);
+        uint16_t color1 = To565(end0);
+        if (color0 < color1)
+            std::swap(color0, color1);
+
+        uint32_t indices = 0;
+        if (color0 != color1)
+        {
+            int palette[4][4];
+            From565(color0, palette[0]);
+            From565(color1, palette[1]);
+            for (int c = 0; c < 3; ++c)
+            {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+
+            for (int i = 0; i < 16; ++i)
+            {
+                uint32_t best = 0;
+                int bestDistance = DistanceSq(block[i], palette[0], 3);
+                for (uint32_t j = 1; j < 4; ++j)
+                {
+                    const int distance = DistanceSq(block[i], palette[j], 3);
+                    if (distance < bestDistance)
+                    {
+                        bestDistance = distance;
+                        best = j;
+                    }
+                }
+                indices |= best << (2 * i);
+            }
+        }
+
+        memcpy(pDest, &color0, sizeof(color0));
+        memcpy(pDest + 2, &color1, sizeof(color1));
+        memcpy(pDest + 4, &indices, sizeof(indices));
+    }
+
+    /// <summary>
+    /// Alpha block of BC3 in 8 alpha mode
+    /// </summary>
+    void CompressAlphaBlock(const Block& block, uint8_t* pDest)
+    {
+        uint8_t alpha0 = 0;
+        uint8_t alpha1 = 255;
+        for (int i = 0; i < 16; ++i)
+        {
+            alpha0 = std::max(alpha0, block[i][3]);
+            alpha1 = std::min(alpha1, block[i][3]);
+        }
+
+        uint64_t indices = 0;
+        if (alpha0 != alpha1)
+        {
+            int palette[8] = { alpha0, alpha1 };
+            for (int j = 1; j < 7; ++j)
+                palette[j + 1] = ((7 - j) * alpha0 + j * alpha1) / 7;
+
+            for (int i = 0; i < 16; ++i)
+            {
+                uint64_t best = 0;
+                int bestDistance = std::abs(block[i][3] - palette[0]);
+                for (uint64_t j = 1; j < 8; ++j)
+                {
+                    const int distance = std::abs(block[i][3] - palette[j]);
+                    if (distance < bestDistance)
+                    {
+                        bestDistance = distance;
+                        best = j;
+                    }
+                }
+                indices |= best << (3 * i);
+            }
+        }
+
+        pDest[0] = alpha0;
+        pDest[1] = alpha1;
+        memcpy(pDest + 2, &indices, 6);
+    }
+
+    /// <summary>
+    /// Quantizes an endpoint of BC7 mode 6 to 7 bits per channel and a shared p-bit
+    /// </summary>
+    void QuantizeEndpoint(const float(&end)[4], uint32_t(&quantized)[4], uint32_t& pBit, int(&decoded)[4])
+    {
+        float bestError = FLT_MAX;
+        for (uint32_t p = 0; p < 2; ++p)
+        {
+            uint32_t q[4];
+            float error = 0.0f;
+            for (int c = 0; c < 4; ++c)
+            {
+                q[c] = static_cast<uint32_t>(std::clamp((end[c] - p) / 2.0f + 0.5f, 0.0f, 127.0f));
+                const float difference = static_cast<float>(q[c] * 2 + p) - end[c];
+                error += difference * difference;
+            }
+
+            if (error < bestError)
+            {
+                bestError = error;
+                pBit = p;
+                std::copy(std::begin(q), std::end(q), std::begin(quantized));
+            }
+        }
+
+        for (int c = 0; c < 4; ++c)
+            decoded[c] = quantized[c] * 2 + pBit;
+    }
+
+    class BitWriter
+    {
+    public:
+        void Write(uint64_t value, unsigned int numBits)
+        {
+            if (m_iPosition < 64)
+            {
+                m_Bits[0] |= value << m_iPosition;
+                if (m_iPosition + numBits > 64)
+                    m_Bits[1] |= value >> (64 - m_iPosition);
+            }
+            else
+            {
+                m_Bits[1] |= value << (m_iPosition - 64);
+            }
+            m_iPosition += numBits;
+        }
+
+        void CopyTo(uint8_t* pDest) const { memcpy(pDest, m_Bits, sizeof(m_Bits)); }
+
+    private:
+        uint64_t m_Bits[2] = {};
+        unsigned int m_iPosition = 0;
+    };
+
+    /// <summary>
+    /// BC7 mode 6: one subset, RGBA endpoints with p-bits, 4 bit indices
+    /// </summary>
+    void CompressBC7Block(const Block& block, uint8_t* pDest)
+    {
+        static const int Weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+        bool use[16];
+        std::fill(std::begin(use), std::end(use), true);
+
+        float end0[4], end1[4];
+        FitEndpoints(block, use, 4, end0, end1);
+
+        uint32_t quantized[2][4];
+        uint32_t pBits[2];
+        int decoded[2][4];
+        QuantizeEndpoint(end0, quantized[0], pBits[0], decoded[0]);
+        QuantizeEndpoint(end1, quantized[1], pBits[1], decoded[1]);
+
+        int palette[16][4];
+        for (int j = 0; j < 16; ++j)
+            for (int c = 0; c < 4; ++c)
+                palette[j][c] = ((64 - Weights[j]) * decoded[0][c] + Weights[j] * decoded[1][c] + 32) >> 6;
+
+        uint32_t indices[16];
+        for (int i = 0; i < 16; ++i)
+        {
+            indices[i] = 0;
+            int bestDistance = DistanceSq(block[i], palette[0], 4);
+            for (uint32_t j = 1; j < 16; ++j)
+            {
+                const int distance = DistanceSq(block[i], palette[j], 4);
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    indices[i] = j;
+                }
+            }
+        }
+
+        // Most significant bit of the first index is implicitly zero
+        if (indices[0] & 8)
+        {
+            std::swap(quantized[0], quantized[1]);
+            std::swap(pBits[0], pBits[1]);
+            for (auto& index : indices)
+                index = 15 - index;
+        }
+
+        BitWriter writer;
+        writer.Write(1 << 6, 7); // mode 6
+        for (int c = 0; c < 4; ++c)
+        {
+            writer.Write(quantized[0][c], 7);
+            writer.Write(quantized[1][c], 7);
+        }
+        writer.Write(pBits[0], 1);
+        writer.Write(pBits[1], 1);
+        writer.Write(indices[0], 3);
+        for (int i = 1; i < 16; ++i)
+            writer.Write(indices[i], 4);
+
+        writer.CopyTo(pDest);
+    }
+
+    void CompressRow(Format format, const uint32_t* pSource, size_t width, size_t height, size_t blockRow, void* pDest)
+    {
+        uint8_t* pBlockDest = static_cast<uint8_t*>(pDest);
+        const size_t blockSize = GetBlockSize(format);
+
+        for (size_t blockX = 0; blockX < GetNumBlocks(width); ++blockX)
+        {
+            // Mips smaller than a block repeat their last row and column
+            Block block;
+            for (size_t y = 0; y < 4; ++y)
+            {
+                const size_t sourceY = std::min(blockRow * 4 + y, height - 1);
+                for (size_t x = 0; x < 4; ++x)
+                {
+                    const size_t sourceX = std::min(blockX * 4 + x, width - 1);
+                    memcpy(block[y * 4 + x], &pSource[sourceY * width + sourceX], sizeof(uint32_t));
+                }
+            }
+
+            switch (format)
+            {
+            case Format::BC1:
+            {
+                bool use[16];
+                std::fill(std::begin(use), std::end(use), true);
+                CompressColorBlock(block, use, pBlockDest);
+                break;
+            }
+            case Format::BC3:
+            {
+                // Colors of masked out pixels don't matter
+                bool use[16];
+                bool bAnyOpaque = false;
+                for (int i = 0; i < 16; ++i)
+                {
+                    use[i] = block[i][3] >= 128;
+                    bAnyOpaque |= use[i];
+                }
+                if (!bAnyOpaque)
+                    std::fill(std::begin(use), std::end(use), true);
+
+                CompressAlphaBlock(block, pBlockDest);
+                CompressColorBlock(block, use, pBlockDest + 8);
+                break;
+            }
+            case Format::BC7:
+                CompressBC7Block(block, pBlockDest);
+                break;
+            }
+
+            pBlockDest += blockSize;
+        }
+    }
+}
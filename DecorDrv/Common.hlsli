@@ -62,6 +62,7 @@ cbuffer PerFrameBuffer : register(b0)
 cbuffer PerTickBuffer : register(b1)
 {
     float4 fTick; // x component - time in seconds, y - random value 0..1, z - normal random 0..1
+    float4 StaticLightStates[MAX_STATIC_LIGHTS]; // x - brightness multiplier of the light type, yzw - searchlight direction
 };
 
 cbuffer PerSceneBuffer : register(b2)
@@ -69,12 +70,6 @@ cbuffer PerSceneBuffer : register(b2)
     float4 StaticLights[3072];
 };
 
-cbuffer PerPolyBuffer : register(b3)
-{
-    uint4 PolyControl;    
-    uint4 StaticLightIds[1024];    
-};
-
 sampler SamLinear : register(s0);
 sampler SamPoint : register(s1);
 
@@ -178,7 +173,7 @@ float4 DiffuseBRDF()
     return 1 / PI;
 };
 
-float4 PbrM_BRDF(float3 lightDir, PbrM_ShadingCtx shadingCtx, PbrM_MatInfo matInfo)
+float4 PbrM_BRDF(float3 lightDir, PbrM_ShadingCtx shadingCtx, PbrM_MatInfo matInfo, bool diffuseOnly = false)
 {
     float4 brdf = float4(0, 0, 0, 1);
 
@@ -226,7 +221,7 @@ float4 PbrM_BRDF(float3 lightDir, PbrM_ShadingCtx shadingCtx, PbrM_MatInfo matIn
 #endif
 
         //return specular + diffuse;
-        brdf = specular + diffuse;
+        brdf = diffuseOnly ? diffuse : specular + diffuse;
     }
 
     return brdf;
@@ -260,14 +255,15 @@ float4 PbrM_PointLightContrib(float3 surfPos,
     float4 lightPos,
     float4 intensity,
     PbrM_ShadingCtx shadingCtx,
-    PbrM_MatInfo matInfo)
+    PbrM_MatInfo matInfo,
+    bool diffuseOnly = false)
 {
     const float3 vectorToSurf = surfPos - (float3) lightPos;
     const float distToSurf = length(vectorToSurf);
     const float3 dirToSurf = vectorToSurf / distToSurf;
 
     const float thetaCos = ThetaCos(shadingCtx.normal, dirToSurf);
-    const float4 brdf = PbrM_BRDF(dirToSurf, shadingCtx, matInfo);
+    const float4 brdf = PbrM_BRDF(dirToSurf, shadingCtx, matInfo, diffuseOnly);
 
     return PbrM_ContribBase(lightPos.w, distToSurf, distToSurf * distToSurf, thetaCos, intensity, brdf);
 }
@@ -309,7 +305,8 @@ float4 PbrM_SpotLightContrib(float3 surfPos,
     float4 lightDirData,
     float4 intensity,
     PbrM_ShadingCtx shadingCtx,
-    PbrM_MatInfo matInfo)
+    PbrM_MatInfo matInfo,
+    bool diffuseOnly = false)
 {
     const float3 vectorToSurf = surfPos - lightPosData.xyz;
     const float distToSurf = length(vectorToSurf);
@@ -324,7 +321,7 @@ float4 PbrM_SpotLightContrib(float3 surfPos,
     else
     {
         const float thetaCos = ThetaCos(shadingCtx.normal, dirToSurf);
-        const float4 brdf = PbrM_BRDF(dirToSurf, shadingCtx, matInfo);
+        const float4 brdf = PbrM_BRDF(dirToSurf, shadingCtx, matInfo, diffuseOnly);
         const float fadeFactor = isFlashLight ?
             100.0f * distToSurf : distToSurf * distToSurf;
         
@@ -363,6 +360,12 @@ static const float4 WaterFogColor = float4(0.025f, 0.024f, 0.021f, 1.0f);
 static const float WaterFogDensity = 1.1f;
 static const float DepthFactor = 50.0f;
 
+bool UseDeferredDynamicLights(uint polyFlags)
+{
+    // Blended surfaces don't write G-buffer, so they get dynamic lights in the forward pass
+    return (FrameControl & FRAME_CONTROL_DEFERRED_DYNAMIC_LIGHTS) && !(polyFlags & (PF_Translucent | PF_Modulated));
+}
+
 bool IsUnderwater(float screenY)
 {
     return (FrameControl & 1) && (screenY / fRes.y > ScreenWaterLevel);
@@ -378,4 +381,74 @@ float4 AddUnderWaterFog(float4 color, float distance, float screenY)
     }
     else
         return color;
-}
\ No newline at end of file
+}
+
+float4 GetDynamicPixel(const float3 posView,
+    const PbrM_ShadingCtx shadingCtx,
+    const PbrM_MatInfo matInfo,
+    const bool diffuseOnly = false)
+{
+    float4 output = float4(0, 0, 0, 0);
+    
+    //    
+    int lightBufPos = 0;
+    while (lightBufPos < MAX_LIGHTS_DATA_SIZE)
+    {
+        float4 intencity = DynamicLights[lightBufPos];
+        
+        uint lightInfo = asuint(intencity.w);
+        
+        uint lightEffect = lightInfo & LIGHT_EFFECT_MASK;
+        if (lightEffect == LE_Unused)
+            break;
+        
+        switch (lightEffect)
+        {
+            case LE_Spotlight:
+            case LE_StaticSpot:
+                {
+                    //  ,        
+                    //           
+                    float4 lightPosData = DynamicLights[lightBufPos + 1];
+                    float4 lightDirData = DynamicLights[lightBufPos + 2];
+                    lightBufPos += 3;
+                
+                    // Skip spot lights that are out of range of the point being shaded.
+                    if (length(lightPosData.xyz - posView) < lightPosData.w)
+                        output += PbrM_SpotLightContrib(posView,
+                                lightPosData,
+                                lightDirData,
+                                intencity,
+                                shadingCtx,
+                                matInfo,
+                                diffuseOnly);
+                }
+                break;
+            default:
+                {
+                    //           
+                    // (..   )
+                    float4 lightPosData = DynamicLights[lightBufPos + 1];
+                
+                    float lightRadius = lightPosData.w;
+                    lightPosData.w = 0;
+                    lightPosData = mul(lightPosData - Origin, ViewMatrix);
+                    lightPosData.w = lightRadius;
+                
+                    lightBufPos += 2;
+
+                    // Skip point lights that are out of range of the point being shaded.
+                    if (length((float3) lightPosData - posView) < lightPosData.w)
+                        output += PbrM_PointLightContrib(posView,
+                                lightPosData,
+                                intencity,
+                                shadingCtx,
+                                matInfo,
+                                diffuseOnly);
+                }
+                break;
+        }
+    }
+    
+    return output;
+}
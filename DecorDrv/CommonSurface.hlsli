@@ -5,7 +5,16 @@ Texture2D TexDiffuse : register(t0);
 Texture2D TexLight : register(t1);
 Texture2D TexFog : register(t2);
 Texture2D TexNoise : register(t3);
-Texture2DArray TexOcclusion : register(t4);
+Texture2DArray TexOcclusion : register(t4); // atlas of occlusion maps of the level
+Buffer<uint> LightBits : register(t9); // raw light bits of the level, 1 bit per texel per light
+Buffer<uint4> OcclusionRecords : register(t10); // per shading map: x - atlas page, y - position in the page (x | y << 16), z - offset in the light bits, w - slices per row (0 - fully lit)
+Texture2D TexPalettes : register(t11); // 256 colors per row, palettes of palette-indexed diffuse textures
+Buffer<uint4> SurfaceRecords : register(t12); // per surface drawn this frame: PolyControl, then an entry per static light, see PerComplexPolyBuffer
+
+// Occlusion levels, the same as OcclusionMapCache uses for occlusion maps
+static const float OcclusionMaxLight = 255.0f / 255.0f;
+static const float OcclusionLowLight = 50.0f / 255.0f;
+static const float OcclusionMinLight = 2.0f / 255.0f;
 
 struct SPoly
 {
@@ -15,6 +24,7 @@ struct SPoly
     float2 TexCoord2 : TexCoord2;
     uint PolyFlags : BlendIndices0;
     uint TexFlags : BlendIndices1;
+    uint SurfaceOffset : BlendIndices2;
 };
 
 struct VSOut
@@ -25,18 +35,71 @@ struct VSOut
     float2 TexCoord2 : TexCoord2;
     uint PolyFlags : BlendIndices0;
     uint TexFlags : BlendIndices1;
+    uint SurfaceOffset : BlendIndices2;
     float4 PosView : Position1;
     float4 PosWorld : Position2;
     float3 Normal : Normal;
 };
 
+float4 LoadPaletteColor(const int2 texel, const uint mip, const uint row)
+{
+    const uint index = (uint) (TexDiffuse.Load(int3(texel, mip)).r * 255.0f + 0.5f);
+    return TexPalettes.Load(int3(index, row, 0));
+}
+
+/// <summary>
+/// Color of a palette-indexed diffuse texture: TexDiffuse holds R8 palette indices, TexFlags has the palette row.
+/// Indices can't be filtered, so colors are fetched from the nearest mip and filtered here, bilinear for SamLinear or nearest for SamPoint.
+/// </summary>
+float4 SamplePaletteDiffuse(const float2 texCoord, const uint texFlags, const bool bLinear)
+{
+    const uint row = texFlags >> TEX_FLAG_PALETTE_ROW_OFFSET;
+
+    uint width, height, numMips;
+    TexDiffuse.GetDimensions(0, width, height, numMips);
+
+    const float2 texelCoord = texCoord * float2(width, height);
+    const float2 dx = ddx(texelCoord);
+    const float2 dy = ddy(texelCoord);
+    const float lod = 0.5f * log2(max(max(dot(dx, dx), dot(dy, dy)), 1.0f));
+    const uint mip = min((uint) (lod + 0.5f), numMips - 1);
+    const int2 size = max(int2(width >> mip, height >> mip), 1);
+
+    // Wrap addressing, like the samplers do
+    if (!bLinear)
+        return LoadPaletteColor((int2(floor(texCoord * size)) % size + size) % size, mip, row);
+
+    const float2 pos = texCoord * size - 0.5f;
+    const float2 weight = frac(pos);
+    const int2 texel0 = (int2(floor(pos)) % size + size) % size;
+    const int2 texel1 = (texel0 + 1) % size;
+
+    const float4 top = lerp(LoadPaletteColor(texel0, mip, row), LoadPaletteColor(int2(texel1.x, texel0.y), mip, row), weight.x);
+    const float4 bottom = lerp(LoadPaletteColor(int2(texel0.x, texel1.y), mip, row), LoadPaletteColor(texel1, mip, row), weight.x);
+    return lerp(top, bottom, weight.y);
+}
+
+/// <summary>
+/// Diffuse texture color, filtered like SamLinear or SamPoint
+/// </summary>
+float4 SampleDiffuse(const VSOut input, const bool bLinear)
+{
+    if (input.TexFlags & TEX_FLAG_PALETTE)
+        return SamplePaletteDiffuse(input.TexCoord, input.TexFlags, bLinear);
+
+    if (bLinear)
+        return TexDiffuse.Sample(SamLinear, input.TexCoord);
+
+    return TexDiffuse.Sample(SamPoint, input.TexCoord);
+}
+
 PbrM_MatInfo PbrM_ComputeMatInfo(VSOut input)
 {
     //const float4 baseColor = BaseColorTexture.Sample(LinearSampler, input.Tex) * BaseColorFactor;
     //const float4 baseColor = float4(1.0f, 1.0f, 1.0f, 1.0f) * float4(0.5f, 0.5f, 0.5f, 1.f); // For now, we will use a fixed BaseColor, but then we will need to take it from TexDiffuse
     float4 baseColor;
     if (input.TexFlags & 0x00000001)
-        baseColor = TexDiffuse.Sample(SamLinear, input.TexCoord) * float4(0.5f, 0.5f, 0.5f, 1.0f);
+        baseColor = SampleDiffuse(input, true) * float4(0.5f, 0.5f, 0.5f, 1.0f);
     else
         baseColor = float4(1.0f, 1.0f, 1.0f, 1.0f) * float4(0.5f, 0.5f, 0.5f, 1.f);
 
@@ -76,14 +139,14 @@ float4 GetOriginalPixel(const VSOut input)
 {
     if (input.PolyFlags & PF_Masked)
     {
-        clip(TexDiffuse.Sample(SamPoint, input.TexCoord).a - 0.5f);
+        clip(SampleDiffuse(input, false).a - 0.5f);
     }
 
     float4 Color = float4(1.0f, 1.0f, 1.0f, 1.0f);
 
     if (input.TexFlags & 0x00000001)
     {
-        const float3 Diffuse = TexDiffuse.Sample(SamLinear, input.TexCoord).rgb;
+        const float3 Diffuse = SampleDiffuse(input, true).rgb;
         Color.rgb *= Diffuse;
     }
     if (input.TexFlags & 0x00000002)
@@ -101,6 +164,72 @@ float4 GetOriginalPixel(const VSOut input)
     return Color;
 }
 
+uint GetLightBit(const uint lightOffset, const uint bytesPerRow, const int2 texel)
+{
+    const uint byteOffset = lightOffset + texel.y * bytesPerRow + (texel.x >> 3);
+    const uint word = LightBits.Load(byteOffset >> 2);
+    return (word >> ((byteOffset & 3) * 8 + (texel.x & 7))) & 1;
+}
+
+/// <summary>
+/// Occlusion of one texel of the shading map, edges are softened the same way as OcclusionMapCache::LitEdges does:
+/// unlit texels on the border of the map take some light from the lit neighbour towards the map center
+/// </summary>
+float GetLightBitsTexel(const uint lightOffset, const uint bytesPerRow, const int2 size, const int2 texel)
+{
+    if (GetLightBit(lightOffset, bytesPerRow, texel))
+        return OcclusionMaxLight;
+
+    const int2 inward = int2(texel.x == 0 ? 1 : (texel.x == size.x - 1 ? -1 : 0),
+                             texel.y == 0 ? 1 : (texel.y == size.y - 1 ? -1 : 0));
+    if (inward.x == 0 && inward.y == 0)
+        return OcclusionMinLight;
+
+    return GetLightBit(lightOffset, bytesPerRow, clamp(texel + inward, 0, size - 1)) ? OcclusionLowLight : OcclusionMinLight;
+}
+
+/// <summary>
+/// Bilinear filtered occlusion of the light, fetched from the raw light bits.
+/// polyControl.y - index of the shading map, polyControl.zw - its UClamp and VClamp
+/// </summary>
+float GetLightBitsOcclusion(const uint4 polyControl, const uint lightIndex, const float2 texCoord)
+{
+    const int2 size = int2(polyControl.z, polyControl.w);
+    const uint bytesPerRow = (polyControl.z + 7) / 8;
+    const uint lightOffset = OcclusionRecords.Load(polyControl.y).z + lightIndex * bytesPerRow * polyControl.w;
+
+    // Wrap addressing, like SamLinear does
+    const float2 pos = texCoord * size - 0.5f;
+    const float2 weight = frac(pos);
+    const int2 texel0 = (int2(floor(pos)) % size + size) % size;
+    const int2 texel1 = (texel0 + 1) % size;
+
+    const float top = lerp(GetLightBitsTexel(lightOffset, bytesPerRow, size, texel0),
+                           GetLightBitsTexel(lightOffset, bytesPerRow, size, int2(texel1.x, texel0.y)), weight.x);
+    const float bottom = lerp(GetLightBitsTexel(lightOffset, bytesPerRow, size, int2(texel0.x, texel1.y)),
+                              GetLightBitsTexel(lightOffset, bytesPerRow, size, texel1), weight.x);
+    return lerp(top, bottom, weight.y);
+}
+
+/// <summary>
+/// Occlusion of four lights of the slice, sampled from the atlas.
+/// Slices are surrounded by a border of wrapped texels, so the filtering matches a separate texture with wrap addressing.
+/// </summary>
+float4 SampleOcclusionAtlas(const uint4 polyControl, const uint slice, const float2 texCoord)
+{
+    const uint4 record = OcclusionRecords.Load(polyControl.y);
+    if (record.w == 0)
+        return float4(1, 1, 1, 1);
+
+    float atlasWidth, atlasHeight, numPages;
+    TexOcclusion.GetDimensions(atlasWidth, atlasHeight, numPages);
+
+    const uint2 sliceSize = polyControl.zw + 2;
+    const uint2 sliceOrigin = uint2(record.y & 0xffff, record.y >> 16) + uint2(slice % record.w, slice / record.w) * sliceSize;
+    const float2 pos = sliceOrigin + 1.0f + frac(texCoord) * polyControl.zw;
+    return TexOcclusion.SampleLevel(SamLinear, float3(pos / float2(atlasWidth, atlasHeight), record.x), 0);
+}
+
 float4 GetAdvancedPixel(const VSOut input,
     const PbrM_ShadingCtx shadingCtx,
     const PbrM_MatInfo matInfo)
@@ -116,47 +245,49 @@ float4 GetAdvancedPixel(const VSOut input,
     //    shadingCtx,
     //    matInfo);
     
-    for (uint i = 0; i < PolyControl.x; ++i)
+    // occlusion of four lights is packed into RGBA channels of one slice, lights are sorted by occlusion map id,
+    // so the slice is fetched once for all its lights
+    uint occlusionSlice = 0xffffffff;
+    float4 occlusionTexel = float4(1, 1, 1, 1);
+    
+    const uint4 polyControl = SurfaceRecords[input.SurfaceOffset];
+    for (uint i = 0; i < polyControl.x; ++i)
     {
-        uint occlusionMapId = StaticLightIds[i].x;
+        const uint4 staticLightId = SurfaceRecords[input.SurfaceOffset + 1 + i];
+
+        // state of the light type and searchlight direction are evaluated on CPU once per tick
+        float4 lightState = StaticLightStates[staticLightId.z];
+        float lightTypeRate = lightState.x;
+        if (lightTypeRate == 0.0f)
+            continue;
         
-        float occlusionValue = TexOcclusion.SampleLevel(SamLinear, float3(input.TexCoord1.x, input.TexCoord1.y, occlusionMapId), 0).r;
+        uint occlusionMapId = staticLightId.x;
+        
+        float occlusionValue;
+        if (FrameControl & FRAME_CONTROL_OCCLUSION_BITS)
+        {
+            occlusionValue = GetLightBitsOcclusion(polyControl, occlusionMapId, input.TexCoord1);
+        }
+        else
+        {
+            if (occlusionMapId / 4 != occlusionSlice)
+            {
+                occlusionSlice = occlusionMapId / 4;
+                occlusionTexel = SampleOcclusionAtlas(polyControl, occlusionSlice, input.TexCoord1);
+            }
+            occlusionValue = occlusionTexel[occlusionMapId % 4];
+        }
         
         if (occlusionValue > 0)
         {
-            uint lightBufPos = StaticLightIds[i].y;
+            uint lightBufPos = staticLightId.y;
             float4 intencity = StaticLights[lightBufPos];
          
             uint lightInfo = asuint(intencity.w);
+            const bool diffuseOnly = staticLightId.w != 0; // lighting LOD, selected on CPU by distance to the surface
             if (bool(lightInfo & LIGHT_SPECIAL_MASK) != bool(input.PolyFlags & PF_SpecialLit))
                 continue;
             
-            float lightPeriod = ((lightInfo & LIGHT_PERIOD_MASK) >> LIGHT_PERIOD_OFFSET);
-            
-            float lightTypeRate = 1.0f;
-            uint lightType = (lightInfo & LIGHT_TYPE_MASK) >> LIGHT_TYPE_OFFSET;
-            switch (lightType)
-            {
-                case LT_Blink:
-                    if (fTick.y < 0.2f)
-                        lightTypeRate = 0.0f;
-                    break;
-                case LT_Flicker:
-                    if (fTick.y > 0.2f)
-                        lightTypeRate = 0.0f;
-                    break;
-                case LT_Pulse:
-                    lightTypeRate = (sin(fTick.x / (lightPeriod * 4.0f)) + 1.0f) / 2.0f;
-                    break;
-                case LT_Strobe:
-                    if (sin(fTick.x / (lightPeriod * 4.0f)) < 0.0f)
-                        lightTypeRate = 0.0f;
-                    break;
-            }
-            
-            if (lightTypeRate == 0.0f)
-                continue;
-            
             occlusionValue *= lightTypeRate; // effect of the light type on occlusion
             
             uint lightEffect = lightInfo & LIGHT_EFFECT_MASK;
@@ -213,7 +344,8 @@ float4 GetAdvancedPixel(const VSOut input,
                                 lightDirData,
                                 intencity,
                                 shadingCtx,
-                                matInfo) * occlusionValue;
+                                matInfo,
+                                diffuseOnly) * occlusionValue;
                     }
                     break;
                 case LE_Searchlight:
@@ -225,8 +357,7 @@ float4 GetAdvancedPixel(const VSOut input,
                         lightPosData = mul(lightPosData - Origin, ViewMatrix);
                         lightPosData.w = lightRadius;
                 
-                        float time = fTick.x / 80.0f + lightPeriod;
-                        float4 lightDirData = float4(cos(time), sin(time), 0.0f, 0.5f);
+                        float4 lightDirData = float4(lightState.yzw, 0.5f);
                 
                         float coneAngle = lightDirData.w;
                         lightDirData.w = 0;
@@ -242,7 +373,8 @@ float4 GetAdvancedPixel(const VSOut input,
                                 lightDirData,
                                 intencity,
                                 shadingCtx,
-                                matInfo) * occlusionValue;
+                                matInfo,
+                                diffuseOnly) * occlusionValue;
                     }
                     break;
                 default:
@@ -263,7 +395,8 @@ float4 GetAdvancedPixel(const VSOut input,
                                 lightPosData,
                                 intencity,
                                 shadingCtx,
-                                matInfo) * occlusionValue;
+                                matInfo,
+                                diffuseOnly) * occlusionValue;
                     }
                     break;
             }
@@ -273,75 +406,6 @@ float4 GetAdvancedPixel(const VSOut input,
     return output;
 }
 
-float4 GetDynamicPixel(const VSOut input,
-    const PbrM_ShadingCtx shadingCtx,
-    const PbrM_MatInfo matInfo)
-{
-    float4 output = float4(0, 0, 0, 0);
-    
-    //    
-    int lightBufPos = 0;
-    while (lightBufPos < MAX_LIGHTS_DATA_SIZE)
-    {
-        float4 intencity = DynamicLights[lightBufPos];
-        
-        uint lightInfo = asuint(intencity.w);
-        
-        uint lightEffect = lightInfo & LIGHT_EFFECT_MASK;
-        if (lightEffect == LE_Unused)
-            break;
-        
-        switch (lightEffect)
-        {
-            case LE_Spotlight:
-            case LE_StaticSpot:
-                {
-                    //  ,        
-                    //           
-                    float4 lightPosData = DynamicLights[lightBufPos + 1];
-                    float4 lightDirData = DynamicLights[lightBufPos + 2];
-                    float3 posView = input.PosView.xyz;
-                    lightBufPos += 3;
-                
-                    // Skip spot lights that are out of range of the point being shaded.
-                    if (length(lightPosData.xyz - posView) < lightPosData.w)
-                        output += PbrM_SpotLightContrib(posView,
-                                lightPosData,
-                                lightDirData,
-                                intencity,
-                                shadingCtx,
-                                matInfo);
-                }
-                break;
-            default:
-                {
-                    //           
-                    // (..   )
-                    float4 lightPosData = DynamicLights[lightBufPos + 1];
-                
-                    float lightRadius = lightPosData.w;
-                    lightPosData.w = 0;
-                    lightPosData = mul(lightPosData - Origin, ViewMatrix);
-                    lightPosData.w = lightRadius;
-                
-                    float3 posView = (float3) input.PosView;
-                    lightBufPos += 2;
-
-                    // Skip point lights that are out of range of the point being shaded.
-                    if (length((float3) lightPosData - posView) < lightPosData.w)
-                        output += PbrM_PointLightContrib(posView,
-                                lightPosData,
-                                intencity,
-                                shadingCtx,
-                                matInfo);
-                }
-                break;
-        }
-    }
-    
-    return output;
-}
-
 float4 GetFlashColor(const VSOut input)
 {
     if (!(input.PolyFlags & (PF_Translucent | PF_Modulated)))
@@ -350,8 +414,19 @@ float4 GetFlashColor(const VSOut input)
         return float4(0, 0, 0, 0);
 }
 
-float4 GetSurfacePixel(const VSOut input)
+struct SurfacePixel
+{
+    float4 Color : SV_Target0;
+    float4 NormalDepth : SV_Target1; // G-buffer: xyz - normal in view space, w - depth in view space (0 if deferred dynamic lights are not used)
+    float4 Albedo : SV_Target2; // G-buffer: diffuse color of the material
+};
+
+SurfacePixel GetSurfacePixel(const VSOut input)
 {
+    SurfacePixel pixel;
+    pixel.NormalDepth = float4(0, 0, 0, 0);
+    pixel.Albedo = float4(0, 0, 0, 0);
+
     float4 output = float4(0, 0, 0, 0);
     
     if (input.TexFlags & 0x00000004)
@@ -359,10 +434,10 @@ float4 GetSurfacePixel(const VSOut input)
     else
     {
         if (input.PolyFlags & PF_Masked)
-            clip(TexDiffuse.Sample(SamPoint, input.TexCoord).a - 0.5f);
+            clip(SampleDiffuse(input, false).a - 0.5f);
         
         if (input.PolyFlags & PF_Unlit)
-            output = float4(TexDiffuse.Sample(SamLinear, input.TexCoord).rgb, input.Pos.z * DepthFactor) + GetFlashColor(input);
+            output = float4(SampleDiffuse(input, true).rgb, input.Pos.z * DepthFactor) + GetFlashColor(input);
         else
         {
             PbrM_ShadingCtx shadingCtx;
@@ -372,7 +447,14 @@ float4 GetSurfacePixel(const VSOut input)
             const PbrM_MatInfo matInfo = PbrM_ComputeMatInfo(input);
             
             output = GetAdvancedPixel(input, shadingCtx, matInfo);
-            output += GetDynamicPixel(input, shadingCtx, matInfo);
+
+            if (UseDeferredDynamicLights(input.PolyFlags))
+            {
+                pixel.NormalDepth = float4(shadingCtx.normal, input.PosView.z);
+                pixel.Albedo = matInfo.diffuse;
+            }
+            else
+                output += GetDynamicPixel((float3) input.PosView, shadingCtx, matInfo);
         
             if (input.TexFlags & 0x00000010)
                 output += TexFog.Sample(SamLinear, input.TexCoord2).bgra * 2.0f;
@@ -382,5 +464,6 @@ float4 GetSurfacePixel(const VSOut input)
         }
     }
     
-    return output;
+    pixel.Color = output;
+    return pixel;
 }
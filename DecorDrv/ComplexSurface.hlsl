@@ -5,7 +5,7 @@ SPoly VSMain(const SPoly Input)
     return Input;
 }
 
-float4 PSMain(const VSOut input) : SV_Target
+SurfacePixel PSMain(const VSOut input)
 {
     return GetSurfacePixel(input);
 }
@@ -31,6 +31,7 @@ void GSMain(triangle SPoly In[3], inout TriangleStream<VSOut> outputStream)
         output.TexCoord2 = In[i].TexCoord2;
         output.PolyFlags = In[i].PolyFlags;
         output.TexFlags = In[i].TexFlags;
+        output.SurfaceOffset = In[i].SurfaceOffset;
         outputStream.Append(output);
     }
 
@@ -1,9 +1,6 @@
 #ifndef __DEFINES_HLSLI__
 #define __DEFINES_HLSLI__
 
-#define CONVERT_SRGB_INPUT_TO_LINEAR
-#define CONVERT_LINEAR_OUTPUT_TO_SRGB
-
 //#define USE_SMOOTH_REFRACTION_APPROX
 //#define USE_ROUGH_REFRACTION_APPROX
 
@@ -11,6 +8,15 @@
 #define FAR_CLIPPING_DISTANCE 32760.0f
 #define MAX_LIGHTS_DATA_SIZE 1024
 #define MAX_LIGHTS_INDEX_SIZE 1024 // must be multiple of 16
+#define MAX_STATIC_LIGHTS 1024 // size of the per-tick light animation table
+
+// Bits of FrameControl
+#define FRAME_CONTROL_DEFERRED_DYNAMIC_LIGHTS 0x2 // dynamic lights are accumulated in a separate low resolution pass
+#define FRAME_CONTROL_OCCLUSION_BITS 0x4 // occlusion is fetched from the raw light bits of the level instead of occlusion maps
+
+// Bits of TexFlags of complex surfaces
+#define TEX_FLAG_PALETTE 0x20 // diffuse texture holds palette indices, the colors are in a row of TexPalettes
+#define TEX_FLAG_PALETTE_ROW_OFFSET 16 // bits 16-31 - the palette row
 
 // Masks and offsets for light data, stored in w-component
 // of ligit color vector
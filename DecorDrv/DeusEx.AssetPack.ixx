@@ -0,0 +1,160 @@
+﻿module;
+
+#include <D3D11.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+
+export module DeusEx.AssetPack;
+
+/// <summary>
+/// Versioned binary file with ready-to-upload blobs of a level, memory-mapped for reading.
+/// Layout: header, table of blobs (offset, size), blob data aligned to 16 bytes.
+/// </summary>
+export class AssetPack
+{
+    struct Header
+    {
+        uint32_t Magic;
+        uint32_t Version;
+        uint64_t Key;
+        uint64_t NumBlobs;
+    };
+
+    struct BlobEntry
+    {
+        uint64_t Offset;
+        uint64_t Size;
+    };
+
+    static const uint32_t sm_iMagic = 0x4b504344; // "DCPK"
+    static const uint64_t sm_iAlignment = 16;
+
+public:
+    struct Blob
+    {
+        const void* pData;
+        size_t Size;
+    };
+
+    /// <summary>
+    /// Maps the pack for reading, IsOpen() is false if the file is missing or is not a pack
+    /// </summary>
+    explicit AssetPack(const std::wstring& path)
+    {
+        m_hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(m_hFile, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(Header)))
+            return;
+
+        m_hMapping = CreateFileMappingW(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_hMapping)
+            return;
+
+        m_pView = static_cast<const uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+        if (!m_pView)
+            return;
+
+        m_iSize = static_cast<size_t>(fileSize.QuadPart);
+
+        const Header& header = *reinterpret_cast<const Header*>(m_pView);
+        if (header.Magic != sm_iMagic || sizeof(Header) + header.NumBlobs * sizeof(BlobEntry) > m_iSize)
+            return;
+
+        const BlobEntry* pEntries = reinterpret_cast<const BlobEntry*>(m_pView + sizeof(Header));
+        for (uint64_t i = 0; i < header.NumBlobs; ++i)
+        {
+            if (pEntries[i].Offset + pEntries[i].Size > m_iSize)
+            {
+                m_Blobs.clear();
+                return;
+            }
+            m_Blobs.push_back({ m_pView + pEntries[i].Offset, static_cast<size_t>(pEntries[i].Size) });
+        }
+
+        m_iVersion = header.Version;
+        m_iKey = header.Key;
+        m_bOpen = true;
+    }
+
+    AssetPack(const AssetPack&) = delete;
+    AssetPack& operator=(const AssetPack&) = delete;
+
+    ~AssetPack()
+    {
+        if (m_pView)
+            UnmapViewOfFile(m_pView);
+        if (m_hMapping)
+            CloseHandle(m_hMapping);
+        if (m_hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(m_hFile);
+    }
+
+    /// <summary>
+    /// Writes a pack, the file is replaced only when it's written completely
+    /// </summary>
+    static bool Write(const std::wstring& path, uint32_t version, uint64_t key, const std::vector<Blob>& blobs)
+    {
+        for (size_t separator = path.find(L'\\'); separator != std::wstring::npos; separator = path.find(L'\\', separator + 1))
+            CreateDirectoryW(path.substr(0, separator).c_str(), nullptr);
+
+        const std::wstring tempPath = path + L".tmp";
+        {
+            std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+            if (!file.good())
+                return false;
+
+            const Header header = { sm_iMagic, version, key, blobs.size() };
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+            uint64_t offset = Align(sizeof(Header) + blobs.size() * sizeof(BlobEntry));
+            for (const auto& blob : blobs)
+            {
+                const BlobEntry entry = { offset, blob.Size };
+                file.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+                offset = Align(offset + blob.Size);
+            }
+
+            const char padding[sm_iAlignment] = {};
+            uint64_t position = sizeof(Header) + blobs.size() * sizeof(BlobEntry);
+            for (const auto& blob : blobs)
+            {
+                file.write(padding, Align(position) - position);
+                position = Align(position);
+                file.write(static_cast<const char*>(blob.pData), blob.Size);
+                position += blob.Size;
+            }
+
+            if (!file.good())
+                return false;
+        }
+
+        return MoveFileExW(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+
+    bool IsOpen() const { return m_bOpen; }
+    uint32_t GetVersion() const { return m_iVersion; }
+    uint64_t GetKey() const { return m_iKey; }
+    size_t GetNumBlobs() const { return m_Blobs.size(); }
+    const Blob& GetBlob(size_t index) const { return m_Blobs[index]; }
+
+protected:
+    static uint64_t Align(uint64_t offset)
+    {
+        return (offset + sm_iAlignment - 1) & ~(sm_iAlignment - 1);
+    }
+
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+    const uint8_t* m_pView = nullptr;
+    size_t m_iSize = 0;
+
+    bool m_bOpen = false;
+    uint32_t m_iVersion = 0;
+    uint64_t m_iKey = 0;
+    std::vector<Blob> m_Blobs;
+};
@@ -4,6 +4,10 @@
 #include <cassert>
 #include <fstream>
 #include <sstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
 
 #include <Engine.h>
 #include <UnRender.h>
@@ -14,10 +18,15 @@ import <simple_json.hpp>;
 import GPU.DeviceState;
 import GPU.RenDevBackend;
 import DeusEx.TextureCache;
+import DeusEx.TextureConverter;
+import DeusEx.LightmapAtlas;
+import DeusEx.FogMapPool;
 import DeusEx.OcclusionMapCache;
 import DeusEx.Renderer.Tile;
 import DeusEx.Renderer.Gouraud;
 import DeusEx.Renderer.ComplexSurface;
+import DeusEx.Renderer.DynamicLight;
+import JobSystem;
 import GlobalShaderConstants;
 import Utils;
 
@@ -37,7 +46,8 @@ public:
         URenderDevice::SupportsFogMaps = 1;
         URenderDevice::SupportsTC = 1;
         URenderDevice::SupportsDistanceFog = 0;
-        URenderDevice::SupportsLazyTextures = 0;
+        URenderDevice::SupportsLazyTextures = 0; // set in Init() from the settings
+        URenderDevice::PrefersDeferredLoad = 0;
         URenderDevice::Coronas = 1;
         URenderDevice::ShinySurfaces = 1;
         //URenderDevice::HighDetailActors = 1;
@@ -80,13 +90,165 @@ protected:
 
             if (m_pComplexSurfaceRenderer->IsMapped())
             {
+                if (m_pDynamicLightRenderer)
+                    m_pDynamicLightRenderer->BindSurfaceTargets(m_Backend.GetRenderTargetView(), m_Backend.GetDepthStencilView());
+
                 m_pComplexSurfaceRenderer->Unmap();
                 m_pComplexSurfaceRenderer->Bind();
                 m_pComplexSurfaceRenderer->Draw();
+
+                if (m_pDynamicLightRenderer)
+                    m_pDynamicLightRenderer->UnbindSurfaceTargets(m_Backend.GetRenderTargetView(), m_Backend.GetDepthStencilView());
             }
         }
     }
 
+    /// <summary>
+    /// Applies a texture cache setting that drops cached textures, the surfaces batched so far that reference them are drawn first
+    /// </summary>
+    template<class Setter>
+    void FlushTextureCache(Setter&& SetTextureCache)
+    {
+        Render();
+        SetTextureCache(*m_pTextureCache);
+    }
+
+    /// <summary>
+    /// Adds dynamic lights, accumulated in reduced resolution, to the surfaces drawn so far
+    /// </summary>
+    void ResolveDynamicLights()
+    {
+        if (m_pDynamicLightRenderer)
+            m_pDynamicLightRenderer->Resolve(m_Backend.GetRenderTargetView(), m_Backend.GetDepthStencilView(), m_Backend.GetDepthShaderResourceView());
+    }
+
+    /// <summary>
+    /// Sets resolution divider of dynamic lights: 1 - full resolution in the surface shaders, 2 - half, 4 - quarter
+    /// </summary>
+    void SetDynamicLightsResolution(int resolutionDivider)
+    {
+        if (resolutionDivider != 2 && resolutionDivider != 4)
+            resolutionDivider = 1;
+
+        if (m_pDynamicLightRenderer && m_pDynamicLightRenderer->GetResolutionDivider() == static_cast<unsigned int>(resolutionDivider))
+            return;
+
+        m_pDynamicLightRenderer.reset();
+        if (resolutionDivider > 1)
+        {
+            m_pDynamicLightRenderer = std::make_unique<DynamicLightRenderer>(m_Backend.GetDevice(), m_Backend.GetDeviceContext(), resolutionDivider);
+
+            uint32_t width, height;
+            m_Backend.GetWindowSize(width, height);
+            m_pDynamicLightRenderer->SizeResources(width, height);
+        }
+
+        m_pGlobalShaderConstants->SetDeferredDynamicLights(m_pDynamicLightRenderer != nullptr);
+    }
+
+    /// <summary>
+    /// Selects the source of static light occlusion: occlusion maps converted on CPU or raw light bits sampled by the shader
+    /// </summary>
+    void SetOcclusionLightBits(bool useLightBits)
+    {
+        Render(); // surfaces already batched must be drawn with the current occlusion source
+        m_pOcclusionMapCache->SetUseLightBits(useLightBits);
+        m_pGlobalShaderConstants->SetOcclusionBits(useLightBits);
+    }
+
+    /// <summary>
+    /// Selects block compression of palette textures: "none", "bc" (BC1/BC3) or "bc7"
+    /// </summary>
+    void SetTextureCompression(const std::string& mode)
+    {
+        TextureConverter::Compression compression = TextureConverter::Compression::None;
+        if (mode == "bc")
+            compression = TextureConverter::Compression::BC;
+        else if (mode == "bc7")
+            compression = TextureConverter::Compression::BC7;
+
+        auto& jsonAssetCache = m_Settings["AssetCache"];
+        const bool bAssetCache = jsonAssetCache.IsNull() || jsonAssetCache.ToBool();
+
+        FlushTextureCache([&](TextureCache& Cache) { Cache.SetCompression(compression, bAssetCache ? L"DecorDrv\\Cache\\Textures" : L""); });
+    }
+
+    /// <summary>
+    /// Selects palette-indexed diffuse textures of complex surfaces, the shader looks up the colors instead of the CPU
+    /// </summary>
+    void SetPaletteTextures(bool bPaletteTextures)
+    {
+        FlushTextureCache([=](TextureCache& Cache) { Cache.SetPaletteTextures(bPaletteTextures); });
+    }
+
+    /// <summary>
+    /// Sets the video memory budget of the texture cache in MB: 0 for no limit, negative for half of what the OS grants the process
+    /// </summary>
+    void SetTextureBudget(int iBudgetMB)
+    {
+        size_t iBudgetBytes = static_cast<size_t>(std::max(iBudgetMB, 0)) * 1024 * 1024;
+        if (iBudgetMB < 0)
+        {
+            iBudgetBytes = m_Backend.GetVideoMemoryBudget() / 2;
+            Utils::LogMessagef(L"Texture budget: %Iu MB.", iBudgetBytes / (1024 * 1024));
+        }
+
+        m_pTextureCache->SetBudget(iBudgetBytes);
+    }
+
+    /// <summary>
+    /// Selects sRGB textures and back buffer view, so filtering and blending happen on linear colors
+    /// </summary>
+    void SetSRGB(bool bSRGB)
+    {
+        FlushTextureCache([=](TextureCache& Cache) { Cache.SetSRGB(bSRGB); });
+        m_Backend.SetSRGB(bSRGB);
+    }
+
+    /// <summary>
+    /// Path of the asset pack with precomputed data of the level, empty if the cache is disabled
+    /// </summary>
+    std::wstring GetAssetCachePath(const FSceneNode& SceneNode)
+    {
+        auto& jsonAssetCache = m_Settings["AssetCache"];
+        if (!jsonAssetCache.IsNull() && !jsonAssetCache.ToBool())
+            return std::wstring();
+
+        return std::wstring(L"DecorDrv\\Cache\\") + SceneNode.Level->GetOuter()->GetName() + L".bin";
+    }
+
+    /// <summary>
+    /// Memory of the caches and renderers by kind of resource, the last entry is the total
+    /// </summary>
+    std::vector<std::pair<const TCHAR*, Utils::MemoryUsage>> GetMemoryUsage() const
+    {
+        Utils::MemoryUsage DynamicBuffers = m_pTileRenderer->GetMemoryUsage();
+        DynamicBuffers += m_pGouraudRenderer->GetMemoryUsage();
+        DynamicBuffers += m_pComplexSurfaceRenderer->GetMemoryUsage();
+
+        Utils::MemoryUsage ConstantBuffers = m_pGlobalShaderConstants->GetMemoryUsage();
+        Utils::MemoryUsage RenderTargets = m_Backend.GetRenderTargetMemoryUsage();
+        if (m_pDynamicLightRenderer)
+        {
+            ConstantBuffers += m_pDynamicLightRenderer->GetConstantBufferMemoryUsage();
+            RenderTargets += m_pDynamicLightRenderer->GetRenderTargetMemoryUsage();
+        }
+
+        std::vector<std::pair<const TCHAR*, Utils::MemoryUsage>> Usage = {
+            { L"Textures", m_pTextureCache->GetMemoryUsage() },
+            { L"Occlusion maps", m_pOcclusionMapCache->GetMemoryUsage() },
+            { L"Dynamic buffers", DynamicBuffers },
+            { L"Constant buffers", ConstantBuffers },
+            { L"Render targets", RenderTargets }
+        };
+
+        Utils::MemoryUsage Total;
+        for (const auto& Entry : Usage)
+            Total += Entry.second;
+        Usage.emplace_back(L"Total", Total);
+        return Usage;
+    }
+
     // Convenience function so don't need to pass Viewport->...; template to pass varargs
     template<class... Args>
     void PrintFunc(Args... args)
@@ -113,10 +275,15 @@ protected:
     std::unique_ptr<TileRenderer> m_pTileRenderer;
     std::unique_ptr<GouraudRenderer> m_pGouraudRenderer;
     std::unique_ptr<ComplexSurfaceRenderer> m_pComplexSurfaceRenderer;    
+    std::unique_ptr<DynamicLightRenderer> m_pDynamicLightRenderer;
+    std::unique_ptr<JobSystem> m_pJobSystem; // must outlive the caches that submit jobs
     std::unique_ptr<TextureCache> m_pTextureCache;
     std::unique_ptr<OcclusionMapCache> m_pOcclusionMapCache;
     JSON m_Settings;
 
+    // Time per frame for creating occlusion map textures built on the workers
+    double m_fOcclusionCommitBudgetMs = 2.0;
+
     bool m_bNoTilesDrawnYet;
 
     // From URenderDevice
@@ -155,11 +322,60 @@ public:
 
             m_pGlobalShaderConstants = std::make_unique<GlobalShaderConstants>(Device, DeviceContext, m_Settings);
             m_pDeviceState = std::make_unique<DeviceState>(Device, DeviceContext);
-            m_pTextureCache = std::make_unique<TextureCache>(Device, DeviceContext);
-            m_pOcclusionMapCache = std::make_unique<OcclusionMapCache>(Device, DeviceContext, 4);
+            m_pJobSystem = std::make_unique<JobSystem>();
+            m_pTextureCache = std::make_unique<TextureCache>(Device, DeviceContext, *m_pJobSystem);
+            m_pOcclusionMapCache = std::make_unique<OcclusionMapCache>(Device, DeviceContext, *m_pJobSystem, 4, 9, 10);
             m_pTileRenderer = std::make_unique<TileRenderer>(Device, DeviceContext);
             m_pGouraudRenderer = std::make_unique<GouraudRenderer>(Device, DeviceContext);
             m_pComplexSurfaceRenderer = std::make_unique<ComplexSurfaceRenderer>(Device, DeviceContext);            
+
+            auto& jsonDynamicLightsResolution = m_Settings["DynamicLightsResolution"];
+            SetDynamicLightsResolution(jsonDynamicLightsResolution.IsNull() ? 1 : jsonDynamicLightsResolution.ToInt());
+
+            auto& jsonOcclusionLightBits = m_Settings["OcclusionFromLightBits"];
+            SetOcclusionLightBits(!jsonOcclusionLightBits.IsNull() && jsonOcclusionLightBits.ToBool());
+
+            auto& jsonTextureCompression = m_Settings["TextureCompression"];
+            SetTextureCompression(jsonTextureCompression.IsNull() ? "none" : jsonTextureCompression.ToString());
+
+            auto& jsonPaletteTextures = m_Settings["PaletteTextures"];
+            SetPaletteTextures(!jsonPaletteTextures.IsNull() && jsonPaletteTextures.ToBool());
+
+            auto& jsonTextureBudget = m_Settings["TextureBudgetMB"];
+            SetTextureBudget(jsonTextureBudget.IsNull() ? 0 : jsonTextureBudget.ToInt());
+
+            auto& jsonLightmapAtlas = m_Settings["LightmapAtlas"];
+            m_pTextureCache->SetLightmapAtlas(jsonLightmapAtlas.IsNull() || jsonLightmapAtlas.ToBool());
+
+            auto& jsonFogMapPool = m_Settings["FogMapPool"];
+            m_pTextureCache->SetFogMapPool(jsonFogMapPool.IsNull() || jsonFogMapPool.ToBool());
+
+            // Mip data is loaded by the engine only when the cache converts a texture
+            auto& jsonLazyTextures = m_Settings["LazyTextures"];
+            const bool bLazyTextures = jsonLazyTextures.IsNull() || jsonLazyTextures.ToBool();
+            URenderDevice::SupportsLazyTextures = bLazyTextures;
+            URenderDevice::PrefersDeferredLoad = bLazyTextures;
+            m_pTextureCache->SetLazyTextures(bLazyTextures);
+
+            // Large textures start with their small mips, the rest is uploaded over the next frames
+            auto& jsonTextureStreaming = m_Settings["TextureStreaming"];
+            auto& jsonTextureStreamingBudget = m_Settings["TextureStreamingBudgetKB"];
+            m_pTextureCache->SetStreaming(jsonTextureStreaming.IsNull() || jsonTextureStreaming.ToBool(),
+                (jsonTextureStreamingBudget.IsNull() ? 1024 : std::max(jsonTextureStreamingBudget.ToInt(), 0)) * static_cast<size_t>(1024));
+            auto& jsonAsyncTextureCreation = m_Settings["AsyncTextureCreation"];
+            m_pTextureCache->SetAsyncCreation(jsonAsyncTextureCreation.IsNull() || jsonAsyncTextureCreation.ToBool());
+
+            // Pre-compressed DDS replacements, <directory>\<package>\<texture>.dds
+            auto& jsonTextureOverrides = m_Settings["TextureOverrideDirectory"];
+            const std::string overrideDirectory = jsonTextureOverrides.IsNull() ? "" : jsonTextureOverrides.ToString();
+            m_pTextureCache->SetOverrideDirectory(std::wstring(overrideDirectory.begin(), overrideDirectory.end()));
+
+            auto& jsonSRGB = m_Settings["SRGB"];
+            SetSRGB(!jsonSRGB.IsNull() && jsonSRGB.ToBool());
+
+            auto& jsonOcclusionCommitBudget = m_Settings["OcclusionCommitBudgetMs"];
+            if (!jsonOcclusionCommitBudget.IsNull())
+                m_fOcclusionCommitBudgetMs = jsonOcclusionCommitBudget.ToFloat();
         }
         catch (const Utils::ComException& ex)
         {
@@ -187,6 +403,9 @@ public:
         try
         {
             m_Backend.SetRes(iNewX, iNewY, bFullscreen != 0);
+
+            if (m_pDynamicLightRenderer)
+                m_pDynamicLightRenderer->SizeResources(iNewX, iNewY);
         }
         catch (const Utils::ComException& ex)
         {
@@ -201,6 +420,11 @@ public:
     {
     }
 
+    virtual void PrecacheTexture(FTextureInfo& Info, const DWORD PolyFlags) override
+    {
+        m_pTextureCache->Precache(Info, PolyFlags);
+    }
+
     virtual void Flush(const UBOOL bAllowPrecache) override
     {
     }
@@ -213,19 +437,26 @@ public:
         m_pTileRenderer->NewFrame();
         m_pGouraudRenderer->NewFrame();
         m_pComplexSurfaceRenderer->NewFrame();            
+        m_pTextureCache->NewFrame(); // commits textures finished by the workers
+        m_pJobSystem->ResetStats();
+        if (m_pDynamicLightRenderer)
+            m_pDynamicLightRenderer->NewFrame();
 
         DirectX::XMVECTOR flashColor = { 0.f, 0.f, 0.f, 0.f };        
         if (FlashFog.X > 0 || (FlashFog.Y > 0 && FlashFog.Z / FlashFog.Y < 3.0f)) // filter weird blue underwater color
             flashColor = { FlashFog.X, FlashFog.Y, FlashFog.Z, 0 };
         m_pGlobalShaderConstants->NewFrame(flashColor);
+
+        m_pOcclusionMapCache->CommitBuiltMaps(m_fOcclusionCommitBudgetMs);
     }
 
     virtual void Unlock(const UBOOL bBlit) override
     {
+        m_pTextureCache->FinishPrecache(); // textures queued by the precache pass of this frame
         m_pGlobalShaderConstants->NewTick();
 
         Render();
-                    
+        ResolveDynamicLights();
 
         if (bBlit)
         {
@@ -252,6 +483,7 @@ public:
         // 0x00000004 - use original UE1 rendering
         // 0x00000008 - poly is a water surface
         // 0x00000010 - needs fog
+        // 0x00000020 - diffuse texture holds palette indices, bits 16-31 are the palette row
         unsigned int TexFlags = 0;
             
         int maxINode = m_pGlobalShaderConstants->GetMaxINode();
@@ -264,46 +496,69 @@ public:
         const TextureConverter::TextureData* pTexDiffuse = nullptr;
         if (Surface.Texture)
         {
-            if (!m_pTextureCache->IsPrepared(*Surface.Texture, 0))
+            UINT iPaletteRow;
+            const bool bPaletteIndices = m_pTextureCache->GetPaletteRow(*Surface.Texture, PolyFlags, iPaletteRow);
+            if (!m_pTextureCache->IsPrepared(*Surface.Texture, 0, bPaletteIndices))
             {
                 Render();
             }
-            pTexDiffuse = &m_pTextureCache->FindOrInsertAndPrepare(*Surface.Texture, 0, PolyFlags);
+            pTexDiffuse = &m_pTextureCache->FindOrInsertAndPrepare(*Surface.Texture, 0, PolyFlags, bPaletteIndices);
             TexFlags |= 0x00000001;
+            if (bPaletteIndices)
+                TexFlags |= 0x00000020 | (iPaletteRow << 16);
         }
 
-        const TextureConverter::TextureData* pTexLight = nullptr;
-        if (Surface.LightMap)
+        // Only the original path samples lightmaps. They're packed in atlas pages, so surfaces with different lightmaps share a batch.
+        const bool bUseLightMap = Surface.LightMap && (TexFlags & 0x00000004);
+        LightmapAtlas::Placement LightMapPlacement = {};
+        if (bUseLightMap)
         {
-            if (!m_pTextureCache->IsPrepared(*Surface.LightMap, 1))
+            if (m_pTextureCache->FindOrInsertLightmap(*Surface.LightMap, LightMapPlacement))
             {
-                Render();
+                if (!m_pTextureCache->IsLightmapPagePrepared(LightMapPlacement.iPage, 1))
+                {
+                    Render();
+                }
+                m_pTextureCache->PrepareLightmapPage(LightMapPlacement.iPage, 1);
+            }
+            else
+            {
+                if (!m_pTextureCache->IsPrepared(*Surface.LightMap, 1))
+                {
+                    Render();
+                }
+                const TextureConverter::TextureData& TexLight = m_pTextureCache->FindOrInsertAndPrepare(*Surface.LightMap, 1, PolyFlags);
+                LightMapPlacement.fMultU = TexLight.fMultU;
+                LightMapPlacement.fMultV = TexLight.fMultV;
             }
-            pTexLight = &m_pTextureCache->FindOrInsertAndPrepare(*Surface.LightMap, 1, PolyFlags);
             TexFlags |= 0x00000002;
         }
 
-        const TextureConverter::TextureData* pTexFogMap = nullptr;
+        // Fog maps of volumetric lighting change all the time, they're streamed through pool pages shared by many surfaces
+        FogMapPool::Placement FogMapPlacement = {};
         if (Surface.FogMap)
         {
-            if (!m_pTextureCache->IsPrepared(*Surface.FogMap, 1)) // using slot for lightmap, otherwise we get a flicker of fog
+            if (m_pTextureCache->FindOrInsertFogMap(*Surface.FogMap, FogMapPlacement))
             {
-                Render();
+                if (!m_pTextureCache->IsFogMapPagePrepared(FogMapPlacement.iPage, 2))
+                {
+                    Render();
+                }
+                m_pTextureCache->PrepareFogMapPage(FogMapPlacement.iPage, 2);
+            }
+            else
+            {
+                if (!m_pTextureCache->IsPrepared(*Surface.FogMap, 2))
+                {
+                    Render();
+                }
+                const TextureConverter::TextureData& TexFogMap = m_pTextureCache->FindOrInsertAndPrepare(*Surface.FogMap, 2, PolyFlags);
+                FogMapPlacement.fMultU = TexFogMap.fMultU;
+                FogMapPlacement.fMultV = TexFogMap.fMultV;
             }
-            pTexFogMap = &m_pTextureCache->FindOrInsertAndPrepare(*Surface.FogMap, 2, PolyFlags);
             TexFlags |= 0x00000010;
         }
 
-        // TO-DO
-        const auto& Poly = *Facet.Polys;
-        const int surfId = pFrame->Level->Model->Nodes(Poly.iNode).iSurf;
-        if (surfId >= 0)
-        {
-            const int mapId = pFrame->Level->Model->Surfs(surfId).iLightMap;
-            if (mapId >= 0)
-                m_pOcclusionMapCache->FindOrInsertAndPrepare(*pFrame->Level->Model, mapId);
-        }        
-
         if (waterFlag)
             m_pComplexSurfaceRenderer->SetDrawMode(ComplexSurfaceRenderer::DM_Water);        
         else
@@ -317,6 +572,7 @@ public:
             m_pGlobalShaderConstants->CheckViewChange(*pFrame, *Facet.Polys);
             m_pGlobalShaderConstants->SetComplexPoly(*pFrame, *Facet.Polys);
         }
+        const uint32_t iSurfaceOffset = m_pGlobalShaderConstants->GetComplexPolyOffset(); // lights and shading map are read through the vertices, so surfaces share batches
 
         m_pDeviceState->PrepareDepthStencilState(DepthStencilState);
         m_pDeviceState->PrepareBlendState(BlendState);
@@ -355,11 +611,11 @@ public:
                 v.TexCoords.x = (UCoord - Surface.Texture->Pan.X) * pTexDiffuse->fMultU;
                 v.TexCoords.y = (VCoord - Surface.Texture->Pan.Y) * pTexDiffuse->fMultV;
 
-                if (Surface.LightMap)
+                if (bUseLightMap)
                 {
                     // Lightmaps require pan correction of -.5
-                    v.TexCoords1.x = (UCoord - (Surface.LightMap->Pan.X - 0.5f * Surface.LightMap->UScale)) * pTexLight->fMultU;
-                    v.TexCoords1.y = (VCoord - (Surface.LightMap->Pan.Y - 0.5f * Surface.LightMap->VScale)) * pTexLight->fMultV;
+                    v.TexCoords1.x = (UCoord - (Surface.LightMap->Pan.X - 0.5f * Surface.LightMap->UScale)) * LightMapPlacement.fMultU + LightMapPlacement.fOffsetU;
+                    v.TexCoords1.y = (VCoord - (Surface.LightMap->Pan.Y - 0.5f * Surface.LightMap->VScale)) * LightMapPlacement.fMultV + LightMapPlacement.fOffsetV;
                 }
                 //if (Surface.DetailTexture)
                 //{
@@ -369,8 +625,8 @@ public:
                 if (Surface.FogMap)
                 {
                     //Fogmaps require pan correction of -.5
-                    v.TexCoords2.x = (UCoord - (Surface.FogMap->Pan.X - 0.5f * Surface.FogMap->UScale)) * pTexFogMap->fMultU;
-                    v.TexCoords2.y = (VCoord - (Surface.FogMap->Pan.Y - 0.5f * Surface.FogMap->VScale)) * pTexFogMap->fMultV;
+                    v.TexCoords2.x = (UCoord - (Surface.FogMap->Pan.X - 0.5f * Surface.FogMap->UScale)) * FogMapPlacement.fMultU + FogMapPlacement.fOffsetU;
+                    v.TexCoords2.y = (VCoord - (Surface.FogMap->Pan.Y - 0.5f * Surface.FogMap->VScale)) * FogMapPlacement.fMultV + FogMapPlacement.fOffsetV;
                 }
                 //if (Surface.MacroTexture)
                 //{
@@ -382,6 +638,7 @@ public:
                 v.Pos = reinterpret_cast<decltype(v.Pos)&>(Poly.Pts[i]->Point);
                 v.PolyFlags = PolyFlags;
                 v.TexFlags = TexFlags;
+                v.SurfaceOffset = iSurfaceOffset;
             }
         }
     }
@@ -506,6 +763,7 @@ public:
     virtual void ClearZ(FSceneNode* const pFrame) override
     {
         Render();
+        ResolveDynamicLights(); // depth buffer is needed to resolve dynamic lights
         m_Backend.ClearDepth();
     }
 
@@ -530,7 +788,66 @@ public:
         PrintFunc(L"Tiles | Buffer fill: %Iu/%Iu. Draw calls: %Iu.", m_pTileRenderer->GetNumTiles(), m_pTileRenderer->GetMaxTiles(), m_pTileRenderer->GetNumDraws());
         PrintFunc(L"Gouraud | Buffer fill: %Iu/%Iu. Draw calls: %Iu.", m_pGouraudRenderer->GetNumIndices(), m_pGouraudRenderer->GetMaxIndices(), m_pGouraudRenderer->GetNumDraws());
         PrintFunc(L"Complex | Buffer fill: %Iu/%Iu. Draw calls: %Iu.", m_pComplexSurfaceRenderer->GetNumIndices(), m_pComplexSurfaceRenderer->GetMaxIndices(), m_pComplexSurfaceRenderer->GetNumDraws());
-        PrintFunc(L"TexCache | Num: %Iu.", m_pTextureCache->GetNumTextures());
+        PrintFunc(L"TexCache | Num: %Iu. Memory: %Iu KB. Saved by compression: %Iu KB. Compressed: %Iu. From disk cache: %Iu. Palettes: %Iu (updated %Iu).",
+            m_pTextureCache->GetNumTextures(),
+            m_pTextureCache->GetNumBytes() / 1024,
+            m_pTextureCache->GetNumBytesSaved() / 1024,
+            m_pTextureCache->GetNumCompressed(),
+            m_pTextureCache->GetNumLoadedFromCache(),
+            m_pTextureCache->GetNumPalettes(),
+            m_pTextureCache->GetNumPaletteUpdates());
+        PrintFunc(L"TexCache | Budget: %Iu MB. Evicted: %Iu. Reloaded: %Iu. Since level change reused: %Iu, rebuilt: %Iu. Lazy loads: %Iu.",
+            m_pTextureCache->GetBudget() / (1024 * 1024),
+            m_pTextureCache->GetNumEvictions(),
+            m_pTextureCache->GetNumReloads(),
+            m_pTextureCache->GetNumReused(),
+            m_pTextureCache->GetNumRebuilt(),
+            m_pTextureCache->GetNumLazyLoads());
+        PrintFunc(L"TexCache | Streaming: %s. Textures streaming: %Iu. Created by workers: %Iu (%.2f ms after the miss on average).",
+            m_pTextureCache->GetStreaming() ? m_pTextureCache->GetAsyncCreation() ? L"async" : L"on" : L"off",
+            m_pTextureCache->GetNumStreaming(),
+            m_pTextureCache->GetNumAsyncCommits(),
+            m_pTextureCache->GetAverageAsyncLatencyMs());
+        PrintFunc(L"Lightmaps | Atlas: %s. Pages: %Iu. Packed: %Iu. Atlas full: %Iu times, lightmaps on their own: %Iu.",
+            m_pTextureCache->GetLightmapAtlas() ? L"on" : L"off",
+            m_pTextureCache->GetNumLightmapPages(),
+            m_pTextureCache->GetNumAtlasLightmaps(),
+            m_pTextureCache->GetNumLightmapAtlasResets(),
+            m_pTextureCache->GetNumLightmapFallbacks());
+        PrintFunc(L"Fog maps | Pool: %s. Pooled this frame: %Iu. Page uploads: %Iu (%Iu KB). Left to the cache: %Iu.",
+            m_pTextureCache->GetFogMapPool() ? L"on" : L"off",
+            m_pTextureCache->GetNumPooledFogMaps(),
+            m_pTextureCache->GetNumFogMapUploads(),
+            m_pTextureCache->GetNumFogMapUploadedBytes() / 1024,
+            m_pTextureCache->GetNumFogMapFallbacks());
+        PrintFunc(L"TexCache | Overrides: %Iu indexed, %Iu loaded.",
+            m_pTextureCache->GetNumOverrides(),
+            m_pTextureCache->GetNumOverridesLoaded());
+        PrintFunc(L"Jobs | Threads: %Iu. Queued: %Iu. Pending: %Iu. Started this frame: %Iu (stolen %Iu). Queue latency: %.3f ms avg, %.3f ms max.",
+            m_pJobSystem->GetNumThreads(),
+            m_pJobSystem->GetQueueDepth(),
+            m_pJobSystem->GetNumPending(),
+            m_pJobSystem->GetNumStarted(),
+            m_pJobSystem->GetNumStolen(),
+            m_pJobSystem->GetAverageLatencyMs(),
+            m_pJobSystem->GetMaxLatencyMs());
+        PrintFunc(L"Realtime textures | Updates: %Iu. Uploaded: %Iu KB. Game thread: %.2f ms.",
+            m_pTextureCache->GetNumRealtimeUpdates(),
+            m_pTextureCache->GetNumRealtimeBytes() / 1024,
+            m_pTextureCache->GetRealtimeTimeMs());
+        PrintFunc(L"StaticLights | Culled by per-surface cap: %Iu.", m_pGlobalShaderConstants->GetNumCulledLights());
+        PrintFunc(L"Occlusion | Source: %s. Maps: %Iu (pending %Iu) in %Iu atlas pages. Memory: %Iu KB. Game thread: %.2f ms. Level build: %.2f ms.",
+            m_pOcclusionMapCache->GetUseLightBits() ? L"light bits" : m_pOcclusionMapCache->IsLoadedFromCache() ? L"cached maps" : L"maps",
+            m_pOcclusionMapCache->GetNumMaps(),
+            m_pOcclusionMapCache->GetNumBuildPending(),
+            m_pOcclusionMapCache->GetNumPages(),
+            m_pOcclusionMapCache->GetNumBytes() / 1024,
+            m_pOcclusionMapCache->GetConversionTimeMs(),
+            m_pOcclusionMapCache->GetLevelBuildTimeMs());
+        if (m_pDynamicLightRenderer)
+            PrintFunc(L"DynamicLights | Resolution: 1/%u. Resolves: %Iu.", m_pDynamicLightRenderer->GetResolutionDivider(), m_pDynamicLightRenderer->GetNumResolves());
+        for (const auto& [pszName, Usage] : GetMemoryUsage())
+            PrintFunc(L"Memory | %s: CPU %Iu KB. GPU %Iu KB. Objects: %Iu.", pszName, Usage.iCPUBytes / 1024, Usage.iGPUBytes / 1024, Usage.iNumObjects);
 
         m_pTextureCache->PrintSizeHistogram(*Viewport->Canvas);
     }
@@ -554,8 +871,10 @@ public:
 
         if (m_pGlobalShaderConstants->CheckLevelChange(*pFrame))
         {
-            m_pTextureCache->Flush(); // При смене уровня сбрасываем кэш текстур, иначе артефакты (на разных уровнях одинаковые текстуры используют разный Id?)
+            Utils::LogMessagef(L"Level textures: %Iu KB, saved by compression: %Iu KB.", m_pTextureCache->GetNumBytes() / 1024, m_pTextureCache->GetNumBytesSaved() / 1024);
+            m_pTextureCache->FlushLevel(); // При смене уровня сбрасываем кэш текстур, иначе артефакты (на разных уровнях одинаковые текстуры используют разный Id?)
             m_pOcclusionMapCache->Flush();
+            m_pOcclusionMapCache->BuildLevel(*pFrame->Level->Model, GetAssetCachePath(*pFrame)); // maps are built on the workers, placeholder is used until they are ready
         }
         m_pGlobalShaderConstants->CheckProjectionChange(*pFrame);
     }
@@ -570,6 +889,130 @@ public:
             //m_pTextureCache->PrintSizeHistogram();
         }
 
+        const TCHAR* pStr = Cmd;
+        if (ParseCommand(&pStr, L"dynamiclightsres"))
+        {
+            try
+            {
+                SetDynamicLightsResolution(appAtoi(pStr));
+            }
+            catch (const Utils::ComException& ex)
+            {
+                Utils::LogWarningf(L"Exception: %s", ex.what());
+            }
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"occlusionbench"))
+        {
+            double referenceMs, simdMs;
+            bool bIdentical;
+            if (m_pOcclusionMapCache->BenchmarkConversion(referenceMs, simdMs, bIdentical))
+                Ar.Logf(L"Occlusion map conversion: reference %.3f ms, SIMD %.3f ms, results %s.", referenceMs, simdMs, bIdentical ? L"identical" : L"DIFFERENT");
+            else
+                Ar.Logf(L"Occlusion map conversion: no level rendered yet.");
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"texbench"))
+        {
+            double referenceMs, simdMs;
+            const bool bIdentical = m_pTextureCache->BenchmarkP8Conversion(referenceMs, simdMs);
+            Ar.Logf(L"P8 texture conversion: reference %.3f ms, SIMD %.3f ms, results %s.", referenceMs, simdMs, bIdentical ? L"identical" : L"DIFFERENT");
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"texcompression"))
+        {
+            char szMode[16];
+            sprintf_s(szMode, "%S", pStr);
+            SetTextureCompression(szMode);
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"palettetextures"))
+        {
+            SetPaletteTextures(appAtoi(pStr) != 0);
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"texbudget"))
+        {
+            SetTextureBudget(appAtoi(pStr));
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"texstreaming"))
+        {
+            FlushTextureCache([=](TextureCache& Cache)
+            {
+                Cache.Flush();
+                Cache.SetStreaming(appAtoi(pStr) != 0, Cache.GetStreamingBudget());
+            });
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"lightmapatlas"))
+        {
+            FlushTextureCache([=](TextureCache& Cache) { Cache.SetLightmapAtlas(appAtoi(pStr) != 0); });
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"fogmappool"))
+        {
+            FlushTextureCache([=](TextureCache& Cache) { Cache.SetFogMapPool(appAtoi(pStr) != 0); });
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"texasync"))
+        {
+            FlushTextureCache([=](TextureCache& Cache)
+            {
+                Cache.Flush();
+                Cache.SetAsyncCreation(appAtoi(pStr) != 0);
+            });
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"texhitches"))
+        {
+            m_pTextureCache->LogHitchHistogram();
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"decormem"))
+        {
+            for (const auto& [pszName, Usage] : GetMemoryUsage())
+                Ar.Logf(L"%s: CPU %Iu KB, GPU %Iu KB, %Iu objects.", pszName, Usage.iCPUBytes / 1024, Usage.iGPUBytes / 1024, Usage.iNumObjects);
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"srgb"))
+        {
+            try
+            {
+                SetSRGB(appAtoi(pStr) != 0);
+            }
+            catch (const Utils::ComException& ex)
+            {
+                Utils::LogWarningf(L"Exception: %s", ex.what());
+            }
+            return 1;
+        }
+
+        if (ParseCommand(&pStr, L"occlusionbits"))
+        {
+            try
+            {
+                SetOcclusionLightBits(appAtoi(pStr) != 0);
+            }
+            catch (const Utils::ComException& ex)
+            {
+                Utils::LogWarningf(L"Exception: %s", ex.what());
+            }
+            return 1;
+        }
+
         return URenderDevice::Exec(Cmd, Ar);
     }
 };
@@ -0,0 +1,330 @@
+﻿module;
+
+#include <D3D11.h>
+#include <vector>
+#include <array>
+#include <unordered_map>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <wrl\client.h>
+
+#include <Engine.h>
+
+export module DeusEx.FogMapPool;
+
+import Utils;
+
+using Microsoft::WRL::ComPtr;
+
+/// <summary>
+/// Fog maps of volumetric lighting, which the engine regenerates all the time. They're packed anew every frame into a ring of dynamic pages:
+/// fog maps are copied to the system memory copy of the open page, which is uploaded with one Map(DISCARD) right before a draw needs it.
+/// After an upload the next page of the ring is opened, so a page is uploaded about once per frame; renaming on discard keeps draws already issued intact.
+/// </summary>
+export class FogMapPool
+{
+public:
+    static const UINT sm_iPageSize = 512;
+    static const UINT sm_iNumPages = 4;
+    static const UINT sm_iMaxFogMapSize = 128; // Larger fog maps are left to the texture cache
+
+    /// <summary>
+    /// Where a fog map is: texture coordinates in the page are (U - Pan) * Mult + Offset
+    /// </summary>
+    struct Placement
+    {
+        UINT iPage;
+        float fMultU;
+        float fMultV;
+        float fOffsetU;
+        float fOffsetV;
+    };
+
+    explicit FogMapPool(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext)
+        : m_DeviceContext(DeviceContext)
+    {
+        D3D11_TEXTURE2D_DESC TextureDesc;
+        TextureDesc.Width = sm_iPageSize;
+        TextureDesc.Height = sm_iPageSize;
+        TextureDesc.MipLevels = 1;
+        TextureDesc.ArraySize = 1;
+        TextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_TYPELESS;
+        TextureDesc.SampleDesc.Count = 1;
+        TextureDesc.SampleDesc.Quality = 0;
+        TextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_DYNAMIC;
+        TextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+        TextureDesc.CPUAccessFlags = D3D11_CPU_ACCESS_FLAG::D3D11_CPU_ACCESS_WRITE;
+        TextureDesc.MiscFlags = 0;
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
+        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
+        ShaderResourceViewDesc.Texture2D.MipLevels = 1;
+        ShaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+
+        for (Page& CurrentPage : m_Pages)
+        {
+            Utils::ThrowIfFailed(
+                Device.CreateTexture2D(&TextureDesc, nullptr, &CurrentPage.pTexture),
+                "Failed to create fog map page."
+            );
+            Utils::SetResourceName(CurrentPage.pTexture, "Fog maps");
+
+            ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM;
+            Utils::ThrowIfFailed(
+                Device.CreateShaderResourceView(CurrentPage.pTexture.Get(), &ShaderResourceViewDesc, &CurrentPage.pShaderResourceView),
+                "Failed to create fog map page SRV."
+            );
+            Utils::SetResourceName(CurrentPage.pShaderResourceView, "Fog maps");
+
+            ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+            Utils::ThrowIfFailed(
+                Device.CreateShaderResourceView(CurrentPage.pTexture.Get(), &ShaderResourceViewDesc, &CurrentPage.pShaderResourceViewSRGB),
+                "Failed to create fog map page sRGB SRV."
+            );
+            Utils::SetResourceName(CurrentPage.pShaderResourceViewSRGB, "Fog maps sRGB");
+
+            CurrentPage.Shadow.resize(sm_iPageSize * sm_iPageSize);
+        }
+    }
+
+    FogMapPool(const FogMapPool&) = delete;
+    FogMapPool& operator=(const FogMapPool&) = delete;
+
+    static bool CanPool(const FTextureInfo& FogMap)
+    {
+        return FogMap.Format == ETextureFormat::TEXF_RGBA7 && FogMap.NumMips > 0 && FogMap.Mips[0]
+            && FogMap.UClamp > 0 && FogMap.VClamp > 0 && FogMap.UClamp <= static_cast<INT>(sm_iMaxFogMapSize) && FogMap.VClamp <= static_cast<INT>(sm_iMaxFogMapSize);
+    }
+
+    /// <summary>
+    /// Copies the fog map into the open page, unless it's already there this frame and unchanged. The mips must be loaded.
+    /// Returns false if all pages hold fog maps not uploaded yet.
+    /// </summary>
+    bool FindOrInsert(FTextureInfo& FogMap, Placement& Out)
+    {
+        assert(CanPool(FogMap));
+
+        auto it = m_Entries.find(FogMap.CacheID);
+        if (it != m_Entries.end() && !FogMap.bRealtimeChanged)
+        {
+            Out = GetPlacement(FogMap, it->second);
+            return true;
+        }
+
+        const UINT iWidth = FogMap.UClamp + 2;
+        const UINT iHeight = FogMap.VClamp + 2;
+        if (!Allocate(m_Pages[m_iOpenPage], iWidth, iHeight))
+        {
+            if (!OpenNextPage())
+            {
+                m_iNumFallbacks++;
+                return false;
+            }
+            const bool bAllocated = Allocate(m_Pages[m_iOpenPage], iWidth, iHeight);
+            assert(bAllocated); // A fresh page fits any fog map
+        }
+
+        Page& OpenPage = m_Pages[m_iOpenPage];
+        const Entry NewEntry = { m_iOpenPage, OpenPage.iShelfX - iWidth, OpenPage.iShelfY };
+        Copy(FogMap, OpenPage, NewEntry);
+        OpenPage.bDirty = true;
+        FogMap.bRealtimeChanged = 0;
+
+        m_Entries.insert_or_assign(FogMap.CacheID, NewEntry);
+        m_iNumFogMaps++;
+        Out = GetPlacement(FogMap, NewEntry);
+        return true;
+    }
+
+    /// <summary>
+    /// Uploads the pages fog maps were added to since their last upload, and moves on from the open page if it was one. Call before drawing.
+    /// </summary>
+    void Commit()
+    {
+        const bool bOpenPageDirty = m_Pages[m_iOpenPage].bDirty;
+        for (Page& CurrentPage : m_Pages)
+        {
+            if (CurrentPage.bDirty)
+            {
+                Upload(CurrentPage);
+            }
+        }
+
+        if (bOpenPageDirty)
+        {
+            OpenNextPage();
+        }
+    }
+
+    void NewFrame()
+    {
+        m_Entries.clear();
+        for (Page& CurrentPage : m_Pages)
+        {
+            CurrentPage.iShelfX = CurrentPage.iShelfY = CurrentPage.iShelfHeight = 0;
+            CurrentPage.bDirty = false;
+        }
+
+        m_iNumFogMaps = 0;
+        m_iNumUploads = 0;
+        m_iNumUploadedBytes = 0;
+        m_iNumFallbacks = 0;
+    }
+
+    ID3D11ShaderResourceView* GetPageSRV(const UINT iPage) const
+    {
+        return m_bSRGB ? m_Pages[iPage].pShaderResourceViewSRGB.Get() : m_Pages[iPage].pShaderResourceView.Get();
+    }
+
+    void SetSRGB(const bool bSRGB) { m_bSRGB = bSRGB; }
+
+    //Diagnostics, per frame
+    size_t GetNumFogMaps() const { return m_iNumFogMaps; }
+    size_t GetNumUploads() const { return m_iNumUploads; }
+    size_t GetNumUploadedBytes() const { return m_iNumUploadedBytes; }
+    size_t GetNumFallbacks() const { return m_iNumFallbacks; } // Fog maps left to the texture cache as the ring was full
+
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage;
+        for (const Page& CurrentPage : m_Pages)
+        {
+            Usage.iCPUBytes += CurrentPage.Shadow.capacity() * sizeof(DWORD);
+        }
+        Usage.iGPUBytes = m_Pages.size() * sm_iPageSize * sm_iPageSize * sizeof(DWORD);
+        Usage.iNumObjects = m_Pages.size();
+        return Usage;
+    }
+
+protected:
+    struct Entry
+    {
+        UINT iPage;
+        UINT iX; // Top left of the border
+        UINT iY;
+    };
+
+    struct Page
+    {
+        ComPtr<ID3D11Texture2D> pTexture;
+        ComPtr<ID3D11ShaderResourceView> pShaderResourceView;
+        ComPtr<ID3D11ShaderResourceView> pShaderResourceViewSRGB;
+        std::vector<DWORD> Shadow; // Contents written by the next upload
+        UINT iShelfX = 0;
+        UINT iShelfY = 0;
+        UINT iShelfHeight = 0;
+        bool bDirty = false;
+    };
+
+    /// <summary>
+    /// Writes the system memory copy to the page; discard leaves the page undefined, so all rows used so far are written
+    /// </summary>
+    void Upload(Page& Target)
+    {
+        D3D11_MAPPED_SUBRESOURCE Mapped;
+        Utils::ThrowIfFailed(
+            m_DeviceContext.Map(Target.pTexture.Get(), 0, D3D11_MAP_WRITE_DISCARD, 0, &Mapped),
+            "Failed to map fog map page."
+        );
+        const UINT iNumRows = std::min(Target.iShelfY + Target.iShelfHeight, sm_iPageSize);
+        for (UINT y = 0; y < iNumRows; y++)
+        {
+            memcpy(static_cast<BYTE*>(Mapped.pData) + y * Mapped.RowPitch, &Target.Shadow[y * sm_iPageSize], sm_iPageSize * sizeof(DWORD));
+        }
+        m_DeviceContext.Unmap(Target.pTexture.Get(), 0);
+
+        Target.bDirty = false;
+        m_iNumUploads++;
+        m_iNumUploadedBytes += iNumRows * sm_iPageSize * sizeof(DWORD);
+    }
+
+    static Placement GetPlacement(const FTextureInfo& FogMap, const Entry& Placed)
+    {
+        Placement Out;
+        Out.iPage = Placed.iPage;
+        Out.fMultU = 1.0f / (FogMap.UScale * sm_iPageSize);
+        Out.fMultV = 1.0f / (FogMap.VScale * sm_iPageSize);
+        Out.fOffsetU = static_cast<float>(Placed.iX + 1) / sm_iPageSize;
+        Out.fOffsetV = static_cast<float>(Placed.iY + 1) / sm_iPageSize;
+        return Out;
+    }
+
+    /// <summary>
+    /// Appends to the current shelf of the page, starting a new one below if the row is full. Pages are packed once per frame, so one shelf at a time does.
+    /// </summary>
+    static bool Allocate(Page& Target, const UINT iWidth, const UINT iHeight)
+    {
+        if (Target.iShelfX + iWidth > sm_iPageSize)
+        {
+            Target.iShelfY += Target.iShelfHeight;
+            Target.iShelfX = 0;
+            Target.iShelfHeight = 0;
+        }
+
+        if (Target.iShelfY + iHeight > sm_iPageSize)
+        {
+            return false;
+        }
+
+        Target.iShelfX += iWidth;
+        Target.iShelfHeight = std::max(Target.iShelfHeight, iHeight);
+        return true;
+    }
+
+    /// <summary>
+    /// Opens the next page of the ring. Fog maps still placed in it this frame are forgotten, their draws were issued with the old contents.
+    /// Fails if the page has fog maps not uploaded yet, draws waiting for them are not issued.
+    /// </summary>
+    bool OpenNextPage()
+    {
+        const UINT iNextPage = (m_iOpenPage + 1) % sm_iNumPages;
+        Page& NextPage = m_Pages[iNextPage];
+        if (NextPage.bDirty)
+        {
+            return false;
+        }
+
+        m_iOpenPage = iNextPage;
+        if (NextPage.iShelfX + NextPage.iShelfY > 0)
+        {
+            std::erase_if(m_Entries, [iNextPage](const auto& Item) { return Item.second.iPage == iNextPage; });
+            NextPage.iShelfX = NextPage.iShelfY = NextPage.iShelfHeight = 0;
+        }
+        return true;
+    }
+
+    /// <summary>
+    /// Copies the fog map with a border replicated from its edge, rows of the Unreal mip are USize texels apart
+    /// </summary>
+    static void Copy(const FTextureInfo& FogMap, Page& Target, const Entry& Placed)
+    {
+        const FMipmapBase& Mip = *FogMap.Mips[0];
+        const UINT iWidth = FogMap.UClamp + 2;
+        const UINT iHeight = FogMap.VClamp + 2;
+        const DWORD* const pSource = reinterpret_cast<const DWORD*>(Mip.DataPtr);
+
+        for (UINT y = 0; y < iHeight; y++)
+        {
+            const INT iSourceY = std::clamp(static_cast<INT>(y) - 1, 0, FogMap.VClamp - 1);
+            const DWORD* const pSourceRow = pSource + iSourceY * Mip.USize;
+            DWORD* const pRow = &Target.Shadow[(Placed.iY + y) * sm_iPageSize + Placed.iX];
+
+            pRow[0] = pSourceRow[0];
+            memcpy(pRow + 1, pSourceRow, FogMap.UClamp * sizeof(DWORD));
+            pRow[iWidth - 1] = pSourceRow[FogMap.UClamp - 1];
+        }
+    }
+
+    ID3D11DeviceContext& m_DeviceContext;
+
+    std::array<Page, sm_iNumPages> m_Pages;
+    UINT m_iOpenPage = 0;
+    std::unordered_map<QWORD, Entry> m_Entries; // Fog maps placed this frame, by cache ID
+    bool m_bSRGB = false;
+
+    size_t m_iNumFogMaps = 0;
+    size_t m_iNumUploads = 0;
+    size_t m_iNumUploadedBytes = 0;
+    size_t m_iNumFallbacks = 0;
+};
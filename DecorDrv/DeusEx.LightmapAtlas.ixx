@@ -0,0 +1,302 @@
+﻿module;
+
+#include <D3D11.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <wrl\client.h>
+
+#include <Engine.h>
+
+export module DeusEx.LightmapAtlas;
+
+import Utils;
+
+using Microsoft::WRL::ComPtr;
+
+/// <summary>
+/// Lightmaps packed into a few large pages, so surfaces with different lightmaps can be drawn in one batch.
+/// Lightmaps are placed on shelves with a texel of border, replicated from the edge, against bleeding of bilinear filtering.
+/// When the pages are full, lightmaps that don't fit keep their own texture until the atlas starts over at the next frame.
+/// </summary>
+export class LightmapAtlas
+{
+public:
+    static const UINT sm_iPageSize = 1024;
+    static const UINT sm_iMaxPages = 8;
+    static const UINT sm_iMaxLightmapSize = 256; // Larger lightmaps keep their own texture
+
+    /// <summary>
+    /// Where a lightmap is: texture coordinates in the page are (U - Pan) * Mult + Offset
+    /// </summary>
+    struct Placement
+    {
+        UINT iPage;
+        float fMultU;
+        float fMultV;
+        float fOffsetU;
+        float fOffsetV;
+    };
+
+    explicit LightmapAtlas(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext)
+        : m_Device(Device)
+        , m_DeviceContext(DeviceContext)
+    {
+    }
+
+    LightmapAtlas(const LightmapAtlas&) = delete;
+    LightmapAtlas& operator=(const LightmapAtlas&) = delete;
+
+    static bool CanPack(const FTextureInfo& LightMap)
+    {
+        return LightMap.Format == ETextureFormat::TEXF_RGBA7 && LightMap.NumMips > 0 && LightMap.Mips[0]
+            && LightMap.UClamp > 0 && LightMap.VClamp > 0 && LightMap.UClamp <= static_cast<INT>(sm_iMaxLightmapSize) && LightMap.VClamp <= static_cast<INT>(sm_iMaxLightmapSize);
+    }
+
+    /// <summary>
+    /// Finds the lightmap, packing and uploading it if it's new or has changed. The mips must be loaded. Returns false if the pages are full.
+    /// </summary>
+    bool FindOrInsert(FTextureInfo& LightMap, Placement& Out)
+    {
+        assert(CanPack(LightMap));
+
+        auto it = m_Entries.find(LightMap.CacheID);
+        if (it != m_Entries.end())
+        {
+            if (LightMap.bRealtimeChanged)
+            {
+                Upload(LightMap, it->second);
+                LightMap.bRealtimeChanged = 0;
+            }
+            Out = GetPlacement(LightMap, it->second);
+            return true;
+        }
+
+        Entry NewEntry;
+        if (!Allocate(LightMap.UClamp + 2, LightMap.VClamp + 2, NewEntry))
+        {
+            m_bFull = true;
+            m_iNumFallbacks++;
+            return false;
+        }
+
+        Upload(LightMap, NewEntry);
+        LightMap.bRealtimeChanged = 0;
+        m_Entries.emplace(LightMap.CacheID, NewEntry);
+        Out = GetPlacement(LightMap, NewEntry);
+        return true;
+    }
+
+    /// <summary>
+    /// Starts over if the pages filled up during the last frame, lightmaps in use are packed again as they're drawn
+    /// </summary>
+    void NewFrame()
+    {
+        if (m_bFull)
+        {
+            Reset();
+            m_iNumResets++;
+        }
+    }
+
+    void Flush()
+    {
+        Reset();
+        m_iNumResets = 0;
+        m_iNumFallbacks = 0;
+    }
+
+    ID3D11ShaderResourceView* GetPageSRV(const UINT iPage) const
+    {
+        return m_bSRGB ? m_Pages[iPage].pShaderResourceViewSRGB.Get() : m_Pages[iPage].pShaderResourceView.Get();
+    }
+
+    void SetSRGB(const bool bSRGB) { m_bSRGB = bSRGB; }
+
+    //Diagnostics
+    size_t GetNumPages() const { return m_Pages.size(); }
+    size_t GetNumLightmaps() const { return m_Entries.size(); }
+    size_t GetNumResets() const { return m_iNumResets; } // Times the atlas was full
+    size_t GetNumFallbacks() const { return m_iNumFallbacks; } // Lightmaps that didn't fit
+
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage;
+        Usage.iCPUBytes = m_UploadBuffer.capacity() * sizeof(DWORD);
+        Usage.iGPUBytes = m_Pages.size() * sm_iPageSize * sm_iPageSize * sizeof(DWORD);
+        Usage.iNumObjects = m_Pages.size();
+        return Usage;
+    }
+
+protected:
+    struct Entry
+    {
+        UINT iPage;
+        UINT iX; // Top left of the border
+        UINT iY;
+    };
+
+    struct Shelf
+    {
+        UINT iY;
+        UINT iHeight;
+        UINT iNextX;
+    };
+
+    struct Page
+    {
+        ComPtr<ID3D11Texture2D> pTexture;
+        ComPtr<ID3D11ShaderResourceView> pShaderResourceView;
+        ComPtr<ID3D11ShaderResourceView> pShaderResourceViewSRGB;
+        std::vector<Shelf> Shelves;
+        UINT iNextY = 0;
+    };
+
+    static Placement GetPlacement(const FTextureInfo& LightMap, const Entry& Placed)
+    {
+        Placement Out;
+        Out.iPage = Placed.iPage;
+        Out.fMultU = 1.0f / (LightMap.UScale * sm_iPageSize);
+        Out.fMultV = 1.0f / (LightMap.VScale * sm_iPageSize);
+        Out.fOffsetU = static_cast<float>(Placed.iX + 1) / sm_iPageSize;
+        Out.fOffsetV = static_cast<float>(Placed.iY + 1) / sm_iPageSize;
+        return Out;
+    }
+
+    /// <summary>
+    /// Places a rectangle on a shelf of its height class, opening a new shelf or page if needed
+    /// </summary>
+    bool Allocate(const UINT iWidth, const UINT iHeight, Entry& Out)
+    {
+        const UINT iShelfHeight = (iHeight + 7) & ~7u; // Height classes keep shelves from wasting too much
+
+        for (UINT iPage = 0; iPage < sm_iMaxPages; iPage++)
+        {
+            if (iPage == m_Pages.size())
+            {
+                CreatePage();
+            }
+
+            Page& CurrentPage = m_Pages[iPage];
+            for (Shelf& CurrentShelf : CurrentPage.Shelves)
+            {
+                if (CurrentShelf.iHeight == iShelfHeight && CurrentShelf.iNextX + iWidth <= sm_iPageSize)
+                {
+                    Out = { iPage, CurrentShelf.iNextX, CurrentShelf.iY };
+                    CurrentShelf.iNextX += iWidth;
+                    return true;
+                }
+            }
+
+            if (CurrentPage.iNextY + iShelfHeight <= sm_iPageSize)
+            {
+                CurrentPage.Shelves.push_back({ CurrentPage.iNextY, iShelfHeight, iWidth });
+                Out = { iPage, 0, CurrentPage.iNextY };
+                CurrentPage.iNextY += iShelfHeight;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// <summary>
+    /// Copies the lightmap with its border, rows of the Unreal mip are USize texels apart
+    /// </summary>
+    void Upload(const FTextureInfo& LightMap, const Entry& Placed)
+    {
+        const FMipmapBase& Mip = *LightMap.Mips[0];
+        const UINT iWidth = LightMap.UClamp + 2;
+        const UINT iHeight = LightMap.VClamp + 2;
+        const DWORD* const pSource = reinterpret_cast<const DWORD*>(Mip.DataPtr);
+
+        m_UploadBuffer.resize(iWidth * iHeight);
+        for (UINT y = 0; y < iHeight; y++)
+        {
+            const INT iSourceY = std::clamp(static_cast<INT>(y) - 1, 0, LightMap.VClamp - 1);
+            const DWORD* const pSourceRow = pSource + iSourceY * Mip.USize;
+            DWORD* const pRow = &m_UploadBuffer[y * iWidth];
+
+            pRow[0] = pSourceRow[0];
+            memcpy(pRow + 1, pSourceRow, LightMap.UClamp * sizeof(DWORD));
+            pRow[iWidth - 1] = pSourceRow[LightMap.UClamp - 1];
+        }
+
+        const D3D11_BOX Box = { Placed.iX, Placed.iY, 0, Placed.iX + iWidth, Placed.iY + iHeight, 1 };
+        m_DeviceContext.UpdateSubresource(m_Pages[Placed.iPage].pTexture.Get(), 0, &Box, m_UploadBuffer.data(), iWidth * sizeof(DWORD), 0);
+    }
+
+    void CreatePage()
+    {
+        Page NewPage;
+
+        D3D11_TEXTURE2D_DESC TextureDesc;
+        TextureDesc.Width = sm_iPageSize;
+        TextureDesc.Height = sm_iPageSize;
+        TextureDesc.MipLevels = 1;
+        TextureDesc.ArraySize = 1;
+        TextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_TYPELESS;
+        TextureDesc.SampleDesc.Count = 1;
+        TextureDesc.SampleDesc.Quality = 0;
+        TextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_DEFAULT;
+        TextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+        TextureDesc.CPUAccessFlags = 0;
+        TextureDesc.MiscFlags = 0;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateTexture2D(&TextureDesc, nullptr, &NewPage.pTexture),
+            "Failed to create lightmap atlas page."
+        );
+        Utils::SetResourceName(NewPage.pTexture, "Lightmap atlas");
+
+        // Lightmaps are sampled like other RGBA textures, so they get an sRGB view too
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
+        ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM;
+        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
+        ShaderResourceViewDesc.Texture2D.MipLevels = 1;
+        ShaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(NewPage.pTexture.Get(), &ShaderResourceViewDesc, &NewPage.pShaderResourceView),
+            "Failed to create lightmap atlas SRV."
+        );
+        Utils::SetResourceName(NewPage.pShaderResourceView, "Lightmap atlas");
+
+        ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(NewPage.pTexture.Get(), &ShaderResourceViewDesc, &NewPage.pShaderResourceViewSRGB),
+            "Failed to create lightmap atlas sRGB SRV."
+        );
+        Utils::SetResourceName(NewPage.pShaderResourceViewSRGB, "Lightmap atlas sRGB");
+
+        m_Pages.push_back(std::move(NewPage));
+    }
+
+    /// <summary>
+    /// Forgets all placements, the page textures are kept
+    /// </summary>
+    void Reset()
+    {
+        m_Entries.clear();
+        for (Page& CurrentPage : m_Pages)
+        {
+            CurrentPage.Shelves.clear();
+            CurrentPage.iNextY = 0;
+        }
+        m_bFull = false;
+    }
+
+    ID3D11Device& m_Device;
+    ID3D11DeviceContext& m_DeviceContext;
+
+    std::vector<Page> m_Pages;
+    std::unordered_map<QWORD, Entry> m_Entries; // By cache ID
+    std::vector<DWORD> m_UploadBuffer; // Reused between uploads
+    bool m_bFull = false;
+    bool m_bSRGB = false;
+
+    size_t m_iNumResets = 0;
+    size_t m_iNumFallbacks = 0;
+};
@@ -2,8 +2,17 @@
 
 #include <D3D11.h>
 #include <vector>
-#include <unordered_map>
 #include <string>
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <cassert>
+#include <immintrin.h>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 #include <wrl\client.h>
 
@@ -12,258 +21,834 @@
 export module DeusEx.OcclusionMapCache;
 
 import Utils;
+import JobSystem;
+import DeusEx.AssetPack;
 
 using Microsoft::WRL::ComPtr;
 
+/// <summary>
+/// Occlusion maps of all shading maps of the level, packed into pages of one texture array (atlas).
+/// Every shading map has a record in a buffer, shader finds its map through the lightmap index.
+/// </summary>
 export class OcclusionMapCache
 {
 public:
-    struct TextureData
+    /// <summary>
+    /// Occlusion of one shading map, built on a worker and copied to its place in the atlas
+    /// </summary>
+    struct MapData
+    {
+        int MapId;
+        std::vector<uint8_t> DataBuffer; // RGBA texels of all slices with their borders, rows of the atlas rectangle
+    };
+
+    explicit OcclusionMapCache(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, JobSystem& Jobs, unsigned int Slot, unsigned int LightBitsSlot, unsigned int RecordsSlot)
+        :m_Device(Device), m_DeviceContext(DeviceContext), m_JobSystem(Jobs), m_Slot(Slot), m_LightBitsSlot(LightBitsSlot), m_RecordsSlot(RecordsSlot)
     {
-        TextureData() {}
-
-        TextureData(const TextureData&) = default;
-        TextureData(TextureData&& Other)
-            : fMultU(Other.fMultU)
-            , fMultV(Other.fMultV)
-            , pTexture(std::move(Other.pTexture))
-            , pShaderResourceView(std::move(Other.pShaderResourceView))
-            , DataBuffer(std::move(Other.DataBuffer))
-            , pSubResourceData(std::move(Other.pSubResourceData))
+        // Every source byte of the light bits expands to 8 texels, the table keeps them as one 64-bit word
+        for (size_t lightByte = 0; lightByte < m_ExpandTable.size(); ++lightByte)
         {
+            uint64_t texels = 0;
+            for (size_t bit = 0; bit < 8; ++bit)
+                texels |= static_cast<uint64_t>(lightByte & (1 << bit) ? MaxLight : MinLight) << (bit * 8);
+            m_ExpandTable[lightByte] = texels;
         }
-        TextureData& operator=(const TextureData&) = delete;
+    }
 
-        float fMultU;
-        float fMultV;
+    OcclusionMapCache(const OcclusionMapCache&) = delete;
+    OcclusionMapCache& operator=(const OcclusionMapCache&) = delete;
 
-        ComPtr<ID3D11Texture2D> pTexture;
-        ComPtr<ID3D11ShaderResourceView> pShaderResourceView;
+    ~OcclusionMapCache()
+    {
+        CancelLevelBuild();
+    }
 
-        std::vector<uint8_t> DataBuffer;
-        std::vector<D3D11_SUBRESOURCE_DATA> pSubResourceData;
-    };
+    /// <summary>
+    /// Binds the atlas, map records and light bits. They don't change while the level is rendered.
+    /// Without records (no level yet) the shader treats every surface as fully lit.
+    /// </summary>
+    void BindMaps()
+    {
+        ID3D11ShaderResourceView* const pAtlasSRV = m_pAtlasSRV.Get();
+        ID3D11ShaderResourceView* const pRecordsSRV = m_pRecordsSRV.Get();
+        ID3D11ShaderResourceView* const pLightBitsSRV = m_pLightBitsSRV.Get();
+        m_DeviceContext.PSSetShaderResources(m_Slot, 1, &pAtlasSRV);
+        m_DeviceContext.PSSetShaderResources(m_RecordsSlot, 1, &pRecordsSRV);
+        m_DeviceContext.PSSetShaderResources(m_LightBitsSlot, 1, &pLightBitsSRV);
+    }
 
-    explicit OcclusionMapCache(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, unsigned int Slot)
-        :m_Device(Device), m_DeviceContext(DeviceContext), m_Slot(Slot)
+    /// <summary>
+    /// Lays out occlusion maps of all shading maps of the level in the atlas and starts building them on the workers.
+    /// Built maps are copied to the atlas by CommitBuiltMaps().
+    /// </summary>
+    /// <param name="cachePath">Asset pack with atlas pages of the level, loaded if it's up to date and written after the build otherwise. Empty - no cache.</param>
+    void BuildLevel(const UModel& Model, const std::wstring& cachePath)
     {
-        m_PreparedId = 0;
-        m_PreparedSRV = nullptr;
+        Flush();
 
-        // Create placeholder texture
-        m_PlaceholderMap.fMultU = 1.0f;
-        m_PlaceholderMap.fMultV = 1.0f;
+        m_pModel = &Model;
+        m_CachePath = cachePath;
+        m_BuildStartTime = std::chrono::high_resolution_clock::now();
+        const auto startTime = m_BuildStartTime;
 
-        D3D11_TEXTURE2D_DESC TextureDesc;
-        TextureDesc.Width = 1;
-        TextureDesc.Height = 1;
-        TextureDesc.MipLevels = 1;
-        TextureDesc.ArraySize = 1;
-        TextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8_UNORM;
-        TextureDesc.SampleDesc.Count = 1;
-        TextureDesc.SampleDesc.Quality = 0;
-        TextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
-        TextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
-        TextureDesc.CPUAccessFlags = 0;
-        TextureDesc.MiscFlags = 0;
+        const size_t numPages = LayoutAtlas(Model);
+        CreateRecords(Model);
 
-        const uint8_t PlaceholderPixel = 0xff;
-        D3D11_SUBRESOURCE_DATA PlaceHolderData;
-        PlaceHolderData.pSysMem = &PlaceholderPixel;
-        PlaceHolderData.SysMemPitch = sizeof(uint8_t);
+        if (m_bUseLightBits)
+        {
+            UploadLightBits(Model);
+            m_ConversionTime += std::chrono::high_resolution_clock::now() - startTime;
+            return;
+        }
 
-        Utils::ThrowIfFailed(
-            m_Device.CreateTexture2D(&TextureDesc, &PlaceHolderData, &m_PlaceholderMap.pTexture),
-            "Failed to create placeholder occlusion map."
-        );
-        Utils::SetResourceName(m_PlaceholderMap.pTexture, "Placeholder occlusion map");
+        if (numPages > 0 && !m_CachePath.empty())
+        {
+            m_iCacheKey = GetCacheKey(Model);
+            if (LoadCachedAtlas(numPages))
+            {
+                m_ConversionTime += std::chrono::high_resolution_clock::now() - startTime;
+                m_BuildTime = m_ConversionTime;
+                return;
+            }
 
-        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
-        ShaderResourceViewDesc.Format = TextureDesc.Format;
-        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
-        ShaderResourceViewDesc.Texture2D.MipLevels = 1;
-        ShaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+            // Committed maps are collected in CPU copies of the pages, to be written to the cache
+            m_PageImages.assign(numPages, std::vector<uint32_t>(AtlasPageSize * AtlasPageSize, 0xffffffff));
+        }
 
-        Utils::ThrowIfFailed(
-            m_Device.CreateShaderResourceView(m_PlaceholderMap.pTexture.Get(), &ShaderResourceViewDesc, &m_PlaceholderMap.pShaderResourceView),
-            "Failed to create placeholder occlusion map SRV."
-        );
-        Utils::SetResourceName(m_PlaceholderMap.pShaderResourceView, "Placeholder occlusion map");
-    }
+        if (numPages > 0)
+            CreateAtlas(numPages, nullptr);
 
-    OcclusionMapCache(const OcclusionMapCache&) = delete;
-    OcclusionMapCache& operator=(const OcclusionMapCache&) = delete;
+        m_bCancelBuild = false;
+        m_iNumBuildPending = Model.LightMap.Num();
+        m_BuildTime = std::chrono::high_resolution_clock::duration::zero();
+        m_ConversionTime += std::chrono::high_resolution_clock::now() - startTime;
+
+        for (int firstMapId = 0; firstMapId < Model.LightMap.Num(); firstMapId += MapsPerJob)
+        {
+            const int lastMapId = std::min(firstMapId + MapsPerJob, Model.LightMap.Num());
+            {
+                std::lock_guard<std::mutex> lock(m_BuiltMapsMutex);
+                m_iNumBuildJobs++;
+            }
+            m_JobSystem.Submit([this, &Model, firstMapId, lastMapId]()
+            {
+                std::vector<MapData> builtMaps;
+                builtMaps.reserve(lastMapId - firstMapId);
+                for (int mapId = firstMapId; mapId < lastMapId && !m_bCancelBuild; ++mapId)
+                    builtMaps.push_back(BuildMapData(Model, mapId));
+
+                std::lock_guard<std::mutex> lock(m_BuiltMapsMutex);
+                for (auto& builtMap : builtMaps)
+                    m_BuiltMaps.push_back(std::move(builtMap));
+                if (--m_iNumBuildJobs == 0)
+                    m_BuildJobsDone.notify_all();
+            });
+        }
+    }
 
-    const TextureData& FindOrInsert(const UModel& Model, const int mapId)
+    /// <summary>
+    /// Copies the maps built on the workers to the atlas, until the time budget of the frame is spent.
+    /// Until then the atlas holds fully lit texels for them.
+    /// </summary>
+    void CommitBuiltMaps(double budgetMs)
     {
-        auto it = m_OcclusionMaps.find(mapId);
-        if (it != m_OcclusionMaps.end())
+        if (m_iNumBuildPending == 0)
+            return;
+
+        const auto startTime = std::chrono::high_resolution_clock::now();
+        const auto budget = std::chrono::duration<double, std::milli>(budgetMs);
+
         {
-            return it->second;
+            std::lock_guard<std::mutex> lock(m_BuiltMapsMutex);
+            while (!m_BuiltMaps.empty())
+            {
+                const MapData& builtMap = m_BuiltMaps.back();
+                if (!builtMap.DataBuffer.empty())
+                {
+                    const MapLayout& layout = m_Layout[builtMap.MapId];
+                    const D3D11_BOX Box = { layout.X, layout.Y, 0, layout.X + layout.Width, layout.Y + layout.Height, 1 };
+                    m_DeviceContext.UpdateSubresource(m_pAtlas.Get(), D3D11CalcSubresource(0, layout.Page, 1), &Box,
+                        builtMap.DataBuffer.data(), layout.Width * sizeof(uint32_t), 0);
+                    m_iNumMaps++;
+
+                    if (!m_PageImages.empty())
+                    {
+                        auto& pageImage = m_PageImages[layout.Page];
+                        for (UINT y = 0; y < layout.Height; ++y)
+                            memcpy(&pageImage[(layout.Y + y) * AtlasPageSize + layout.X], &builtMap.DataBuffer[y * layout.Width * sizeof(uint32_t)], layout.Width * sizeof(uint32_t));
+                    }
+                }
+                m_BuiltMaps.pop_back();
+                m_iNumBuildPending--;
+
+                if (std::chrono::high_resolution_clock::now() - startTime >= budget)
+                    break;
+            }
+
+            if (m_iNumBuildPending == 0)
+                std::vector<MapData>().swap(m_BuiltMaps); // the atlas holds every map now, drop the storage of the queue
         }
 
-        OcclusionMapCache::TextureData NewData = Convert(Model, mapId);
-        const OcclusionMapCache::TextureData& Data = m_OcclusionMaps.emplace(mapId, std::move(NewData)).first->second;
+        const auto endTime = std::chrono::high_resolution_clock::now();
+        m_ConversionTime += endTime - startTime;
+        if (m_iNumBuildPending == 0)
+        {
+            m_BuildTime = endTime - m_BuildStartTime;
+            if (!m_PageImages.empty())
+                WriteCachedAtlas();
+        }
+    }
 
-        return Data;
+    void Flush()
+    {
+        CancelLevelBuild();
+
+        ID3D11ShaderResourceView* const pNullSRV = nullptr;
+        m_DeviceContext.PSSetShaderResources(m_Slot, 1, &pNullSRV); // To be able to release maps
+        m_DeviceContext.PSSetShaderResources(m_RecordsSlot, 1, &pNullSRV);
+        m_DeviceContext.PSSetShaderResources(m_LightBitsSlot, 1, &pNullSRV);
+        m_pAtlasSRV.Reset();
+        m_pAtlas.Reset();
+        m_pRecordsSRV.Reset();
+        m_pRecordsBuffer.Reset();
+        m_pLightBitsSRV.Reset();
+        m_pLightBitsBuffer.Reset();
+        m_Layout.clear();
+        m_PageImages.clear();
+        m_pModel = nullptr;
+        m_bLoadedFromCache = false;
+
+        m_ConversionTime = std::chrono::high_resolution_clock::duration::zero();
+        m_BuildTime = std::chrono::high_resolution_clock::duration::zero();
+        m_iNumBytes = 0;
+        m_iNumMaps = 0;
+        m_iNumPages = 0;
     }
 
-    const TextureData& FindOrInsertAndPrepare(const UModel& Model, const int mapId)
+    /// <summary>
+    /// Switches between occlusion maps, converted on CPU, and raw light bits of the level, sampled by the shader.
+    /// Rebuilds the level, so the cost of the new mode is measured from scratch.
+    /// </summary>
+    void SetUseLightBits(bool useLightBits)
     {
-        const OcclusionMapCache::TextureData& Data = FindOrInsert(Model, mapId);
+        const UModel* pModel = m_pModel;
 
-        m_PreparedSRV = Data.pShaderResourceView.Get();
-        m_PreparedId = mapId;
+        const std::wstring cachePath = m_CachePath;
 
-        return Data;
-    }
+        Flush();
+        m_bUseLightBits = useLightBits;
 
-    bool IsPrepared(const int mapId) const
-    {
-        return m_PreparedId == mapId;
+        if (pModel)
+            BuildLevel(*pModel, cachePath);
     }
 
-    void BindMaps()
+    bool GetUseLightBits() const { return m_bUseLightBits; }
+
+    /// <summary>
+    /// Converts every shading map of the current level with the scalar reference and with the SIMD kernel, without GPU upload
+    /// </summary>
+    /// <param name="bIdentical">Whether the SIMD kernel produced the same texels as the reference</param>
+    /// <returns>false if no level has been rendered since the last flush</returns>
+    bool BenchmarkConversion(double& referenceMs, double& simdMs, bool& bIdentical) const
     {
-        m_DeviceContext.PSSetShaderResources(m_Slot, 1, &m_PreparedSRV);
+        if (!m_pModel)
+            return false;
+
+        const UModel& Model = *m_pModel;
+        const auto mapData = reinterpret_cast<const BYTE*>(Model.LightBits.GetData());
+        std::vector<uint8_t> referencePlane;
+        std::vector<uint8_t> plane;
+        bIdentical = true;
+
+        std::chrono::high_resolution_clock::duration referenceTime = std::chrono::high_resolution_clock::duration::zero();
+        std::chrono::high_resolution_clock::duration simdTime = std::chrono::high_resolution_clock::duration::zero();
+
+        for (int mapId = 0; mapId < Model.LightMap.Num(); ++mapId)
+        {
+            const auto& map = Model.LightMap(mapId);
+            if (map.iLightActors < 0)
+                continue;
+
+            size_t numLights = 0;
+            while (Model.Lights(map.iLightActors + static_cast<int>(numLights)) != nullptr)
+                numLights++;
+
+            const size_t mapSize = map.UClamp * map.VClamp;
+            const size_t bytesPerUClamp = (map.UClamp + 7) / 8;
+            const size_t bytesPerLight = map.VClamp * bytesPerUClamp;
+
+            auto startTime = std::chrono::high_resolution_clock::now();
+            referencePlane.clear();
+            for (size_t lightIndex = 0; lightIndex < numLights; ++lightIndex)
+                ExpandLightBitsReference(&mapData[map.DataOffset + lightIndex * bytesPerLight], bytesPerUClamp, map.UClamp, map.VClamp, referencePlane);
+            referenceTime += std::chrono::high_resolution_clock::now() - startTime;
+
+            startTime = std::chrono::high_resolution_clock::now();
+            plane.resize(numLights * mapSize);
+            for (size_t lightIndex = 0; lightIndex < numLights; ++lightIndex)
+                ExpandLightBits(&mapData[map.DataOffset + lightIndex * bytesPerLight], bytesPerUClamp, map.UClamp, map.VClamp, plane, lightIndex * mapSize);
+            simdTime += std::chrono::high_resolution_clock::now() - startTime;
+
+            bIdentical = bIdentical && referencePlane == plane;
+        }
+
+        referenceMs = std::chrono::duration<double, std::milli>(referenceTime).count();
+        simdMs = std::chrono::duration<double, std::milli>(simdTime).count();
+        return true;
     }
 
-    void Flush()
+    //Diagnostics
+    size_t GetNumMaps() const { return m_iNumMaps; }
+    size_t GetNumPages() const { return m_iNumPages; }
+    size_t GetNumBytes() const { return m_iNumBytes; }
+    double GetConversionTimeMs() const { return std::chrono::duration<double, std::milli>(m_ConversionTime).count(); }
+    double GetLevelBuildTimeMs() const { return std::chrono::duration<double, std::milli>(m_BuildTime).count(); }
+    size_t GetNumBuildPending() const { return m_iNumBuildPending; }
+    bool IsLoadedFromCache() const { return m_bLoadedFromCache; }
+
+    /// <summary>
+    /// GPU resources of the level and the CPU data still held for them: the layout, maps built but not committed yet and page copies for the asset pack
+    /// </summary>
+    Utils::MemoryUsage GetMemoryUsage() const
     {
-        m_PreparedSRV = nullptr;
-        m_DeviceContext.PSSetShaderResources(m_Slot, 1, &m_PreparedSRV); // To be able to release maps
-        m_OcclusionMaps.clear();
+        Utils::MemoryUsage Usage;
+        Usage.iCPUBytes = m_Layout.capacity() * sizeof(MapLayout);
+        for (const auto& pageImage : m_PageImages)
+            Usage.iCPUBytes += pageImage.capacity() * sizeof(uint32_t);
+        {
+            std::lock_guard<std::mutex> lock(m_BuiltMapsMutex);
+            Usage.iCPUBytes += m_BuiltMaps.capacity() * sizeof(MapData);
+            for (const auto& builtMap : m_BuiltMaps)
+                Usage.iCPUBytes += builtMap.DataBuffer.capacity();
+        }
+
+        Usage.iGPUBytes = m_iNumBytes;
+        Usage.iNumObjects = (m_pAtlas ? 1 : 0) + (m_pRecordsBuffer ? 1 : 0) + (m_pLightBitsBuffer ? 1 : 0);
+        return Usage;
     }
 
 protected:
+    static const size_t LightsPerSlice = 4; // occlusion of up to four lights is packed into RGBA channels of one slice
+    static const int MapsPerJob = 32; // shading maps are small, so they are built in groups to keep job overhead low
+    static const UINT AtlasPageSize = 1024;
+    static const UINT SliceBorder = 1; // slices are surrounded by texels of the opposite edge, so linear filtering wraps like on a separate texture
+    static const uint32_t CacheVersion = 2; // must be increased when the content or the layout of the atlas changes
+
+    /// <summary>
+    /// Place of the shading map in the atlas. Slices of the map are laid out in rows inside its rectangle.
+    /// </summary>
+    struct MapLayout
+    {
+        UINT Page = 0;
+        UINT X = 0;
+        UINT Y = 0;
+        UINT Width = 0;
+        UINT Height = 0;
+        UINT SlicesPerRow = 0; // 0 - map has no occlusion data and is fully lit
+    };
+
     const uint8_t MaxLight = 255;
     const uint8_t LowLight = 50;
     const uint8_t MinLight = 2;
 
-    unsigned int m_Slot;
-
     ID3D11Device& m_Device;
     ID3D11DeviceContext& m_DeviceContext;
+    JobSystem& m_JobSystem;
 
-    std::unordered_map<int, TextureData> m_OcclusionMaps;
-
-    int m_PreparedId;
-    ID3D11ShaderResourceView* m_PreparedSRV;
+    unsigned int m_Slot;
+    unsigned int m_LightBitsSlot;
+    unsigned int m_RecordsSlot;
+
+    std::array<uint64_t, 256> m_ExpandTable; // texels of every possible byte of the light bits
+    const UModel* m_pModel = nullptr; // level the cached data belongs to
+
+    // Atlas of the level and the record of every shading map: x - page, y - position in the page (x | y << 16), z - offset in the light bits, w - slices per row
+    std::vector<MapLayout> m_Layout;
+    ComPtr<ID3D11Texture2D> m_pAtlas;
+    ComPtr<ID3D11ShaderResourceView> m_pAtlasSRV;
+    ComPtr<ID3D11Buffer> m_pRecordsBuffer;
+    ComPtr<ID3D11ShaderResourceView> m_pRecordsSRV;
+
+    // Raw light bits of the level, used instead of occlusion maps when m_bUseLightBits is set
+    bool m_bUseLightBits = false;
+    ComPtr<ID3D11Buffer> m_pLightBitsBuffer;
+    ComPtr<ID3D11ShaderResourceView> m_pLightBitsSRV;
+
+    // Level build on the workers: maps built, but not yet copied to the atlas, and the number of maps not committed yet.
+    // Build jobs still running are counted under the mutex, so cancelling waits for them only and not for other work on the job system.
+    mutable std::mutex m_BuiltMapsMutex;
+    std::vector<MapData> m_BuiltMaps;
+    size_t m_iNumBuildJobs = 0;
+    std::condition_variable m_BuildJobsDone;
+    std::atomic<bool> m_bCancelBuild = false;
+    size_t m_iNumBuildPending = 0;
+    std::chrono::high_resolution_clock::time_point m_BuildStartTime;
+    std::chrono::high_resolution_clock::duration m_BuildTime = std::chrono::high_resolution_clock::duration::zero();
+
+    // Asset pack of the level: CPU copies of the atlas pages are kept while the level is built, then written by a worker
+    std::wstring m_CachePath;
+    uint64_t m_iCacheKey = 0;
+    std::vector<std::vector<uint32_t>> m_PageImages;
+    bool m_bLoadedFromCache = false;
+
+    // Time spent on building occlusion data on the game thread and its size since the last flush
+    std::chrono::high_resolution_clock::duration m_ConversionTime = std::chrono::high_resolution_clock::duration::zero();
+    size_t m_iNumBytes = 0;
+    size_t m_iNumMaps = 0;
+    size_t m_iNumPages = 0;
 
-    TextureData Convert(const UModel& Model, const int mapId) const
+    /// <summary>
+    /// Stops building maps of the level and waits for the workers that still use the model
+    /// </summary>
+    void CancelLevelBuild()
     {
-        auto& map = Model.LightMap(mapId);
+        m_bCancelBuild = true;
 
-        if (map.iLightActors < 0)
-            return m_PlaceholderMap;
+        std::unique_lock<std::mutex> lock(m_BuiltMapsMutex);
+        m_BuildJobsDone.wait(lock, [this]() { return m_iNumBuildJobs == 0; });
+        std::vector<MapData>().swap(m_BuiltMaps);
+        m_iNumBuildPending = 0;
+    }
 
-        // Count the number of light sources for this shading map
+    static size_t CountLights(const UModel& Model, const FLightMapIndex& map)
+    {
         size_t numLights = 0;
-        auto lightIndex = map.iLightActors;
-        while (Model.Lights(lightIndex++) != nullptr)
-            numLights++;
+        if (map.iLightActors >= 0)
+        {
+            while (Model.Lights(map.iLightActors + static_cast<int>(numLights)) != nullptr)
+                numLights++;
+        }
+        return numLights;
+    }
 
-        if (numLights == 0)
-            return m_PlaceholderMap;
+    /// <summary>
+    /// Places rectangles of all shading maps in atlas pages with a shelf allocator, the tallest maps first
+    /// </summary>
+    /// <returns>Number of pages</returns>
+    size_t LayoutAtlas(const UModel& Model)
+    {
+        m_Layout.assign(Model.LightMap.Num(), MapLayout());
 
-        OcclusionMapCache::TextureData OutputTexture;
+        for (int mapId = 0; mapId < Model.LightMap.Num(); ++mapId)
+        {
+            const auto& map = Model.LightMap(mapId);
+            const UINT numSlices = static_cast<UINT>((CountLights(Model, map) + LightsPerSlice - 1) / LightsPerSlice);
+            if (numSlices == 0)
+                continue;
+
+            const UINT sliceWidth = map.UClamp + 2 * SliceBorder;
+            const UINT sliceHeight = map.VClamp + 2 * SliceBorder;
+            const UINT slicesPerRow = std::min<UINT>(std::max<UINT>(AtlasPageSize / sliceWidth, 1), numSlices);
+            const UINT numRows = (numSlices + slicesPerRow - 1) / slicesPerRow;
+
+            auto& layout = m_Layout[mapId];
+            layout.Width = slicesPerRow * sliceWidth;
+            layout.Height = numRows * sliceHeight;
+            if (layout.Width > AtlasPageSize || layout.Height > AtlasPageSize)
+            {
+                Utils::LogWarningf(L"Occlusion map %d doesn't fit the atlas page and will be fully lit.", mapId);
+                continue;
+            }
+            layout.SlicesPerRow = slicesPerRow;
+        }
 
-        size_t mapSize = map.UClamp * map.VClamp;
-        OutputTexture.DataBuffer.reserve(numLights * mapSize);
+        std::vector<int> order(m_Layout.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [this](int a, int b) { return m_Layout[a].Height > m_Layout[b].Height; });
 
-        // Reference to the bitmask of the shading maps
-        auto mapData = reinterpret_cast<const BYTE*>(Model.LightBits.GetData());
+        UINT page = 0, shelfY = 0, shelfHeight = 0, x = 0;
+        bool bPageUsed = false;
+        for (const int mapId : order)
+        {
+            auto& layout = m_Layout[mapId];
+            if (layout.SlicesPerRow == 0)
+                continue;
 
-        // The number of bytes that occupies one row in the bitmask of the shading map
-        size_t bytesPerUClamp = (map.UClamp + 7) / 8;
-        // The number of bytes occupied by the shading map for a single light source in the bitmask
-        size_t bytesPerLight = map.VClamp * bytesPerUClamp;
+            if (x + layout.Width > AtlasPageSize)
+            {
+                shelfY += shelfHeight;
+                shelfHeight = 0;
+                x = 0;
+            }
+            if (shelfY + layout.Height > AtlasPageSize)
+            {
+                page++;
+                shelfY = 0;
+                shelfHeight = 0;
+                x = 0;
+            }
+
+            layout.Page = page;
+            layout.X = x;
+            layout.Y = shelfY;
+            x += layout.Width;
+            shelfHeight = std::max(shelfHeight, layout.Height);
+            bPageUsed = true;
+        }
 
-        std::vector<uint8_t> bufferCopy(mapSize);
+        return bPageUsed ? page + 1 : 0;
+    }
 
-        for (size_t lightIndex = 0; lightIndex < numLights; ++lightIndex)
+    void CreateRecords(const UModel& Model)
+    {
+        // Never empty, so the buffer can be created for a level without shading maps
+        std::vector<uint32_t> records(std::max<size_t>(m_Layout.size(), 1) * 4, 0);
+        for (size_t mapId = 0; mapId < m_Layout.size(); ++mapId)
         {
-            for (size_t v = 0; v < map.VClamp; ++v)
-            {
-                size_t uclampCounter = map.UClamp;
-                for (size_t byteIndex = 0; byteIndex < bytesPerUClamp; ++byteIndex)
-                {
-                    auto lightByte = mapData[map.DataOffset + lightIndex * bytesPerLight + v * bytesPerUClamp + byteIndex];
-
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x01 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x02 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x04 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x08 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x10 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x20 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x40 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                    OutputTexture.DataBuffer.push_back(lightByte & 0x80 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
-                }
-            }
+            const auto& layout = m_Layout[mapId];
+            records[mapId * 4 + 0] = layout.Page;
+            records[mapId * 4 + 1] = layout.X | (layout.Y << 16);
+            records[mapId * 4 + 2] = Model.LightMap(static_cast<int>(mapId)).DataOffset;
+            records[mapId * 4 + 3] = layout.SlicesPerRow;
+        }
+
+        D3D11_BUFFER_DESC BufferDesc = {};
+        BufferDesc.ByteWidth = records.size() * sizeof(uint32_t);
+        BufferDesc.Usage = D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
+        BufferDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+
+        D3D11_SUBRESOURCE_DATA BufferData = {};
+        BufferData.pSysMem = records.data();
 
-            auto lightOffset = lightIndex * mapSize;
-            for (size_t i = 0; i < mapSize; ++i)
-                OutputTexture.DataBuffer[lightOffset + i] = LitEdges(OutputTexture.DataBuffer, lightOffset, map.VClamp, map.UClamp, i);
+        Utils::ThrowIfFailed(
+            m_Device.CreateBuffer(&BufferDesc, &BufferData, &m_pRecordsBuffer),
+            "Failed to create occlusion map records buffer."
+        );
+        Utils::SetResourceName(m_pRecordsBuffer, "OcclusionMapRecords");
 
-            // We are not using antializing maps yet
-            /*
-                    std::copy(OutputTexture.DataBuffer.begin() + lightIndex * mapSize,
-                        OutputTexture.DataBuffer.end(),
-                        bufferCopy.begin());
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc = {};
+        ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R32G32B32A32_UINT;
+        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_BUFFER;
+        ShaderResourceViewDesc.Buffer.FirstElement = 0;
+        ShaderResourceViewDesc.Buffer.NumElements = records.size() / 4;
 
-                    for (size_t i = 0; i < mapSize; ++i)
-                        OutputTexture.DataBuffer[lightIndex * mapSize + i] = Antialize(bufferCopy, map.VClamp, map.UClamp, i);
-            */
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(m_pRecordsBuffer.Get(), &ShaderResourceViewDesc, &m_pRecordsSRV),
+            "Failed to create occlusion map records SRV."
+        );
+        Utils::SetResourceName(m_pRecordsSRV, "OcclusionMapRecords");
+
+        m_iNumBytes += BufferDesc.ByteWidth;
+    }
+
+    /// <summary>
+    /// Hash of everything the atlas is built from, so the cache is invalidated when the map changes
+    /// </summary>
+    static uint64_t GetCacheKey(const UModel& Model)
+    {
+        const uint32_t pageSize = AtlasPageSize;
+        uint64_t hash = Utils::HashBytes(&pageSize, sizeof(pageSize));
+        hash = Utils::HashBytes(Model.LightBits.GetData(), Model.LightBits.Num(), hash);
+        for (int mapId = 0; mapId < Model.LightMap.Num(); ++mapId)
+        {
+            const auto& map = Model.LightMap(mapId);
+            const uint32_t mapInfo[] = { static_cast<uint32_t>(map.DataOffset), static_cast<uint32_t>(map.UClamp), static_cast<uint32_t>(map.VClamp), static_cast<uint32_t>(CountLights(Model, map)) };
+            hash = Utils::HashBytes(mapInfo, sizeof(mapInfo), hash);
         }
+        return hash;
+    }
 
+    /// <summary>
+    /// Creates the atlas straight from the memory-mapped pages of the asset pack
+    /// </summary>
+    bool LoadCachedAtlas(size_t numPages)
+    {
+        AssetPack Pack(m_CachePath);
+        if (!Pack.IsOpen() || Pack.GetVersion() != CacheVersion || Pack.GetKey() != m_iCacheKey || Pack.GetNumBlobs() != numPages)
+            return false;
+
+        std::vector<const void*> pages(numPages);
+        for (size_t i = 0; i < numPages; ++i)
+        {
+            if (Pack.GetBlob(i).Size != AtlasPageSize * AtlasPageSize * sizeof(uint32_t))
+                return false;
+            pages[i] = Pack.GetBlob(i).pData;
+        }
+
+        CreateAtlas(numPages, pages.data());
+
+        m_iNumMaps = std::count_if(m_Layout.begin(), m_Layout.end(), [](const MapLayout& layout) { return layout.SlicesPerRow != 0; });
+        m_bLoadedFromCache = true;
+        return true;
+    }
+
+    void WriteCachedAtlas()
+    {
+        m_JobSystem.Submit([pageImages = std::move(m_PageImages), path = m_CachePath, key = m_iCacheKey]()
+        {
+            std::vector<AssetPack::Blob> blobs;
+            for (const auto& pageImage : pageImages)
+                blobs.push_back({ pageImage.data(), pageImage.size() * sizeof(uint32_t) });
+
+            AssetPack::Write(path, CacheVersion, key, blobs); // if it fails, the level is just built again next time
+        });
+        m_PageImages.clear();
+    }
+
+    /// <summary>
+    /// Creates the atlas from the given pages, or fully lit if there are no pages yet
+    /// </summary>
+    void CreateAtlas(size_t numPages, const void* const* ppPages)
+    {
         D3D11_TEXTURE2D_DESC TextureDesc;
-        TextureDesc.Width = map.UClamp; //Texture.UClamp;
-        TextureDesc.Height = map.VClamp; //Texture.VClamp;
-        TextureDesc.MipLevels = 1; //Texture.NumMips;
-        TextureDesc.ArraySize = numLights;
-        TextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8_UNORM;
+        TextureDesc.Width = AtlasPageSize;
+        TextureDesc.Height = AtlasPageSize;
+        TextureDesc.MipLevels = 1;
+        TextureDesc.ArraySize = numPages;
+        TextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM;
         TextureDesc.SampleDesc.Count = 1;
         TextureDesc.SampleDesc.Quality = 0;
-        TextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
+        TextureDesc.Usage = ppPages ? D3D11_USAGE::D3D11_USAGE_IMMUTABLE : D3D11_USAGE::D3D11_USAGE_DEFAULT; // maps of a cached atlas are never committed
         TextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
         TextureDesc.CPUAccessFlags = 0;
         TextureDesc.MiscFlags = 0;
 
-        OutputTexture.pSubResourceData.resize(numLights);
-        for (size_t i = 0; i < numLights; ++i)
+        // Maps not committed yet are fully lit
+        const std::vector<uint32_t> LitPage(ppPages ? 0 : AtlasPageSize * AtlasPageSize, 0xffffffff);
+        std::vector<D3D11_SUBRESOURCE_DATA> PageData(numPages);
+        for (size_t i = 0; i < numPages; ++i)
         {
-            OutputTexture.pSubResourceData[i].pSysMem = &OutputTexture.DataBuffer.data()[i * mapSize];
-            OutputTexture.pSubResourceData[i].SysMemPitch = map.UClamp * sizeof(uint8_t);
-            OutputTexture.pSubResourceData[i].SysMemSlicePitch = mapSize * sizeof(uint8_t);
+            PageData[i].pSysMem = ppPages ? ppPages[i] : LitPage.data();
+            PageData[i].SysMemPitch = AtlasPageSize * sizeof(uint32_t);
+            PageData[i].SysMemSlicePitch = 0;
         }
 
-        auto texName = std::wstring(L"OcclusionMap") + std::to_wstring(mapId);
-        const wchar_t* const pszTexName = texName.c_str();
-
         Utils::ThrowIfFailed(
-            m_Device.CreateTexture2D(&TextureDesc, OutputTexture.pSubResourceData.data(), &OutputTexture.pTexture),
-            "Failed to create texture '%s'.", pszTexName
+            m_Device.CreateTexture2D(&TextureDesc, PageData.data(), &m_pAtlas),
+            "Failed to create occlusion map atlas."
         );
-        Utils::SetResourceNameW(OutputTexture.pTexture, pszTexName);
+        Utils::SetResourceName(m_pAtlas, "OcclusionMapAtlas");
 
         D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
         ShaderResourceViewDesc.Format = TextureDesc.Format;
         ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
         ShaderResourceViewDesc.Texture2DArray.MostDetailedMip = 0;
-        ShaderResourceViewDesc.Texture2DArray.MipLevels = TextureDesc.MipLevels;
+        ShaderResourceViewDesc.Texture2DArray.MipLevels = 1;
         ShaderResourceViewDesc.Texture2DArray.FirstArraySlice = 0;
-        ShaderResourceViewDesc.Texture2DArray.ArraySize = numLights;
+        ShaderResourceViewDesc.Texture2DArray.ArraySize = numPages;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(m_pAtlas.Get(), &ShaderResourceViewDesc, &m_pAtlasSRV),
+            "Failed to create occlusion map atlas SRV."
+        );
+        Utils::SetResourceName(m_pAtlasSRV, "OcclusionMapAtlas");
+
+        m_iNumPages = numPages;
+        m_iNumBytes += numPages * AtlasPageSize * AtlasPageSize * sizeof(uint32_t);
+    }
+
+    /// <summary>
+    /// Uploads the whole Model.LightBits once, shader finds the shading map by its DataOffset
+    /// </summary>
+    void UploadLightBits(const UModel& Model)
+    {
+        // Buffer<uint> is used as the byte address buffer, so the size is padded to whole words (and never empty)
+        const size_t numBytes = Model.LightBits.Num();
+        std::vector<uint32_t> words((numBytes + sizeof(uint32_t) - 1) / sizeof(uint32_t) + 1, 0);
+        if (numBytes > 0)
+            memcpy(words.data(), Model.LightBits.GetData(), numBytes);
+
+        D3D11_BUFFER_DESC BufferDesc = {};
+        BufferDesc.ByteWidth = words.size() * sizeof(uint32_t);
+        BufferDesc.Usage = D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
+        BufferDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+
+        D3D11_SUBRESOURCE_DATA BufferData = {};
+        BufferData.pSysMem = words.data();
 
         Utils::ThrowIfFailed(
-            m_Device.CreateShaderResourceView(OutputTexture.pTexture.Get(), &ShaderResourceViewDesc, &OutputTexture.pShaderResourceView),
-            "Failed to create SRV for '%s'.", pszTexName
+            m_Device.CreateBuffer(&BufferDesc, &BufferData, &m_pLightBitsBuffer),
+            "Failed to create light bits buffer."
         );
-        Utils::SetResourceNameW(OutputTexture.pShaderResourceView, pszTexName);
+        Utils::SetResourceName(m_pLightBitsBuffer, "LightBits");
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc = {};
+        ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R32_UINT;
+        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_BUFFER;
+        ShaderResourceViewDesc.Buffer.FirstElement = 0;
+        ShaderResourceViewDesc.Buffer.NumElements = words.size();
 
-        OutputTexture.fMultU = 1.0f / (map.UClamp * map.UScale);
-        OutputTexture.fMultV = 1.0f / (map.VClamp * map.VScale);
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(m_pLightBitsBuffer.Get(), &ShaderResourceViewDesc, &m_pLightBitsSRV),
+            "Failed to create light bits SRV."
+        );
+        Utils::SetResourceName(m_pLightBitsSRV, "LightBits");
 
-        return OutputTexture;
+        m_iNumBytes += BufferDesc.ByteWidth;
+    }
+
+    /// <summary>
+    /// Builds texels of the map's rectangle in the atlas. Doesn't touch D3D, so it can run on the workers.
+    /// </summary>
+    MapData BuildMapData(const UModel& Model, const int mapId) const
+    {
+        MapData OutputMap;
+        OutputMap.MapId = mapId;
+
+        const MapLayout& layout = m_Layout[mapId];
+        if (layout.SlicesPerRow == 0)
+            return OutputMap;
+
+        auto& map = Model.LightMap(mapId);
+        const size_t numLights = CountLights(Model, map);
+
+        size_t mapSize = map.UClamp * map.VClamp;
+
+        // Occlusion of every light is expanded into its own plane first, then planes are interleaved into slices
+        std::vector<uint8_t> lightPlanes(numLights * mapSize);
+
+        // Reference to the bitmask of the shading maps
+        auto mapData = reinterpret_cast<const BYTE*>(Model.LightBits.GetData());
+
+        // The number of bytes that occupies one row in the bitmask of the shading map
+        size_t bytesPerUClamp = (map.UClamp + 7) / 8;
+        // The number of bytes occupied by the shading map for a single light source in the bitmask
+        size_t bytesPerLight = map.VClamp * bytesPerUClamp;
+
+        for (size_t lightIndex = 0; lightIndex < numLights; ++lightIndex)
+            ExpandLightBits(&mapData[map.DataOffset + lightIndex * bytesPerLight], bytesPerUClamp, map.UClamp, map.VClamp, lightPlanes, lightIndex * mapSize);
+
+#ifdef _DEBUG
+        std::vector<uint8_t> referencePlanes;
+        for (size_t lightIndex = 0; lightIndex < numLights; ++lightIndex)
+            ExpandLightBitsReference(&mapData[map.DataOffset + lightIndex * bytesPerLight], bytesPerUClamp, map.UClamp, map.VClamp, referencePlanes);
+        assert(referencePlanes == lightPlanes);
+#endif
+
+        // Interleave lights into RGBA slices, every slice gets a border copied from the opposite edge
+        const size_t sliceWidth = map.UClamp + 2 * SliceBorder;
+        const size_t sliceHeight = map.VClamp + 2 * SliceBorder;
+
+        OutputMap.DataBuffer.assign(layout.Width * layout.Height * sizeof(uint32_t), MaxLight);
+        for (size_t lightIndex = 0; lightIndex < numLights; ++lightIndex)
+        {
+            const uint8_t* pPlane = &lightPlanes[lightIndex * mapSize];
+            const size_t slice = lightIndex / LightsPerSlice;
+            const size_t sliceX = (slice % layout.SlicesPerRow) * sliceWidth;
+            const size_t sliceY = (slice / layout.SlicesPerRow) * sliceHeight;
+            const size_t channel = lightIndex % LightsPerSlice;
+
+            for (size_t y = 0; y < sliceHeight; ++y)
+            {
+                const size_t v = (y + map.VClamp - SliceBorder) % map.VClamp;
+                uint8_t* pRow = &OutputMap.DataBuffer[((sliceY + y) * layout.Width + sliceX) * sizeof(uint32_t) + channel];
+                for (size_t x = 0; x < sliceWidth; ++x)
+                {
+                    const size_t u = (x + map.UClamp - SliceBorder) % map.UClamp;
+                    pRow[x * sizeof(uint32_t)] = pPlane[v * map.UClamp + u];
+                }
+            }
+        }
+
+        return OutputMap;
+    }
+
+    /// <summary>
+    /// Expands the light bits of one light into texels of the occlusion map and lights its edges in the same pass.
+    /// Source bytes go through the lookup table, four per AVX2 store when the CPU has it, two per SSE2 store otherwise.
+    /// </summary>
+    /// <param name="pLightBits">Light bits of the light, rows are bytesPerUClamp apart</param>
+    /// <param name="buffer">Pre-sized buffer of occlusion maps</param>
+    /// <param name="lightOffset">Offset of the light's map in the buffer</param>
+    void ExpandLightBits(const BYTE* pLightBits, size_t bytesPerUClamp, size_t uclamp, size_t vclamp, std::vector<uint8_t>& buffer, size_t lightOffset) const
+    {
+        static const bool bAVX2 = Utils::HasAVX2();
+
+        for (size_t v = 0; v < vclamp; ++v)
+        {
+            const BYTE* const pRow = &pLightBits[v * bytesPerUClamp];
+            uint8_t* const pTexels = &buffer[lightOffset + v * uclamp];
+            if (bAVX2)
+            {
+                ExpandRowAVX2(pRow, uclamp, pTexels);
+            }
+            else
+            {
+                ExpandRowSSE2(pRow, uclamp, pTexels);
+            }
+
+            // Edges of a row depend on the row below it, so they are lit one row behind the expansion.
+            // LitEdges changes border texels only, they are visited in the same order as a full pass does.
+            if (v > 0)
+                LitRowEdges(buffer, lightOffset, vclamp, uclamp, v - 1);
+        }
+        if (vclamp > 0)
+            LitRowEdges(buffer, lightOffset, vclamp, uclamp, vclamp - 1);
+    }
+
+    void ExpandRowSSE2(const BYTE* pRow, size_t uclamp, uint8_t* pTexels) const
+    {
+        size_t u = 0;
+        for (; u + 16 <= uclamp; u += 16, pRow += 2)
+        {
+            const __m128i low = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&m_ExpandTable[pRow[0]]));
+            const __m128i high = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&m_ExpandTable[pRow[1]]));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(&pTexels[u]), _mm_unpacklo_epi64(low, high));
+        }
+        for (; u < uclamp; u += 8, ++pRow)
+            memcpy(&pTexels[u], &m_ExpandTable[*pRow], std::min<size_t>(8, uclamp - u));
+    }
+
+    void ExpandRowAVX2(const BYTE* pRow, size_t uclamp, uint8_t* pTexels) const
+    {
+        size_t u = 0;
+        for (; u + 32 <= uclamp; u += 32, pRow += 4)
+        {
+            const __m256i texels = _mm256_setr_epi64x(
+                static_cast<long long>(m_ExpandTable[pRow[0]]), static_cast<long long>(m_ExpandTable[pRow[1]]),
+                static_cast<long long>(m_ExpandTable[pRow[2]]), static_cast<long long>(m_ExpandTable[pRow[3]]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(&pTexels[u]), texels);
+        }
+        ExpandRowSSE2(pRow, uclamp - u, pTexels + u);
+    }
+
+    /// <summary>
+    /// Lights the border texels of one row: the whole row for the top and bottom ones, the first and last texel for the others
+    /// </summary>
+    void LitRowEdges(std::vector<uint8_t>& buffer, size_t lightOffset, size_t vclamp, size_t uclamp, size_t row) const
+    {
+        const size_t rowStart = row * uclamp;
+        if (row == 0 || row + 1 == vclamp)
+        {
+            for (size_t j = rowStart; j < rowStart + uclamp; ++j)
+                buffer[lightOffset + j] = LitEdges(buffer, lightOffset, vclamp, uclamp, j);
+        }
+        else
+        {
+            buffer[lightOffset + rowStart] = LitEdges(buffer, lightOffset, vclamp, uclamp, rowStart);
+            if (uclamp > 1)
+                buffer[lightOffset + rowStart + uclamp - 1] = LitEdges(buffer, lightOffset, vclamp, uclamp, rowStart + uclamp - 1);
+        }
+    }
+
+    /// <summary>
+    /// Scalar reference of ExpandLightBits: appends texels of one light bit by bit, then lights edges in a full pass
+    /// </summary>
+    void ExpandLightBitsReference(const BYTE* pLightBits, size_t bytesPerUClamp, size_t uclamp, size_t vclamp, std::vector<uint8_t>& buffer) const
+    {
+        const size_t lightOffset = buffer.size();
+
+        for (size_t v = 0; v < vclamp; ++v)
+        {
+            size_t uclampCounter = uclamp;
+            for (size_t byteIndex = 0; byteIndex < bytesPerUClamp; ++byteIndex)
+            {
+                auto lightByte = pLightBits[v * bytesPerUClamp + byteIndex];
+
+                buffer.push_back(lightByte & 0x01 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x02 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x04 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x08 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x10 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x20 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x40 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+                buffer.push_back(lightByte & 0x80 ? MaxLight : MinLight); if (--uclampCounter == 0) break;
+            }
+        }
+
+        const size_t mapSize = uclamp * vclamp;
+        for (size_t i = 0; i < mapSize; ++i)
+            buffer[lightOffset + i] = LitEdges(buffer, lightOffset, vclamp, uclamp, i);
     }
 
     uint8_t Antialize(const std::vector<uint8_t>& buffer, size_t vclamp, size_t uclamp, size_t index) const
@@ -360,6 +945,4 @@ protected:
         else
             return value;
     }
-
-    TextureData m_PlaceholderMap; // Placeholder occlusion map
 };
\ No newline at end of file
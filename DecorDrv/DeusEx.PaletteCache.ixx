@@ -0,0 +1,172 @@
+﻿module;
+
+#include <D3D11.h>
+#include <map>
+#include <array>
+#include <cstring>
+#include <cassert>
+#include <utility>
+#include <wrl\client.h>
+
+#include <Engine.h>
+
+export module DeusEx.PaletteCache;
+
+import Utils;
+
+using Microsoft::WRL::ComPtr;
+
+/// <summary>
+/// Palettes of palette-indexed textures, one 256 color row per palette in a shared texture.
+/// Masked textures get their own row with color 0 transparent, so the Unreal palette isn't touched.
+/// The texture is typeless, with a UNORM and an sRGB view to match the diffuse textures.
+/// </summary>
+export class PaletteCache
+{
+    static const UINT sm_iNumColors = 256;
+    static const UINT sm_iMaxPalettes = 1024;
+
+public:
+    static const unsigned int sm_iTextureSlot = 11;
+
+    explicit PaletteCache(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext)
+        : m_DeviceContext(DeviceContext)
+    {
+        D3D11_TEXTURE2D_DESC TextureDesc;
+        TextureDesc.Width = sm_iNumColors;
+        TextureDesc.Height = sm_iMaxPalettes;
+        TextureDesc.MipLevels = 1;
+        TextureDesc.ArraySize = 1;
+        TextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_TYPELESS;
+        TextureDesc.SampleDesc.Count = 1;
+        TextureDesc.SampleDesc.Quality = 0;
+        TextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_DEFAULT;
+        TextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+        TextureDesc.CPUAccessFlags = 0;
+        TextureDesc.MiscFlags = 0;
+
+        Utils::ThrowIfFailed(
+            Device.CreateTexture2D(&TextureDesc, nullptr, &m_pTexture),
+            "Failed to create palette texture."
+        );
+        Utils::SetResourceName(m_pTexture, "Palettes");
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
+        ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM;
+        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
+        ShaderResourceViewDesc.Texture2D.MipLevels = 1;
+        ShaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+
+        Utils::ThrowIfFailed(
+            Device.CreateShaderResourceView(m_pTexture.Get(), &ShaderResourceViewDesc, &m_pShaderResourceView),
+            "Failed to create palette texture SRV."
+        );
+        Utils::SetResourceName(m_pShaderResourceView, "Palettes");
+
+        ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        Utils::ThrowIfFailed(
+            Device.CreateShaderResourceView(m_pTexture.Get(), &ShaderResourceViewDesc, &m_pShaderResourceViewSRGB),
+            "Failed to create palette texture sRGB SRV."
+        );
+        Utils::SetResourceName(m_pShaderResourceViewSRGB, "Palettes sRGB");
+    }
+
+    PaletteCache(const PaletteCache&) = delete;
+    PaletteCache& operator=(const PaletteCache&) = delete;
+
+    /// <summary>
+    /// Finds the row of the texture palette, uploading it if it's new or has changed since it was last checked.
+    /// A palette is compared at most once per frame. Returns false if all rows are taken.
+    /// </summary>
+    bool FindOrInsert(const FTextureInfo& Texture, const DWORD PolyFlags, UINT& iRow)
+    {
+        assert(Texture.Palette);
+
+        const bool bMasked = (PolyFlags & PF_Masked) != 0;
+        auto it = m_Palettes.find(std::make_pair(Texture.PaletteCacheID, bMasked));
+        if (it == m_Palettes.end())
+        {
+            if (m_Palettes.size() == sm_iMaxPalettes)
+            {
+                return false;
+            }
+
+            Palette NewPalette;
+            NewPalette.iRow = static_cast<UINT>(m_Palettes.size());
+            it = m_Palettes.emplace(std::make_pair(Texture.PaletteCacheID, bMasked), NewPalette).first;
+        }
+
+        Palette& Entry = it->second;
+        if (Entry.iCheckedFrame != m_iFrame)
+        {
+            Entry.iCheckedFrame = m_iFrame;
+
+            std::array<FColor, sm_iNumColors> Colors;
+            memcpy(Colors.data(), Texture.Palette, sizeof(Colors));
+            if (bMasked)
+            {
+                Colors[0].R = Colors[0].G = Colors[0].B = Colors[0].A = 0;
+            }
+
+            if (!Entry.bUploaded || memcmp(Colors.data(), Entry.Colors.data(), sizeof(Colors)) != 0)
+            {
+                if (Entry.bUploaded)
+                {
+                    m_iNumUpdates++;
+                }
+                Entry.Colors = Colors;
+                Entry.bUploaded = true;
+
+                const D3D11_BOX Box = { 0, Entry.iRow, 0, sm_iNumColors, Entry.iRow + 1, 1 };
+                m_DeviceContext.UpdateSubresource(m_pTexture.Get(), 0, &Box, Colors.data(), sizeof(Colors), 0);
+            }
+        }
+
+        iRow = Entry.iRow;
+        return true;
+    }
+
+    void NewFrame()
+    {
+        m_iFrame++;
+    }
+
+    void BindPalettes()
+    {
+        m_DeviceContext.PSSetShaderResources(sm_iTextureSlot, 1, m_bSRGB ? m_pShaderResourceViewSRGB.GetAddressOf() : m_pShaderResourceView.GetAddressOf());
+    }
+
+    void SetSRGB(const bool bSRGB) { m_bSRGB = bSRGB; }
+
+    void Flush()
+    {
+        m_Palettes.clear();
+        m_iNumUpdates = 0;
+    }
+
+    //Diagnostics
+    size_t GetNumPalettes() const { return m_Palettes.size(); }
+    size_t GetNumUpdates() const { return m_iNumUpdates; } // Uploads of palettes changed after their first use
+    Utils::MemoryUsage GetMemoryUsage() const { return { m_Palettes.size() * sizeof(Palette), sm_iNumColors * sm_iMaxPalettes * sizeof(FColor), 1 }; }
+
+protected:
+    struct Palette
+    {
+        UINT iRow;
+        size_t iCheckedFrame = static_cast<size_t>(-1);
+        bool bUploaded = false;
+        std::array<FColor, sm_iNumColors> Colors;
+    };
+
+    ID3D11DeviceContext& m_DeviceContext;
+
+    ComPtr<ID3D11Texture2D> m_pTexture;
+    ComPtr<ID3D11ShaderResourceView> m_pShaderResourceView;
+    ComPtr<ID3D11ShaderResourceView> m_pShaderResourceViewSRGB;
+    bool m_bSRGB = false;
+
+    std::map<std::pair<QWORD, bool>, Palette> m_Palettes;
+
+    size_t m_iFrame = 0;
+    size_t m_iNumUpdates = 0;
+};
@@ -7,6 +7,7 @@
 
 export module DeusEx.Renderer.ComplexSurface;
 
+import Utils;
 import GPU.ShaderCompiler;
 import GPU.DynamicBuffer;
 
@@ -23,6 +24,7 @@ public:
         DirectX::XMFLOAT2 TexCoords2;
         unsigned int PolyFlags;
         unsigned int TexFlags;
+        unsigned int SurfaceOffset; // record of the surface in the buffer of surface records
     };
 
     enum DrawMode
@@ -48,7 +50,8 @@ public:
             { "TexCoord", 1, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
             { "TexCoord", 2, DXGI_FORMAT_R32G32_FLOAT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
             { "BlendIndices", 0, DXGI_FORMAT_R32_UINT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
-            { "BlendIndices", 1, DXGI_FORMAT_R32_UINT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 }
+            { "BlendIndices", 1, DXGI_FORMAT_R32_UINT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 },
+            { "BlendIndices", 2, DXGI_FORMAT_R32_UINT, 0, D3D11_APPEND_ALIGNED_ELEMENT, D3D11_INPUT_PER_VERTEX_DATA, 0 }
         };
 
         m_pInputLayout = Compiler.CreateInputLayout(InputElementDescs, _countof(InputElementDescs));
@@ -124,6 +127,12 @@ public:
     size_t GetNumIndices() const { return m_IndexBuffer.GetSize(); }
     size_t GetNumDraws() const { return m_iNumDraws; }
     size_t GetMaxIndices() const { return m_IndexBuffer.GetReserved(); }
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage = m_VertexBuffer.GetMemoryUsage();
+        Usage += m_IndexBuffer.GetMemoryUsage();
+        return Usage;
+    }
 
 protected:
     ID3D11Device& m_Device;
@@ -0,0 +1,237 @@
+﻿module;
+
+#include <D3D11.h>
+#include <memory>
+#include <cassert>
+#include <wrl\client.h>
+
+export module DeusEx.Renderer.DynamicLight;
+
+import Utils;
+import GPU.ShaderCompiler;
+import GPU.ConstantBuffer;
+import GPU.RenderTexture;
+
+using Microsoft::WRL::ComPtr;
+
+/// <summary>
+/// Renders dynamic lights in reduced resolution: complex surfaces write normal, depth and albedo to G-buffer,
+/// then diffuse irradiance of dynamic lights is accumulated in a low resolution target
+/// and added to the scene with depth and normal aware upsampling
+/// </summary>
+export class DynamicLightRenderer
+{
+    struct DynamicLightControl
+    {
+        uint32_t ResolutionDivider;
+        uint32_t LowResWidth;
+        uint32_t LowResHeight;
+        uint32_t padding;
+    };
+
+    static const unsigned int sm_iConstantBufferSlot = 4;
+    static const unsigned int sm_iFirstTextureSlot = 5; // t5 - normal and depth, t6 - albedo, t7 - depth buffer, t8 - low resolution light
+    static const unsigned int sm_iNumTextureSlots = 4;
+
+public:
+    explicit DynamicLightRenderer(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, unsigned int resolutionDivider)
+        : m_Device(Device)
+        , m_DeviceContext(DeviceContext)
+        , m_ConstantBuffer(Device, DeviceContext)
+        , m_iResolutionDivider(resolutionDivider)
+    {
+        assert(m_iResolutionDivider > 1);
+
+        ShaderCompiler Compiler(m_Device, L"DecorDrv\\DynamicLight.hlsl");
+        m_pVertexShader = Compiler.CompileVertexShader();
+        m_pPixelShader = Compiler.CompilePixelShader();
+
+        ShaderCompiler CompositeCompiler(m_Device, L"DecorDrv\\DynamicLightComposite.hlsl");
+        m_pCompositePixelShader = CompositeCompiler.CompilePixelShader();
+
+        m_pGBufferNormal = std::make_unique<RenderTexture>(DXGI_FORMAT_R16G16B16A16_FLOAT);
+        m_pGBufferNormal->SetDevice(&m_Device);
+        m_pGBufferAlbedo = std::make_unique<RenderTexture>(DXGI_FORMAT_R8G8B8A8_UNORM);
+        m_pGBufferAlbedo->SetDevice(&m_Device);
+        m_pLightTexture = std::make_unique<RenderTexture>(DXGI_FORMAT_R16G16B16A16_FLOAT);
+        m_pLightTexture->SetDevice(&m_Device);
+
+        // Additive blending of dynamic light, alpha channel of the scene must stay intact
+        D3D11_BLEND_DESC BlendDesc = {};
+        BlendDesc.RenderTarget[0].BlendEnable = TRUE;
+        BlendDesc.RenderTarget[0].SrcBlend = D3D11_BLEND::D3D11_BLEND_ONE;
+        BlendDesc.RenderTarget[0].DestBlend = D3D11_BLEND::D3D11_BLEND_ONE;
+        BlendDesc.RenderTarget[0].BlendOp = D3D11_BLEND_OP::D3D11_BLEND_OP_ADD;
+        BlendDesc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND::D3D11_BLEND_ZERO;
+        BlendDesc.RenderTarget[0].DestBlendAlpha = D3D11_BLEND::D3D11_BLEND_ONE;
+        BlendDesc.RenderTarget[0].BlendOpAlpha = D3D11_BLEND_OP::D3D11_BLEND_OP_ADD;
+        BlendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_RED | D3D11_COLOR_WRITE_ENABLE_GREEN | D3D11_COLOR_WRITE_ENABLE_BLUE;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateBlendState(&BlendDesc, &m_pCompositeBlendState),
+            "Failed to create dynamic light blend state."
+        );
+        Utils::SetResourceName(m_pCompositeBlendState, "DynamicLightComposite");
+
+        BlendDesc.RenderTarget[0].BlendEnable = FALSE;
+        BlendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateBlendState(&BlendDesc, &m_pOpaqueBlendState),
+            "Failed to create dynamic light blend state."
+        );
+        Utils::SetResourceName(m_pOpaqueBlendState, "DynamicLight");
+    }
+
+    DynamicLightRenderer(const DynamicLightRenderer&) = delete;
+    DynamicLightRenderer& operator=(const DynamicLightRenderer&) = delete;
+
+    ~DynamicLightRenderer()
+    {
+        m_pGBufferNormal->ReleaseDevice();
+        m_pGBufferAlbedo->ReleaseDevice();
+        m_pLightTexture->ReleaseDevice();
+    }
+
+    void SizeResources(uint32_t width, uint32_t height)
+    {
+        const uint32_t lowResWidth = (width + m_iResolutionDivider - 1) / m_iResolutionDivider;
+        const uint32_t lowResHeight = (height + m_iResolutionDivider - 1) / m_iResolutionDivider;
+
+        m_pGBufferNormal->SizeResources(width, height);
+        m_pGBufferAlbedo->SizeResources(width, height);
+        m_pLightTexture->SizeResources(lowResWidth, lowResHeight);
+
+        m_Viewport = { 0.0f, 0.0f, static_cast<float>(width), static_cast<float>(height), 0.0f, 1.0f };
+        m_LowResViewport = { 0.0f, 0.0f, static_cast<float>(lowResWidth), static_cast<float>(lowResHeight), 0.0f, 1.0f };
+
+        m_ConstantBuffer.m_Data.ResolutionDivider = m_iResolutionDivider;
+        m_ConstantBuffer.m_Data.LowResWidth = lowResWidth;
+        m_ConstantBuffer.m_Data.LowResHeight = lowResHeight;
+        m_ConstantBuffer.MarkAsDirty();
+
+        ClearGBuffer();
+    }
+
+    void NewFrame()
+    {
+        ClearGBuffer();
+        m_iNumResolves = 0;
+    }
+
+    /// <summary>
+    /// Binds scene render target together with G-buffer, must be called before drawing complex surfaces
+    /// </summary>
+    void BindSurfaceTargets(ID3D11RenderTargetView* pSceneRTV, ID3D11DepthStencilView* pDSV)
+    {
+        ID3D11RenderTargetView* const RenderTargets[] = { pSceneRTV, m_pGBufferNormal->GetRenderTargetView(), m_pGBufferAlbedo->GetRenderTargetView() };
+        m_DeviceContext.OMSetRenderTargets(_countof(RenderTargets), RenderTargets, pDSV);
+        m_bHasSurfaces = true;
+    }
+
+    void UnbindSurfaceTargets(ID3D11RenderTargetView* pSceneRTV, ID3D11DepthStencilView* pDSV)
+    {
+        m_DeviceContext.OMSetRenderTargets(1, &pSceneRTV, pDSV);
+    }
+
+    /// <summary>
+    /// Accumulates dynamic lights for the surfaces drawn so far and adds them to the scene.
+    /// Must be called before depth buffer is cleared.
+    /// </summary>
+    void Resolve(ID3D11RenderTargetView* pSceneRTV, ID3D11DepthStencilView* pDSV, ID3D11ShaderResourceView* pDepthSRV)
+    {
+        if (!m_bHasSurfaces)
+            return;
+
+        UINT iNumViewports = 1;
+        D3D11_VIEWPORT SceneViewport;
+        m_DeviceContext.RSGetViewports(&iNumViewports, &SceneViewport);
+
+        m_ConstantBuffer.UpdateAndBind(sm_iConstantBufferSlot);
+
+        m_DeviceContext.IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY::D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        m_DeviceContext.IASetInputLayout(nullptr);
+        m_DeviceContext.VSSetShader(m_pVertexShader.Get(), nullptr, 0);
+        m_DeviceContext.GSSetShader(nullptr, nullptr, 0);
+
+        // Low resolution pass
+        auto pLightRTV = m_pLightTexture->GetRenderTargetView();
+        m_DeviceContext.OMSetRenderTargets(1, &pLightRTV, nullptr);
+        m_DeviceContext.OMSetBlendState(m_pOpaqueBlendState.Get(), nullptr, 0xffffffff);
+        m_DeviceContext.RSSetViewports(1, &m_LowResViewport);
+
+        ID3D11ShaderResourceView* const GBufferSRVs[] = { m_pGBufferNormal->GetShaderResourceView(), m_pGBufferAlbedo->GetShaderResourceView(), pDepthSRV };
+        m_DeviceContext.PSSetShaderResources(sm_iFirstTextureSlot, _countof(GBufferSRVs), GBufferSRVs);
+        m_DeviceContext.PSSetShader(m_pPixelShader.Get(), nullptr, 0);
+        m_DeviceContext.Draw(3, 0);
+
+        // Composite pass
+        m_DeviceContext.OMSetRenderTargets(1, &pSceneRTV, nullptr);
+        m_DeviceContext.OMSetBlendState(m_pCompositeBlendState.Get(), nullptr, 0xffffffff);
+        m_DeviceContext.RSSetViewports(1, &m_Viewport);
+
+        ID3D11ShaderResourceView* const pLightSRV = m_pLightTexture->GetShaderResourceView();
+        m_DeviceContext.PSSetShaderResources(sm_iFirstTextureSlot + _countof(GBufferSRVs), 1, &pLightSRV);
+        m_DeviceContext.PSSetShader(m_pCompositePixelShader.Get(), nullptr, 0);
+        m_DeviceContext.Draw(3, 0);
+
+        // Restore state, blend state and shaders are set again by the next Render()
+        ID3D11ShaderResourceView* const nullSRVs[sm_iNumTextureSlots] = { nullptr };
+        m_DeviceContext.PSSetShaderResources(sm_iFirstTextureSlot, sm_iNumTextureSlots, nullSRVs);
+        m_DeviceContext.OMSetRenderTargets(1, &pSceneRTV, pDSV);
+        m_DeviceContext.RSSetViewports(1, &SceneViewport);
+
+        ClearGBuffer();
+        m_iNumResolves++;
+    }
+
+    //Diagnostics
+    unsigned int GetResolutionDivider() const { return m_iResolutionDivider; }
+    size_t GetNumResolves() const { return m_iNumResolves; }
+
+    /// <summary>
+    /// G-buffer and light texture of the low resolution pass
+    /// </summary>
+    Utils::MemoryUsage GetRenderTargetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage = m_pGBufferNormal->GetMemoryUsage();
+        Usage += m_pGBufferAlbedo->GetMemoryUsage();
+        Usage += m_pLightTexture->GetMemoryUsage();
+        return Usage;
+    }
+
+    Utils::MemoryUsage GetConstantBufferMemoryUsage() const { return m_ConstantBuffer.GetMemoryUsage(); }
+
+protected:
+    void ClearGBuffer()
+    {
+        // Zero depth marks pixels without deferred dynamic lights
+        const float ClearColor[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        if (m_pGBufferNormal->GetRenderTargetView())
+            m_DeviceContext.ClearRenderTargetView(m_pGBufferNormal->GetRenderTargetView(), ClearColor);
+
+        m_bHasSurfaces = false;
+    }
+
+    ID3D11Device& m_Device;
+    ID3D11DeviceContext& m_DeviceContext;
+
+    ComPtr<ID3D11VertexShader> m_pVertexShader;
+    ComPtr<ID3D11PixelShader> m_pPixelShader;
+    ComPtr<ID3D11PixelShader> m_pCompositePixelShader;
+    ComPtr<ID3D11BlendState> m_pOpaqueBlendState;
+    ComPtr<ID3D11BlendState> m_pCompositeBlendState;
+
+    std::unique_ptr<RenderTexture> m_pGBufferNormal;
+    std::unique_ptr<RenderTexture> m_pGBufferAlbedo;
+    std::unique_ptr<RenderTexture> m_pLightTexture;
+
+    ConstantBuffer<DynamicLightControl> m_ConstantBuffer;
+
+    D3D11_VIEWPORT m_Viewport = {};
+    D3D11_VIEWPORT m_LowResViewport = {};
+
+    unsigned int m_iResolutionDivider;
+    bool m_bHasSurfaces = false;
+    size_t m_iNumResolves = 0; // Number of resolves this frame, for stats
+};
@@ -7,6 +7,7 @@
 
 export module DeusEx.Renderer.Gouraud;
 
+import Utils;
 import GPU.ShaderCompiler;
 import GPU.DynamicBuffer;
 
@@ -105,6 +106,12 @@ public:
     size_t GetNumIndices() const { return m_IndexBuffer.GetSize(); }
     size_t GetNumDraws() const { return m_iNumDraws; }
     size_t GetMaxIndices() const { return m_IndexBuffer.GetReserved(); }
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage = m_VertexBuffer.GetMemoryUsage();
+        Usage += m_IndexBuffer.GetMemoryUsage();
+        return Usage;
+    }
 
 protected:
     ID3D11Device& m_Device;
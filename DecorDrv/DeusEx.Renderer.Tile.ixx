@@ -7,6 +7,7 @@
 
 export module DeusEx.Renderer.Tile;
 
+import Utils;
 import GPU.ShaderCompiler;
 import GPU.DynamicBuffer;
 
@@ -95,6 +96,7 @@ public:
     size_t GetNumTiles() const { return m_InstanceBuffer.GetSize(); }
     size_t GetNumDraws() const { return m_iNumDraws; }
     size_t GetMaxTiles() const { return m_InstanceBuffer.GetReserved(); }
+    Utils::MemoryUsage GetMemoryUsage() const { return m_InstanceBuffer.GetMemoryUsage(); }
 
 protected:
     ID3D11Device& m_Device;
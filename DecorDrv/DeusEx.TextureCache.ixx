@@ -2,7 +2,19 @@
 
 #include <D3D11.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <vector>
+#include <tuple>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <initializer_list>
+#include <atomic>
+#include <array>
 #include <wrl\client.h>
 
 #include "FastNoiseLite.h"
@@ -11,7 +23,12 @@
 export module DeusEx.TextureCache;
 
 import DeusEx.TextureConverter;
+import DeusEx.PaletteCache;
+import DeusEx.TextureOverrides;
+import DeusEx.LightmapAtlas;
+import DeusEx.FogMapPool;
 import Utils;
+import JobSystem;
 
 using Microsoft::WRL::ComPtr;
 
@@ -20,9 +37,13 @@ export class TextureCache
 public:
     static const unsigned int sm_iMaxSlots = 3; // Maximum texture slot managed by the cache
 
-    explicit TextureCache(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext)
+    explicit TextureCache(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, JobSystem& jobSystem)
         :m_DeviceContext(DeviceContext)
-        , m_TextureConverter(Device, DeviceContext)
+        , m_JobSystem(jobSystem)
+        , m_TextureConverter(Device, DeviceContext, jobSystem)
+        , m_PaletteCache(Device, DeviceContext)
+        , m_LightmapAtlas(Device, DeviceContext)
+        , m_FogMapPool(Device, DeviceContext)
     {
         ResetDirtySlots();
         CreateNoiseTexture(Device);
@@ -31,11 +52,20 @@ public:
     TextureCache(const TextureCache&) = delete;
     TextureCache& operator=(const TextureCache&) = delete;
 
-    const TextureConverter::TextureData& FindOrInsert(FTextureInfo& Texture, const DWORD PolyFlags)
+    ~TextureCache()
     {
-        auto it = m_Textures.find(Texture.CacheID);
-        if (it != m_Textures.end())
+        m_JobSystem.Wait(); // Streaming jobs use the converter
+    }
+
+    const TextureConverter::TextureData& FindOrInsert(FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices = false)
+    {
+        // Palette-indexed copies are kept apart, tiles and meshes sample the same textures as RGBA
+        auto& Textures = bPaletteIndices ? m_PaletteIndexTextures : m_Textures;
+
+        auto it = Textures.find(Texture.CacheID);
+        if (it != Textures.end())
         {
+            it->second.iLastUsedFrame = m_iFrame;
             if (Texture.bRealtimeChanged)
             {
                 m_TextureConverter.Update(Texture, it->second, PolyFlags);
@@ -45,33 +75,386 @@ public:
             return it->second;
         }
 
-        TextureConverter::TextureData NewData = m_TextureConverter.Convert(Texture, PolyFlags);
-        const TextureConverter::TextureData& Data = m_Textures.emplace(Texture.CacheID, std::move(NewData)).first->second;
+        // Replacements don't need the Unreal mips, and work for formats the converter doesn't handle
+        if (!bPaletteIndices && !Texture.bRealtime && !Texture.bRealtimeChanged)
+        {
+            if (auto pImage = m_TextureOverrides.Open(Texture))
+            {
+                try
+                {
+                    return Insert(Texture.CacheID, false, m_TextureConverter.CreateOverride(Texture, *pImage));
+                }
+                catch (const Utils::ComException& ex)
+                {
+                    Utils::LogWarningf(L"Exception: %s", ex.what()); // BC7 needs feature level 11, the original is used then
+                }
+            }
+        }
+
+        LoadLazy(Texture);
 
-        return Data;
+        // Textures of the previous level with the same content are linked to the new cache ID
+        const uint64_t iContentHash = GetContentHash(Texture, PolyFlags, bPaletteIndices);
+        if (iContentHash != 0 && !m_ReusePool.empty())
+        {
+            auto itReuse = m_ReusePool.find(iContentHash);
+            if (itReuse != m_ReusePool.end())
+            {
+                TextureConverter::TextureData& Data = Textures.emplace(Texture.CacheID, std::move(itReuse->second)).first->second;
+                m_ReusePool.erase(itReuse);
+                Data.iLastUsedFrame = m_iFrame;
+                m_iNumReused++;
+                UnloadLazy(Texture);
+                return Data;
+            }
+        }
+
+        const auto convertStartTime = std::chrono::high_resolution_clock::now();
+
+        // Large textures start out with their small mips, the full chain is converted on a worker.
+        // The worker creates the complete texture, which replaces the placeholder at the next frame; without async creation the larger mips are uploaded over the next frames.
+        const INT iFirstMip = m_bStreaming ? m_TextureConverter.GetStreamingFirstMip(Texture, bPaletteIndices) : 0;
+        TextureConverter::TextureData NewData = iFirstMip > 0
+            ? m_TextureConverter.ConvertStreamed(Texture, PolyFlags, bPaletteIndices, iFirstMip)
+            : m_TextureConverter.Convert(Texture, PolyFlags, bPaletteIndices);
+        if (iFirstMip > 0)
+        {
+            QueueStreaming(Texture, PolyFlags, bPaletteIndices, iContentHash);
+        }
+        UnloadLazy(Texture);
+        AddHitch(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - convertStartTime).count());
+
+        NewData.iContentHash = iFirstMip > 0 ? 0 : iContentHash; // Set once the texture is complete
+        m_iNumRebuilt++;
+
+        return Insert(Texture.CacheID, bPaletteIndices, std::move(NewData));
     }
 
-    const TextureConverter::TextureData& FindOrInsertAndPrepare(FTextureInfo& Texture, const unsigned int iSlot, const DWORD PolyFlags)
+    const TextureConverter::TextureData& FindOrInsertAndPrepare(FTextureInfo& Texture, const unsigned int iSlot, const DWORD PolyFlags, const bool bPaletteIndices = false)
     {
-        const TextureConverter::TextureData& Data = FindOrInsert(Texture, PolyFlags);
+        const TextureConverter::TextureData& Data = FindOrInsert(Texture, PolyFlags, bPaletteIndices);
 
         m_iDirtyBeginSlot = std::min(m_iDirtyBeginSlot, iSlot);
         m_iDirtyEndSlot = std::max(m_iDirtyEndSlot, iSlot);
         m_PreparedSRVs[iSlot] = Data.pShaderResourceView.Get();
         m_PreparedIds[iSlot] = Texture.CacheID;
+        m_PreparedPaletteIndices[iSlot] = bPaletteIndices;
 
         return Data;
     }
     
+    /// <summary>
+    /// Places the lightmap in the atlas, returns false if it has to use a texture of its own (FindOrInsertAndPrepare) instead
+    /// </summary>
+    bool FindOrInsertLightmap(FTextureInfo& LightMap, LightmapAtlas::Placement& Placement)
+    {
+        if (!m_bLightmapAtlas || !LightmapAtlas::CanPack(LightMap))
+        {
+            return false;
+        }
+
+        LoadLazy(LightMap);
+        const bool bPacked = m_LightmapAtlas.FindOrInsert(LightMap, Placement);
+        UnloadLazy(LightMap);
+        return bPacked;
+    }
+
+    bool IsLightmapPagePrepared(const UINT iPage, const unsigned int iSlot) const
+    {
+        return m_iDirtyBeginSlot <= iSlot && m_iDirtyEndSlot >= iSlot && m_PreparedIds[iSlot] == sm_iLightmapPageId + iPage;
+    }
+
+    void PrepareLightmapPage(const UINT iPage, const unsigned int iSlot)
+    {
+        m_iDirtyBeginSlot = std::min(m_iDirtyBeginSlot, iSlot);
+        m_iDirtyEndSlot = std::max(m_iDirtyEndSlot, iSlot);
+        m_PreparedSRVs[iSlot] = m_LightmapAtlas.GetPageSRV(iPage);
+        m_PreparedIds[iSlot] = sm_iLightmapPageId + iPage;
+        m_PreparedPaletteIndices[iSlot] = false;
+    }
+
+    void SetLightmapAtlas(const bool bLightmapAtlas)
+    {
+        Flush();
+        m_bLightmapAtlas = bLightmapAtlas;
+    }
+
+    bool GetLightmapAtlas() const { return m_bLightmapAtlas; }
+    size_t GetNumLightmapPages() const { return m_LightmapAtlas.GetNumPages(); }
+    size_t GetNumAtlasLightmaps() const { return m_LightmapAtlas.GetNumLightmaps(); }
+    size_t GetNumLightmapAtlasResets() const { return m_LightmapAtlas.GetNumResets(); }
+    size_t GetNumLightmapFallbacks() const { return m_LightmapAtlas.GetNumFallbacks(); }
+
+    /// <summary>
+    /// Copies the fog map into the pool for this frame, returns false if it has to use a texture of its own (FindOrInsertAndPrepare) instead
+    /// </summary>
+    bool FindOrInsertFogMap(FTextureInfo& FogMap, FogMapPool::Placement& Placement)
+    {
+        if (!m_bFogMapPool || !FogMapPool::CanPool(FogMap))
+        {
+            return false;
+        }
+
+        LoadLazy(FogMap);
+        const bool bPooled = m_FogMapPool.FindOrInsert(FogMap, Placement);
+        UnloadLazy(FogMap);
+        return bPooled;
+    }
+
+    bool IsFogMapPagePrepared(const UINT iPage, const unsigned int iSlot) const
+    {
+        return m_iDirtyBeginSlot <= iSlot && m_iDirtyEndSlot >= iSlot && m_PreparedIds[iSlot] == sm_iFogMapPageId + iPage;
+    }
+
+    void PrepareFogMapPage(const UINT iPage, const unsigned int iSlot)
+    {
+        m_iDirtyBeginSlot = std::min(m_iDirtyBeginSlot, iSlot);
+        m_iDirtyEndSlot = std::max(m_iDirtyEndSlot, iSlot);
+        m_PreparedSRVs[iSlot] = m_FogMapPool.GetPageSRV(iPage);
+        m_PreparedIds[iSlot] = sm_iFogMapPageId + iPage;
+        m_PreparedPaletteIndices[iSlot] = false;
+    }
+
+    void SetFogMapPool(const bool bFogMapPool)
+    {
+        Flush();
+        m_bFogMapPool = bFogMapPool;
+    }
+
+    bool GetFogMapPool() const { return m_bFogMapPool; }
+    size_t GetNumPooledFogMaps() const { return m_FogMapPool.GetNumFogMaps(); }
+    size_t GetNumFogMapUploads() const { return m_FogMapPool.GetNumUploads(); }
+    size_t GetNumFogMapUploadedBytes() const { return m_FogMapPool.GetNumUploadedBytes(); }
+    size_t GetNumFogMapFallbacks() const { return m_FogMapPool.GetNumFallbacks(); }
+
     // Instead of checking what's actually bound, for our purposes it's enough to just check if someone else WANTED to bind something else.
     // However this means that preparing a new texture and then not using it to render will result in a false positive for having to flush geometry.
-    bool IsPrepared(const FTextureInfo& Texture, const unsigned int iSlot) const
+    bool IsPrepared(const FTextureInfo& Texture, const unsigned int iSlot, const bool bPaletteIndices = false) const
     {
-        return m_iDirtyBeginSlot <= iSlot && m_iDirtyEndSlot >= iSlot && m_PreparedIds[iSlot] == Texture.CacheID;
+        return m_iDirtyBeginSlot <= iSlot && m_iDirtyEndSlot >= iSlot && m_PreparedIds[iSlot] == Texture.CacheID && m_PreparedPaletteIndices[iSlot] == bPaletteIndices;
+    }
+
+    /// <summary>
+    /// With lazy textures the engine doesn't keep mip data in memory, it's loaded when a texture is converted and released right after
+    /// </summary>
+    void SetLazyTextures(const bool bLazyTextures) { m_bLazyTextures = bLazyTextures; }
+    bool GetLazyTextures() const { return m_bLazyTextures; }
+
+    /// <summary>
+    /// Queues a texture of the engine precache pass, it's converted on the workers by FinishPrecache().
+    /// Overridden textures are left to FindOrInsert, which loads the replacement instead; textures of the previous level with the same content are linked right away.
+    /// </summary>
+    void Precache(FTextureInfo& Texture, const DWORD PolyFlags)
+    {
+        if (m_PrecacheQueue.empty())
+        {
+            m_PrecacheStartTime = std::chrono::high_resolution_clock::now();
+        }
+
+        if (m_Textures.find(Texture.CacheID) != m_Textures.end() || m_TextureOverrides.Has(Texture) || !m_PrecacheIds.insert(Texture.CacheID).second)
+        {
+            return;
+        }
+
+        LoadLazy(Texture);
+
+        const uint64_t iContentHash = GetContentHash(Texture, PolyFlags, false);
+        if (iContentHash != 0 && !m_ReusePool.empty())
+        {
+            auto itReuse = m_ReusePool.find(iContentHash);
+            if (itReuse != m_ReusePool.end())
+            {
+                TextureConverter::TextureData& Data = m_Textures.emplace(Texture.CacheID, std::move(itReuse->second)).first->second;
+                m_ReusePool.erase(itReuse);
+                Data.iLastUsedFrame = m_iFrame;
+                m_iNumReused++;
+                UnloadLazy(Texture);
+                return;
+            }
+        }
+
+        auto pPrepared = m_TextureConverter.CreatePreparedTexture(Texture, PolyFlags);
+        UnloadLazy(Texture);
+        if (pPrepared)
+        {
+            m_PrecacheQueue.push_back({ Texture.CacheID, iContentHash, std::move(pPrepared) });
+        }
+    }
+
+    /// <summary>
+    /// Converts the queued textures in parallel and creates their device resources, a chunk at a time to bound the converted data held at once
+    /// </summary>
+    void FinishPrecache()
+    {
+        if (m_PrecacheQueue.empty())
+        {
+            return;
+        }
+
+        // The copies of the Unreal data are dropped as soon as they're converted, and the converted data once it's uploaded
+        double fConvertMs = 0.0;
+        double fCreateMs = 0.0;
+        for (size_t iBegin = 0; iBegin < m_PrecacheQueue.size(); iBegin += sm_iPrecacheChunkSize)
+        {
+            const size_t iNumChunk = std::min(sm_iPrecacheChunkSize, m_PrecacheQueue.size() - iBegin);
+
+            const auto convertStartTime = std::chrono::high_resolution_clock::now();
+            m_JobSystem.ParallelFor(iNumChunk, [this, iBegin](size_t i)
+            {
+                TextureConverter::PreparedTexture& Prepared = *m_PrecacheQueue[iBegin + i].pPrepared;
+                TextureConverter::Prepare(Prepared);
+                TextureConverter::ReleasePreparedSource(Prepared);
+            });
+            const auto createStartTime = std::chrono::high_resolution_clock::now();
+
+            for (size_t i = iBegin; i < iBegin + iNumChunk; i++)
+            {
+                PrecachedTexture& Precached = m_PrecacheQueue[i];
+                if (m_Textures.find(Precached.CacheID) == m_Textures.end()) // textures drawn during the frame are already created
+                {
+                    TextureConverter::TextureData NewData = m_TextureConverter.CreatePrepared(*Precached.pPrepared);
+                    NewData.iLastUsedFrame = m_iFrame;
+                    NewData.iContentHash = Precached.iContentHash;
+                    m_iResidentBytes += NewData.iNumBytes;
+                    m_iNumRebuilt++;
+                    m_Textures.emplace(Precached.CacheID, std::move(NewData));
+                }
+                Precached.pPrepared.reset();
+            }
+
+            const auto endTime = std::chrono::high_resolution_clock::now();
+            fConvertMs += std::chrono::duration<double, std::milli>(createStartTime - convertStartTime).count();
+            fCreateMs += std::chrono::duration<double, std::milli>(endTime - createStartTime).count();
+        }
+
+        Utils::LogMessagef(L"Precached %Iu textures in %.2f ms (conversion %.2f ms, creation %.2f ms).",
+            m_PrecacheQueue.size(),
+            std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - m_PrecacheStartTime).count(),
+            fConvertMs,
+            fCreateMs);
+
+        m_PrecacheQueue.clear();
+        m_PrecacheIds.clear();
+    }
+
+    /// <summary>
+    /// Row of the texture palette if the texture should be drawn palette-indexed, false to draw it as RGBA
+    /// </summary>
+    bool GetPaletteRow(const FTextureInfo& Texture, const DWORD PolyFlags, UINT& iRow)
+    {
+        if (!m_bPaletteTextures || Texture.Format != ETextureFormat::TEXF_P8 || m_TextureOverrides.Has(Texture))
+            return false;
+
+        return m_PaletteCache.FindOrInsert(Texture, PolyFlags, iRow);
+    }
+
+    /// <summary>
+    /// Enables palette-indexed textures, textures already converted are dropped
+    /// </summary>
+    void SetPaletteTextures(const bool bPaletteTextures)
+    {
+        Flush();
+        m_bPaletteTextures = bPaletteTextures;
+    }
+
+    bool GetPaletteTextures() const { return m_bPaletteTextures; }
+
+    /// <summary>
+    /// Switches color textures and palettes to sRGB formats, textures already converted are dropped
+    /// </summary>
+    void SetSRGB(const bool bSRGB)
+    {
+        Flush();
+        m_TextureConverter.SetSRGB(bSRGB);
+        m_PaletteCache.SetSRGB(bSRGB);
+        m_LightmapAtlas.SetSRGB(bSRGB);
+        m_FogMapPool.SetSRGB(bSRGB);
+    }
+
+    bool GetSRGB() const { return m_TextureConverter.GetSRGB(); }
+
+    /// <summary>
+    /// Indexes the replacement textures of the directory, an empty path disables them. Textures already converted are dropped.
+    /// </summary>
+    void SetOverrideDirectory(const std::wstring& directory)
+    {
+        Flush();
+        m_TextureOverrides.SetDirectory(directory);
+    }
+
+    size_t GetNumOverrides() const { return m_TextureOverrides.GetNumIndexed(); }
+    size_t GetNumOverridesLoaded() const { return m_TextureOverrides.GetNumLoaded(); }
+
+    void NewFrame()
+    {
+        m_iFrame++;
+        m_PaletteCache.NewFrame();
+        m_LightmapAtlas.NewFrame();
+        m_FogMapPool.NewFrame();
+        m_TextureConverter.NewFrame();
+        UpdateStreaming();
+        EvictOverBudget();
+
+        if (!m_ReusePool.empty() && m_iFrame - m_iReusePoolFrame > sm_iReuseFrames)
+        {
+            Utils::LogMessagef(L"Level change: %Iu textures reused, %Iu rebuilt, %Iu released.", m_iNumReused, m_iNumRebuilt, m_ReusePool.size());
+            ReleaseReusePool();
+        }
+    }
+
+    /// <summary>
+    /// Sets the video memory the cache may use, 0 for no limit. Over budget, textures unused for the longest time are released a few per frame.
+    /// </summary>
+    void SetBudget(const size_t iBudgetBytes)
+    {
+        m_iBudgetBytes = iBudgetBytes;
+    }
+
+    size_t GetBudget() const { return m_iBudgetBytes; }
+
+    /// <summary>
+    /// Enables mip tail first streaming of large textures; iBudgetBytes is uploaded per frame, at least one mip
+    /// </summary>
+    void SetStreaming(const bool bStreaming, const size_t iBudgetBytes)
+    {
+        m_bStreaming = bStreaming;
+        m_iStreamingBudgetBytes = iBudgetBytes;
+    }
+
+    bool GetStreaming() const { return m_bStreaming; }
+
+    /// <summary>
+    /// Lets workers create the complete textures of streaming textures, instead of uploading mip by mip on the render thread
+    /// </summary>
+    void SetAsyncCreation(const bool bAsyncCreation) { m_bAsyncCreation = bAsyncCreation; }
+    bool GetAsyncCreation() const { return m_bAsyncCreation; }
+    size_t GetStreamingBudget() const { return m_iStreamingBudgetBytes; }
+    size_t GetNumStreaming() const { return m_Streaming.size(); }
+    size_t GetNumAsyncCommits() const { return m_iNumAsyncCommits; }
+    double GetAverageAsyncLatencyMs() const { return m_iNumAsyncCommits > 0 ? m_fTotalAsyncLatencyMs / m_iNumAsyncCommits : 0.0; } // From the miss to the swap
+
+    /// <summary>
+    /// Logs how long texture misses stalled the render thread since the last call, and starts over
+    /// </summary>
+    void LogHitchHistogram()
+    {
+        static const wchar_t* const Labels[sm_iNumHitchBuckets] = { L"< 0.25", L"< 0.5", L"< 1", L"< 2", L"< 4", L"< 8", L"< 16", L">= 16" };
+
+        Utils::LogMessagef(L"Texture misses by stall time (streaming %s, %Iu textures streaming):", m_bStreaming ? L"on" : L"off", m_Streaming.size());
+        for (size_t i = 0; i < sm_iNumHitchBuckets; i++)
+        {
+            Utils::LogMessagef(L"  %s ms: %Iu", Labels[i], m_HitchHistogram[i]);
+        }
+        Utils::LogMessagef(L"  worst %.2f ms", m_fWorstHitchMs);
+
+        m_HitchHistogram.fill(0);
+        m_fWorstHitchMs = 0.0;
     }
 
     void BindTextures()
     {
+        m_FogMapPool.Commit(); // Fog maps added since the last draw, whether or not their page is already bound
+
         if (m_iDirtyBeginSlot > m_iDirtyEndSlot) // Anything prepared?
         {
             return;
@@ -81,6 +464,7 @@ public:
 
         // TODO Load the noise texture into the shader (perhaps it should be taken out from another place. So far so)
         m_DeviceContext.PSSetShaderResources(sm_iMaxSlots, 1, m_NoiseTextureData.pShaderResourceView.GetAddressOf());
+        m_PaletteCache.BindPalettes();
 
         ResetDirtySlots();
     }
@@ -91,14 +475,137 @@ public:
         for (UINT n = 0; n <= sm_iMaxSlots; ++n)
             m_DeviceContext.PSSetShaderResources(n, 1, nullSRV); // To be able to release textures
         m_Textures.clear();
+        m_PaletteIndexTextures.clear();
+        m_ReusePool.clear();
+        m_PrecacheQueue.clear();
+        m_PrecacheIds.clear();
+        m_Streaming.clear();
+        m_iResidentBytes = 0;
+        m_iNumReused = 0;
+        m_iNumRebuilt = 0;
+        m_Evicted.clear();
+        m_iNumEvictions = 0;
+        m_iNumReloads = 0;
+        m_iNumAsyncCommits = 0;
+        m_fTotalAsyncLatencyMs = 0.0;
+        m_PaletteCache.Flush();
+        m_TextureOverrides.FlushLevel();
+        m_LightmapAtlas.Flush();
+        m_TextureConverter.ResetStats();
+
+        ResetDirtySlots();
+    }
+
+    /// <summary>
+    /// Drops the textures of the level, since cache IDs aren't stable across levels. Textures are kept aside by content
+    /// for a few frames so the ones the next level shares (HUD, fonts, common packages) don't have to be converted again.
+    /// </summary>
+    void FlushLevel()
+    {
+        ID3D11ShaderResourceView* const nullSRV[1] = { nullptr };
+        for (UINT n = 0; n <= sm_iMaxSlots; ++n)
+            m_DeviceContext.PSSetShaderResources(n, 1, nullSRV);
+
+        ReleaseReusePool();
+        for (auto* pTextures : { &m_Textures, &m_PaletteIndexTextures })
+        {
+            for (auto& t : *pTextures)
+            {
+                if (t.second.iContentHash == 0 || !m_ReusePool.try_emplace(t.second.iContentHash, std::move(t.second)).second)
+                {
+                    m_iResidentBytes -= t.second.iNumBytes;
+                }
+            }
+            pTextures->clear();
+        }
+        m_Streaming.clear();
+        m_iReusePoolFrame = m_iFrame;
+        m_iNumReused = 0;
+        m_iNumRebuilt = 0;
+
+        m_Evicted.clear();
+        m_iNumEvictions = 0;
+        m_iNumReloads = 0;
+        m_iNumAsyncCommits = 0;
+        m_fTotalAsyncLatencyMs = 0.0;
+        m_PaletteCache.Flush();
+        m_TextureOverrides.FlushLevel();
+        m_LightmapAtlas.Flush();
+        m_TextureConverter.ResetStats();
 
         ResetDirtySlots();
     }
 
+    /// <summary>
+    /// Changes compression of palette textures, textures already converted are dropped
+    /// </summary>
+    void SetCompression(const TextureConverter::Compression compression, const std::wstring& cacheDirectory)
+    {
+        Flush();
+        m_TextureConverter.SetCompression(compression, cacheDirectory);
+    }
+
+    TextureConverter::Compression GetCompression() const { return m_TextureConverter.GetCompression(); }
+
     size_t GetNumTextures() const
     {
-        return m_Textures.size();
+        return m_Textures.size() + m_PaletteIndexTextures.size();
+    }
+
+    size_t GetNumBytes() const { return m_iResidentBytes; }
+    size_t GetNumEvictions() const { return m_iNumEvictions; }
+    size_t GetNumReloads() const { return m_iNumReloads; } // Evicted textures that were needed again
+    size_t GetNumLazyLoads() const { return m_iNumLazyLoads; }
+    size_t GetNumReused() const { return m_iNumReused; } // Taken over from the previous level
+    size_t GetNumRebuilt() const { return m_iNumRebuilt; } // Converted since the last level change
+
+    size_t GetNumBytesSaved() const
+    {
+        size_t iNumBytesSaved = 0;
+        for (const auto* pTextures : { &m_Textures, &m_PaletteIndexTextures })
+            for (const auto& t : *pTextures)
+                iNumBytesSaved += t.second.iNumUncompressedBytes - std::min(t.second.iNumBytes, t.second.iNumUncompressedBytes);
+        return iNumBytesSaved;
+    }
+
+    size_t GetNumPalettes() const { return m_PaletteCache.GetNumPalettes(); }
+    size_t GetNumPaletteUpdates() const { return m_PaletteCache.GetNumUpdates(); }
+
+    size_t GetNumCompressed() const { return m_TextureConverter.GetNumCompressed(); }
+    size_t GetNumLoadedFromCache() const { return m_TextureConverter.GetNumLoadedFromCache(); }
+    size_t GetNumRealtimeUpdates() const { return m_TextureConverter.GetNumRealtimeUpdates(); }
+    size_t GetNumRealtimeBytes() const { return m_TextureConverter.GetNumRealtimeBytes(); }
+    double GetRealtimeTimeMs() const { return m_TextureConverter.GetRealtimeTimeMs(); }
+
+    /// <summary>
+    /// Textures of the cache with the pages and palettes it manages, and the system memory still held for them:
+    /// conversion scratch data, textures being precached or streamed, and the upload state of realtime textures
+    /// </summary>
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage;
+        Usage.iCPUBytes = m_TextureConverter.GetNumScratchBytes();
+        Usage.iGPUBytes = m_iResidentBytes + m_NoiseTextureData.iNumBytes;
+        Usage.iNumObjects = m_Textures.size() + m_PaletteIndexTextures.size() + m_ReusePool.size() + 1;
+
+        for (const auto* pTextures : { &m_Textures, &m_PaletteIndexTextures })
+            for (const auto& t : *pTextures)
+                Usage.iCPUBytes += TextureConverter::GetRealtimeBytes(t.second);
+        for (const PrecachedTexture& Precached : m_PrecacheQueue)
+            if (Precached.pPrepared) // Released once its texture is created
+                Usage.iCPUBytes += TextureConverter::GetPreparedBytes(*Precached.pPrepared);
+        for (const StreamingTexture& Streaming : m_Streaming)
+        {
+            if (Streaming.pState->bReady.load(std::memory_order_acquire)) // The others are still being converted by a worker
+                Usage.iCPUBytes += TextureConverter::GetPreparedBytes(*Streaming.pPrepared);
+        }
+
+        Usage += m_PaletteCache.GetMemoryUsage();
+        Usage += m_LightmapAtlas.GetMemoryUsage();
+        Usage += m_FogMapPool.GetMemoryUsage();
+        return Usage;
     }
+    bool BenchmarkP8Conversion(double& referenceMs, double& simdMs) const { return m_TextureConverter.BenchmarkP8Conversion(referenceMs, simdMs); }
 
     void PrintSizeHistogram(UCanvas& c) const
     {
@@ -123,6 +630,257 @@ public:
     }
 
 protected:
+    static const size_t sm_iMaxEvictionsPerFrame = 32;
+    static const size_t sm_iReuseFrames = 120; // Textures of the previous level are kept this long
+    static const size_t sm_iNumHitchBuckets = 8;
+    static const size_t sm_iPrecacheChunkSize = 64; // Textures converted before their device resources are created and the converted data released
+    static const QWORD sm_iLightmapPageId = 0xFFFFFFFF00000000ull; // Slot IDs of lightmap atlas pages, no cache ID has the upper bits all set
+    static const QWORD sm_iFogMapPageId = 0xFFFFFFFF00010000ull; // Slot IDs of fog map pool pages
+
+    const TextureConverter::TextureData& Insert(const long long CacheID, const bool bPaletteIndices, TextureConverter::TextureData&& NewData)
+    {
+        NewData.iLastUsedFrame = m_iFrame;
+        m_iResidentBytes += NewData.iNumBytes;
+        if (m_Evicted.erase(std::make_pair(CacheID, bPaletteIndices)) > 0)
+        {
+            m_iNumReloads++;
+        }
+
+        auto& Textures = bPaletteIndices ? m_PaletteIndexTextures : m_Textures;
+        return Textures.emplace(CacheID, std::move(NewData)).first->second;
+    }
+
+    /// <summary>
+    /// Result of the worker, read by the render thread once bReady is set
+    /// </summary>
+    struct StreamingState
+    {
+        std::atomic<bool> bReady = false;
+        TextureConverter::TextureData Data; // Complete texture if the worker created it
+        std::chrono::high_resolution_clock::time_point QueueTime;
+    };
+
+    /// <summary>
+    /// Texture of the engine precache pass, its content hash is taken before the Unreal data is unloaded again
+    /// </summary>
+    struct PrecachedTexture
+    {
+        long long CacheID;
+        uint64_t iContentHash;
+        std::unique_ptr<TextureConverter::PreparedTexture> pPrepared;
+    };
+
+    /// <summary>
+    /// Texture whose full mip chain is converted on a worker, committed by UpdateStreaming()
+    /// </summary>
+    struct StreamingTexture
+    {
+        long long CacheID;
+        bool bPaletteIndices;
+        uint64_t iContentHash;
+        std::shared_ptr<TextureConverter::PreparedTexture> pPrepared;
+        std::shared_ptr<StreamingState> pState;
+    };
+
+    void QueueStreaming(const FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices, const uint64_t iContentHash)
+    {
+        std::shared_ptr<TextureConverter::PreparedTexture> pPrepared = m_TextureConverter.CreatePreparedTexture(Texture, PolyFlags, bPaletteIndices);
+        assert(pPrepared);
+        auto pState = std::make_shared<StreamingState>();
+        pState->QueueTime = std::chrono::high_resolution_clock::now();
+
+        m_JobSystem.Submit([pPrepared, pState, pConverter = m_bAsyncCreation ? &m_TextureConverter : nullptr]()
+        {
+            TextureConverter::Prepare(*pPrepared);
+            TextureConverter::ReleasePreparedSource(*pPrepared); // Mips are uploaded from the converted data
+            if (pConverter)
+            {
+                try
+                {
+                    pState->Data = pConverter->CreatePreparedAsync(*pPrepared);
+                }
+                catch (const Utils::ComException&)
+                {
+                    // Left to the mip by mip upload on the render thread
+                }
+            }
+            pState->bReady.store(true, std::memory_order_release);
+        });
+
+        m_Streaming.push_back({ Texture.CacheID, bPaletteIndices, iContentHash, std::move(pPrepared), std::move(pState) });
+    }
+
+    /// <summary>
+    /// Swaps in textures the workers have created, and uploads the next larger mips of the others up to the per frame budget
+    /// </summary>
+    void UpdateStreaming()
+    {
+        const auto Now = std::chrono::high_resolution_clock::now();
+        size_t iUploadedBytes = 0;
+        for (auto it = m_Streaming.begin(); it != m_Streaming.end();)
+        {
+            StreamingState& State = *it->pState;
+            if (!State.bReady.load(std::memory_order_acquire))
+            {
+                ++it;
+                continue;
+            }
+
+            auto& Textures = it->bPaletteIndices ? m_PaletteIndexTextures : m_Textures;
+            auto itTexture = Textures.find(it->CacheID);
+            if (itTexture == Textures.end()) // Evicted meanwhile
+            {
+                it = m_Streaming.erase(it);
+                continue;
+            }
+
+            if (State.Data.pTexture)
+            {
+                const TextureConverter::TextureData& Placeholder = itTexture->second;
+                State.Data.iLastUsedFrame = Placeholder.iLastUsedFrame;
+                State.Data.iContentHash = it->iContentHash;
+                m_iResidentBytes = m_iResidentBytes - Placeholder.iNumBytes + State.Data.iNumBytes;
+                std::replace(m_PreparedSRVs.begin(), m_PreparedSRVs.end(), Placeholder.pShaderResourceView.Get(), State.Data.pShaderResourceView.Get());
+
+                Textures.erase(itTexture);
+                Textures.emplace(it->CacheID, std::move(State.Data));
+                m_TextureConverter.AddPreparedStats(*it->pPrepared);
+
+                m_iNumAsyncCommits++;
+                m_fTotalAsyncLatencyMs += std::chrono::duration<double, std::milli>(Now - State.QueueTime).count();
+                it = m_Streaming.erase(it);
+                continue;
+            }
+
+            if (iUploadedBytes >= m_iStreamingBudgetBytes && iUploadedBytes > 0)
+            {
+                ++it;
+                continue;
+            }
+
+            TextureConverter::TextureData& Data = itTexture->second;
+            while (Data.iFirstResidentMip > 0 && (iUploadedBytes < m_iStreamingBudgetBytes || iUploadedBytes == 0))
+            {
+                ID3D11ShaderResourceView* const pOldSRV = Data.pShaderResourceView.Get();
+                iUploadedBytes += m_TextureConverter.UploadPreparedMip(Data, *it->pPrepared, Data.iFirstResidentMip - 1);
+                std::replace(m_PreparedSRVs.begin(), m_PreparedSRVs.end(), pOldSRV, Data.pShaderResourceView.Get());
+            }
+
+            if (Data.iFirstResidentMip == 0)
+            {
+                Data.iContentHash = it->iContentHash;
+                it = m_Streaming.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    void AddHitch(const double fMs)
+    {
+        static const double Limits[sm_iNumHitchBuckets - 1] = { 0.25, 0.5, 1.0, 2.0, 4.0, 8.0, 16.0 };
+        const size_t iBucket = std::upper_bound(std::begin(Limits), std::end(Limits), fMs) - std::begin(Limits);
+        m_HitchHistogram[iBucket]++;
+        m_fWorstHitchMs = std::max(m_fWorstHitchMs, fMs);
+    }
+
+    /// <summary>
+    /// Hash of format, size, masking, palette and the first mip; 0 for realtime textures, which change anyway
+    /// </summary>
+    static uint64_t GetContentHash(const FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices)
+    {
+        if (Texture.bRealtime || Texture.bRealtimeChanged || !Texture.Mips[0])
+        {
+            return 0;
+        }
+
+        const FMipmapBase& Mip = *Texture.Mips[0];
+        const size_t iMipBytes = TextureConverter::GetSourceMipBytes(Texture.Format, Mip);
+
+        const uint32_t Header[] = { Texture.Format, static_cast<uint32_t>(Mip.USize), static_cast<uint32_t>(Mip.VSize), static_cast<uint32_t>(Texture.NumMips), (PolyFlags & PF_Masked) != 0, bPaletteIndices };
+        uint64_t iHash = Utils::HashBytes(Header, sizeof(Header));
+        if (Texture.Palette)
+        {
+            iHash = Utils::HashBytes(Texture.Palette, sizeof(FColor) * 256, iHash);
+        }
+        iHash = Utils::HashBytes(Mip.DataPtr, iMipBytes, iHash);
+
+        return iHash == 0 ? 1 : iHash;
+    }
+
+    void LoadLazy(FTextureInfo& Texture)
+    {
+        if (m_bLazyTextures && Texture.Texture) // lightmaps and fog maps have no UTexture, Load() would dereference it
+        {
+            Texture.Load();
+            m_iNumLazyLoads++;
+        }
+    }
+
+    /// <summary>
+    /// Releases the mip data once the GPU texture exists; realtime textures keep it, it's their update source
+    /// </summary>
+    void UnloadLazy(FTextureInfo& Texture)
+    {
+        if (m_bLazyTextures && Texture.Texture && !Texture.bRealtime && !Texture.bRealtimeChanged && !Texture.bParametric)
+        {
+            Texture.Unload();
+        }
+    }
+
+    void ReleaseReusePool()
+    {
+        for (const auto& t : m_ReusePool)
+        {
+            m_iResidentBytes -= t.second.iNumBytes;
+        }
+        m_ReusePool.clear();
+    }
+
+    void EvictOverBudget()
+    {
+        if (m_iBudgetBytes == 0 || m_iResidentBytes <= m_iBudgetBytes)
+        {
+            return;
+        }
+
+        // Candidates are textures not used since the last frame, which has been drawn completely, and not prepared for a slot
+        typedef std::tuple<size_t, long long, bool> Candidate; // Last used frame, cache ID, palette indices
+        m_EvictionCandidates.clear();
+        for (const bool bPaletteIndices : { false, true })
+        {
+            for (const auto& t : bPaletteIndices ? m_PaletteIndexTextures : m_Textures)
+            {
+                if (t.second.iLastUsedFrame + 1 < m_iFrame && std::find(m_PreparedIds.begin(), m_PreparedIds.end(), t.first) == m_PreparedIds.end())
+                {
+                    m_EvictionCandidates.emplace_back(t.second.iLastUsedFrame, t.first, bPaletteIndices);
+                }
+            }
+        }
+
+        const size_t iNumCandidates = std::min(m_EvictionCandidates.size(), sm_iMaxEvictionsPerFrame);
+        std::partial_sort(m_EvictionCandidates.begin(), m_EvictionCandidates.begin() + iNumCandidates, m_EvictionCandidates.end());
+
+        for (size_t i = 0; i < iNumCandidates && m_iResidentBytes > m_iBudgetBytes; i++)
+        {
+            const auto& [iLastUsedFrame, CacheID, bPaletteIndices] = m_EvictionCandidates[i];
+            auto& Textures = bPaletteIndices ? m_PaletteIndexTextures : m_Textures;
+            auto it = Textures.find(CacheID);
+            m_iResidentBytes -= it->second.iNumBytes;
+            Textures.erase(it);
+
+            m_Evicted.insert(std::make_pair(CacheID, bPaletteIndices));
+            m_iNumEvictions++;
+        }
+    }
+
+    struct EvictedHash
+    {
+        size_t operator()(const std::pair<long long, bool>& Key) const { return std::hash<long long>()(Key.first) ^ static_cast<size_t>(Key.second); }
+    };
+
     void ResetDirtySlots()
     {
         m_iDirtyBeginSlot = m_PreparedIds.size() - 1;
@@ -130,11 +888,58 @@ protected:
     }
 
     ID3D11DeviceContext& m_DeviceContext;
+    JobSystem& m_JobSystem;
 
     TextureConverter m_TextureConverter;
     std::unordered_map<long long, TextureConverter::TextureData> m_Textures;
+    std::unordered_map<long long, TextureConverter::TextureData> m_PaletteIndexTextures;
+
+    PaletteCache m_PaletteCache;
+    bool m_bPaletteTextures = false;
+
+    TextureOverrides m_TextureOverrides;
+
+    LightmapAtlas m_LightmapAtlas;
+    bool m_bLightmapAtlas = false;
+
+    FogMapPool m_FogMapPool;
+    bool m_bFogMapPool = false;
+
+    // Eviction
+    size_t m_iFrame = 0;
+    size_t m_iBudgetBytes = 0;
+    size_t m_iResidentBytes = 0;
+    size_t m_iNumEvictions = 0;
+    size_t m_iNumReloads = 0;
+    std::unordered_set<std::pair<long long, bool>, EvictedHash> m_Evicted;
+    std::vector<std::tuple<size_t, long long, bool>> m_EvictionCandidates; // Reused between frames
+
+    // Reuse across level changes
+    std::unordered_map<uint64_t, TextureConverter::TextureData> m_ReusePool;
+    size_t m_iReusePoolFrame = 0;
+    size_t m_iNumReused = 0;
+    size_t m_iNumRebuilt = 0;
+
+    bool m_bLazyTextures = false;
+    size_t m_iNumLazyLoads = 0;
+
+    // Textures of the engine precache pass, waiting for FinishPrecache()
+    std::vector<PrecachedTexture> m_PrecacheQueue;
+    std::unordered_set<long long> m_PrecacheIds;
+    std::chrono::high_resolution_clock::time_point m_PrecacheStartTime;
+
+    // Mip tail first streaming
+    bool m_bStreaming = false;
+    bool m_bAsyncCreation = false;
+    size_t m_iStreamingBudgetBytes = 0;
+    size_t m_iNumAsyncCommits = 0;
+    double m_fTotalAsyncLatencyMs = 0.0;
+    std::vector<StreamingTexture> m_Streaming;
+    std::array<size_t, sm_iNumHitchBuckets> m_HitchHistogram = {};
+    double m_fWorstHitchMs = 0.0;
 
     std::array<decltype(FTextureInfo::CacheID), sm_iMaxSlots> m_PreparedIds;
+    std::array<bool, sm_iMaxSlots> m_PreparedPaletteIndices = {};
     std::array<ID3D11ShaderResourceView*, sm_iMaxSlots> m_PreparedSRVs;
 
     // Tracking of which slots need to be bound on BindTextures()
@@ -196,6 +1001,7 @@ protected:
         );
         Utils::SetResourceNameW(m_NoiseTextureData.pShaderResourceView, pszTexName);
 
+        m_NoiseTextureData.iNumBytes = width * height * sizeof(uint32_t);
         m_NoiseTextureData.fMultU = 1.0f; // / (Texture.UClamp * Texture.UScale);
         m_NoiseTextureData.fMultV = 1.0f; // / (Texture.VClamp * Texture.VScale);
     }
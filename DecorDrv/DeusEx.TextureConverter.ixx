@@ -3,7 +3,15 @@
 #include <D3D11.h>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <cassert>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <intrin.h>
+#include <immintrin.h>
 #include <wrl\client.h>
 
 #include <Engine.h>
@@ -11,11 +19,21 @@
 export module DeusEx.TextureConverter;
 
 import Utils;
+import JobSystem;
+import BlockCompressor;
+import DeusEx.AssetPack;
+import DeusEx.TextureOverrides;
 
 using Microsoft::WRL::ComPtr;
 
 export class TextureConverter
 {
+protected:
+    struct RealtimeData;
+    class IFormatConverter;
+    class ConvertedTextureData;
+    class FormatConverterBC;
+
 public:
     struct TextureData
     {
@@ -25,8 +43,15 @@ public:
         TextureData(TextureData&& Other)
             : fMultU(Other.fMultU)
             , fMultV(Other.fMultV)
+            , iNumBytes(Other.iNumBytes)
+            , iNumUncompressedBytes(Other.iNumUncompressedBytes)
+            , bPaletteIndices(Other.bPaletteIndices)
+            , iLastUsedFrame(Other.iLastUsedFrame)
+            , iContentHash(Other.iContentHash)
+            , iFirstResidentMip(Other.iFirstResidentMip)
             , pTexture(std::move(Other.pTexture))
             , pShaderResourceView(std::move(Other.pShaderResourceView))
+            , pRealtime(std::move(Other.pRealtime))
         {
         }
 
@@ -35,13 +60,102 @@ public:
         float fMultU;
         float fMultV;
 
+        size_t iNumBytes = 0; // Video memory of all mips
+        size_t iNumUncompressedBytes = 0; // Video memory of all mips as RGBA8
+        bool bPaletteIndices = false; // R8 palette indices, colors come from PaletteCache
+        size_t iLastUsedFrame = 0; // Maintained by TextureCache for eviction
+        uint64_t iContentHash = 0; // Maintained by TextureCache for reuse across levels, 0 if not reusable
+        INT iFirstResidentMip = 0; // Larger mips of streamed textures are still being uploaded
+
         ComPtr<ID3D11Texture2D> pTexture;
         ComPtr<ID3D11ShaderResourceView> pShaderResourceView;
+        std::shared_ptr<RealtimeData> pRealtime; // Upload state of realtime P8 textures
+    };
+
+    /// <summary>
+    /// Texture converted by Prepare() off the render thread, from its own copy of the Unreal data, as Unreal data is only valid while the texture is locked.
+    /// The device resources are created later by CreatePrepared().
+    /// </summary>
+    class PreparedTexture
+    {
+        friend class TextureConverter;
+
+    public:
+        PreparedTexture(const FTextureInfo& Texture, const DWORD PolyFlags)
+            : m_Info(Texture)
+            , m_PolyFlags(PolyFlags)
+            , m_Mips(Texture.NumMips)
+            , m_MipData(Texture.NumMips)
+            , m_Name(Texture.Texture ? Texture.Texture->GetName() : L"")
+        {
+            m_Info.Texture = nullptr; // The object may be gone by the time a worker creates the texture
+            for (INT i = 0; i < Texture.NumMips; i++)
+            {
+                assert(Texture.Mips[i]);
+                const FMipmapBase& UnrealMip = *Texture.Mips[i];
+                m_MipData[i].assign(UnrealMip.DataPtr, UnrealMip.DataPtr + GetSourceMipBytes(Texture.Format, UnrealMip));
+                m_Mips[i] = UnrealMip;
+                m_Mips[i].DataPtr = m_MipData[i].data();
+                m_Info.Mips[i] = &m_Mips[i];
+            }
+
+            if (Texture.Palette)
+            {
+                memcpy(m_Palette.data(), Texture.Palette, sizeof(m_Palette));
+                m_Info.Palette = m_Palette.data();
+            }
+        }
+
+        const FTextureInfo& GetInfo() const { return m_Info; }
+        DWORD GetPolyFlags() const { return m_PolyFlags; }
+
+    private:
+        FTextureInfo m_Info; // Points at the copies below
+        DWORD m_PolyFlags;
+        bool m_bPaletteIndices = false;
+        bool m_bSRGB = false; // Taken when the texture is queued, SetSRGB() may change the converter's while a worker creates it
+        std::wstring m_Name;
+        std::vector<FMipmapBase> m_Mips;
+        std::vector<std::vector<BYTE>> m_MipData;
+        std::array<FColor, 256> m_Palette;
+
+        std::unique_ptr<ConvertedTextureData> m_pBuffer;
+        std::unique_ptr<IFormatConverter> m_pConverter; // Keeps data the buffer references alive, like mapped cache packs
+        FormatConverterBC* m_pConverterBC = nullptr;
     };
 
-    explicit TextureConverter(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext)
+    /// <summary>
+    /// Size of an Unreal mip in its source format
+    /// </summary>
+    static size_t GetSourceMipBytes(const ETextureFormat Format, const FMipmapBase& Mip)
+    {
+        switch (Format)
+        {
+        case ETextureFormat::TEXF_P8:
+            return Mip.USize * Mip.VSize;
+        case ETextureFormat::TEXF_DXT1:
+            return std::max(Mip.USize / 4, 1) * std::max(Mip.VSize / 4, 1) * 8;
+        default:
+            return Mip.USize * Mip.VSize * 4;
+        }
+    }
+
+    /// <summary>
+    /// Block compression of palette textures
+    /// </summary>
+    enum class Compression
+    {
+        None,
+        BC, // BC1 for opaque, BC3 for masked textures
+        BC7, // Higher quality, falls back to BC on feature level 10
+    };
+
+    explicit TextureConverter(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, JobSystem& jobSystem)
         : m_Device(Device)
         , m_DeviceContext(DeviceContext)
+        , m_JobSystem(jobSystem)
+        , m_FormatConverterP8(m_ConvertedTextureData, jobSystem)
+        , m_FormatConverterBC(m_ConvertedTextureData, jobSystem)
     {
 
         // Create placeholder texture
@@ -88,17 +202,338 @@ public:
     TextureConverter(const TextureConverter&) = delete;
     TextureConverter& operator=(const TextureConverter&) = delete;
 
-    TextureData Convert(const FTextureInfo& Texture, const DWORD PolyFlags) const
+    /// <summary>
+    /// Creates a texture from Unreal data; with bPaletteIndices a P8 texture keeps its indices and the shader looks up the palette
+    /// </summary>
+    TextureData Convert(const FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices = false)
     {
-        IFormatConverter* const pConverter = m_FormatConverters[Texture.Format];
+        IFormatConverter* const pConverter = SelectConverter(Texture, bPaletteIndices);
         if (pConverter == nullptr)
         {
             return m_PlaceholderTexture;
         }
 
+        pConverter->Convert(Texture, PolyFlags);
+
+        return CreateTexture(Texture, PolyFlags, bPaletteIndices, m_bSRGB, *pConverter, m_ConvertedTextureData);
+    }
+
+    /// <summary>
+    /// Creates a texture from a replacement image, handed to the device straight from the file mapping. Texture coordinates keep the scale of the Unreal texture.
+    /// </summary>
+    TextureData CreateOverride(const FTextureInfo& Texture, const TextureOverrides::Image& Image)
+    {
+        TextureData OutputTexture;
+
+        D3D11_TEXTURE2D_DESC TextureDesc;
+        TextureDesc.Width = Image.GetWidth();
+        TextureDesc.Height = Image.GetHeight();
+        TextureDesc.MipLevels = Image.GetNumMips();
+        TextureDesc.ArraySize = 1;
+        TextureDesc.Format = m_bSRGB ? ToSRGB(Image.GetFormat()) : Image.GetFormat();
+        TextureDesc.SampleDesc.Count = 1;
+        TextureDesc.SampleDesc.Quality = 0;
+        TextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
+        TextureDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        TextureDesc.CPUAccessFlags = 0;
+        TextureDesc.MiscFlags = 0;
+
+        const wchar_t* const pszTexName = Texture.Texture ? Texture.Texture->GetName() : nullptr;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateTexture2D(&TextureDesc, Image.GetSubResourceData(), &OutputTexture.pTexture),
+            "Failed to create override texture '%s'.", pszTexName
+        );
+        Utils::SetResourceNameW(OutputTexture.pTexture, pszTexName);
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
+        ShaderResourceViewDesc.Format = TextureDesc.Format;
+        ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
+        ShaderResourceViewDesc.Texture2D.MipLevels = TextureDesc.MipLevels;
+        ShaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(OutputTexture.pTexture.Get(), &ShaderResourceViewDesc, &OutputTexture.pShaderResourceView),
+            "Failed to create SRV for override '%s'.", pszTexName
+        );
+        Utils::SetResourceNameW(OutputTexture.pShaderResourceView, pszTexName);
+
+        OutputTexture.fMultU = 1.0f / (Texture.UClamp * Texture.UScale);
+        OutputTexture.fMultV = 1.0f / (Texture.VClamp * Texture.VScale);
+        OutputTexture.iNumBytes = Image.GetNumBytes();
+        for (UINT i = 0; i < TextureDesc.MipLevels; i++)
+        {
+            OutputTexture.iNumUncompressedBytes += GetMipBytes(DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM, std::max(TextureDesc.Width >> i, 1u), std::max(TextureDesc.Height >> i, 1u));
+        }
+
+        return OutputTexture;
+    }
+
+    /// <summary>
+    /// First mip uploaded right away if the texture is streamed, that is the first mip no larger than sm_iStreamingTailSize; 0 if the texture isn't streamed
+    /// </summary>
+    INT GetStreamingFirstMip(const FTextureInfo& Texture, const bool bPaletteIndices)
+    {
+        if (Texture.bRealtime || Texture.bRealtimeChanged || Texture.NumMips < 2 || Texture.UClamp != Texture.USize || Texture.VClamp != Texture.VSize)
+        {
+            return 0;
+        }
+
+        IFormatConverter* const pConverter = SelectConverter(Texture, bPaletteIndices);
+        if (pConverter == nullptr)
+        {
+            return 0;
+        }
+
+        INT iFirstMip = 0;
+        while (iFirstMip < Texture.NumMips - 1 && std::max(Texture.Mips[iFirstMip]->USize, Texture.Mips[iFirstMip]->VSize) > sm_iStreamingTailSize)
+        {
+            iFirstMip++;
+        }
+
+        // The tail is converted on its own, it has to end up in the format of the whole chain
+        if (pConverter == &m_FormatConverterBC && !FormatConverterBC::CanCompress(GetMipTail(Texture, iFirstMip)))
+        {
+            return 0;
+        }
+
+        return iFirstMip;
+    }
+
+    /// <summary>
+    /// Creates a texture with only the mips from iFirstMip on; the others are uploaded later by UploadPreparedMip()
+    /// </summary>
+    TextureData ConvertStreamed(const FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices, const INT iFirstMip)
+    {
+        IFormatConverter* const pConverter = SelectConverter(Texture, bPaletteIndices);
+        assert(pConverter);
+
+        pConverter->Convert(GetMipTail(Texture, iFirstMip), PolyFlags);
+
+        return CreateTexture(Texture, PolyFlags, bPaletteIndices, m_bSRGB, *pConverter, m_ConvertedTextureData, iFirstMip);
+    }
+
+    /// <summary>
+    /// Uploads a mip of a streamed texture from its prepared chain and lets the SRV use it, returns the bytes uploaded
+    /// </summary>
+    size_t UploadPreparedMip(TextureData& Data, PreparedTexture& Prepared, const INT iMip)
+    {
+        const FTextureInfo& Info = Prepared.m_Info;
+        const FMipmapBase& Mip = *Info.Mips[iMip];
+        assert(iMip == Data.iFirstResidentMip - 1);
+
+        m_DeviceContext.UpdateSubresource(Data.pTexture.Get(), iMip, nullptr, Prepared.m_pBuffer->GetSubResourceDataSysMem(iMip), Prepared.m_pConverter->GetStride(Mip), 0);
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
+        Data.pShaderResourceView->GetDesc(&ShaderResourceViewDesc);
+        ShaderResourceViewDesc.Texture2D.MostDetailedMip = iMip;
+        ShaderResourceViewDesc.Texture2D.MipLevels = Info.NumMips - iMip;
+
+        ComPtr<ID3D11ShaderResourceView> pShaderResourceView;
+        Utils::ThrowIfFailed(
+            m_Device.CreateShaderResourceView(Data.pTexture.Get(), &ShaderResourceViewDesc, &pShaderResourceView),
+            "Failed to create SRV for mip %d.", iMip
+        );
+        Data.pShaderResourceView = std::move(pShaderResourceView);
+        Data.iFirstResidentMip = iMip;
+
+        if (iMip == 0)
+        {
+            AddPreparedStats(Prepared);
+        }
+
+        return GetMipBytes(Prepared.m_pConverter->GetDXGIFormat(), Mip.USize, Mip.VSize);
+    }
+
+    /// <summary>
+    /// Copies the Unreal data of a static texture for Prepare(), returns nullptr if the texture can't be converted
+    /// </summary>
+    std::unique_ptr<PreparedTexture> CreatePreparedTexture(const FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices = false)
+    {
+        IFormatConverter* const pSelected = SelectConverter(Texture, bPaletteIndices);
+        if (pSelected == nullptr || Texture.bRealtime || Texture.bRealtimeChanged)
+        {
+            return nullptr;
+        }
+
+        auto pPrepared = std::make_unique<PreparedTexture>(Texture, PolyFlags);
+        pPrepared->m_bPaletteIndices = bPaletteIndices;
+        pPrepared->m_bSRGB = m_bSRGB;
+        pPrepared->m_pBuffer = std::make_unique<ConvertedTextureData>();
+        ConvertedTextureData& Buffer = *pPrepared->m_pBuffer;
+
+        // Each prepared texture gets converters of its own, so textures can be prepared in parallel
+        if (pSelected == &m_FormatConverterBC)
+        {
+            auto pConverterBC = std::make_unique<FormatConverterBC>(Buffer, m_JobSystem);
+            pConverterBC->SetHighQuality(m_FormatConverterBC.GetHighQuality());
+            pConverterBC->SetCacheDirectory(m_FormatConverterBC.GetCacheDirectory());
+            pPrepared->m_pConverterBC = pConverterBC.get();
+            pPrepared->m_pConverter = std::move(pConverterBC);
+        }
+        else if (pSelected == &m_FormatConverterP8)
+        {
+            pPrepared->m_pConverter = std::make_unique<FormatConverterP8>(Buffer, m_JobSystem);
+        }
+        else if (pSelected == &m_FormatConverterDXT)
+        {
+            pPrepared->m_pConverter = std::make_unique<FormatConverterDXT>(Buffer);
+        }
+        else if (pSelected == &m_FormatConverterP8Indices)
+        {
+            pPrepared->m_pConverter = std::make_unique<FormatConverterP8Indices>(Buffer);
+        }
+        else
+        {
+            assert(pSelected == &m_FormatConverterIdentity);
+            pPrepared->m_pConverter = std::make_unique<FormatConverterIdentity>(Buffer);
+        }
+
+        return pPrepared;
+    }
+
+    /// <summary>
+    /// Converts a prepared texture on the calling thread, doesn't touch the device
+    /// </summary>
+    static void Prepare(PreparedTexture& Prepared)
+    {
+        Prepared.m_pConverter->Convert(Prepared.m_Info, Prepared.m_PolyFlags);
+    }
+
+    /// <summary>
+    /// Frees the copy of the Unreal data of a prepared texture, if the conversion result doesn't point into it. Mip sizes stay valid for the upload.
+    /// </summary>
+    static void ReleasePreparedSource(PreparedTexture& Prepared)
+    {
+        if (!Prepared.m_pConverter->WantsBuffer())
+        {
+            return;
+        }
+
+        for (FMipmapBase& Mip : Prepared.m_Mips)
+        {
+            Mip.DataPtr = nullptr;
+        }
+        std::vector<std::vector<BYTE>>().swap(Prepared.m_MipData);
+
+        if (Prepared.m_pConverterBC)
+        {
+            Prepared.m_pConverterBC->ReleaseSource();
+        }
+    }
+
+    /// <summary>
+    /// System memory held by a prepared texture: the copy of the Unreal data and the converted mips
+    /// </summary>
+    static size_t GetPreparedBytes(const PreparedTexture& Prepared)
+    {
+        size_t iNumBytes = Prepared.m_pBuffer ? Prepared.m_pBuffer->GetNumBytes() : 0;
+        if (Prepared.m_pConverterBC)
+        {
+            iNumBytes += Prepared.m_pConverterBC->GetNumSourceBytes();
+        }
+        for (const auto& MipData : Prepared.m_MipData)
+        {
+            iNumBytes += MipData.capacity();
+        }
+        return iNumBytes;
+    }
+
+    /// <summary>
+    /// System memory of the upload state of a realtime texture; its staging textures aren't counted as video memory
+    /// </summary>
+    static size_t GetRealtimeBytes(const TextureData& Data)
+    {
+        return Data.pRealtime ? Data.pRealtime->PreviousSource.capacity() + sizeof(RealtimeData) : 0;
+    }
+
+    /// <summary>
+    /// Creates the device resources of a texture converted by Prepare()
+    /// </summary>
+    TextureData CreatePrepared(PreparedTexture& Prepared)
+    {
+        AddPreparedStats(Prepared);
+
+        return CreatePreparedAsync(Prepared);
+    }
+
+    /// <summary>
+    /// Like CreatePrepared(), but only touches the device, so it can run on a worker. Compression stats are added by AddPreparedStats() on the render thread.
+    /// </summary>
+    TextureData CreatePreparedAsync(PreparedTexture& Prepared)
+    {
+        TextureData Data = CreateTexture(Prepared.m_Info, Prepared.m_PolyFlags, Prepared.m_bPaletteIndices, Prepared.m_bSRGB, *Prepared.m_pConverter, *Prepared.m_pBuffer);
+        Utils::SetResourceNameW(Data.pTexture, Prepared.m_Name.c_str());
+        Utils::SetResourceNameW(Data.pShaderResourceView, Prepared.m_Name.c_str());
+        return Data;
+    }
+
+    void AddPreparedStats(const PreparedTexture& Prepared)
+    {
+        if (Prepared.m_pConverterBC)
+        {
+            m_FormatConverterBC.AddStats(*Prepared.m_pConverterBC);
+        }
+    }
+
+protected:
+    static const INT sm_iStreamingTailSize = 32; // Mips up to this size are uploaded with the texture
+    static const size_t sm_iMaxScratchBytes = 8 * 1024 * 1024; // Scratch data kept between frames, enough for the mip chain of a 1024x1024 RGBA texture
+
+    /// <summary>
+    /// Texture info of the mips from iFirstMip on
+    /// </summary>
+    static FTextureInfo GetMipTail(const FTextureInfo& Texture, const INT iFirstMip)
+    {
+        FTextureInfo Tail = Texture;
+        Tail.NumMips = Texture.NumMips - iFirstMip;
+        for (INT i = 0; i < Tail.NumMips; i++)
+        {
+            Tail.Mips[i] = Texture.Mips[iFirstMip + i];
+        }
+        Tail.USize = Tail.UClamp = Texture.Mips[iFirstMip]->USize;
+        Tail.VSize = Tail.VClamp = Texture.Mips[iFirstMip]->VSize;
+        return Tail;
+    }
+
+    IFormatConverter* SelectConverter(const FTextureInfo& Texture, const bool bPaletteIndices)
+    {
+        IFormatConverter* const pConverter = m_FormatConverters[Texture.Format];
+        if (pConverter == nullptr)
+        {
+            return nullptr;
+        }
+
+        if (bPaletteIndices)
+        {
+            assert(Texture.Format == ETextureFormat::TEXF_P8);
+            return &m_FormatConverterP8Indices;
+        }
+
+        // Realtime textures are updated in place with RGBA data, so they are never compressed
         const bool bDynamic = Texture.bRealtimeChanged; // bRealtime isn't always set
+        if (pConverter == &m_FormatConverterP8 && m_Compression != Compression::None && !bDynamic && !Texture.bRealtime && FormatConverterBC::CanCompress(Texture))
+        {
+            return &m_FormatConverterBC;
+        }
 
-        pConverter->Convert(Texture, PolyFlags);
+        return pConverter;
+    }
+
+    /// <summary>
+    /// Creates the texture and its SRV from converted data; with iFirstMip > 0 Buffer holds only the mips from iFirstMip on, the others are left empty.
+    /// Doesn't read the converter settings, it runs on workers for prepared textures.
+    /// </summary>
+    TextureData CreateTexture(const FTextureInfo& Texture, const DWORD PolyFlags, const bool bPaletteIndices, const bool bSRGB, const IFormatConverter& Converter, const ConvertedTextureData& Buffer, const INT iFirstMip = 0)
+    {
+        const IFormatConverter* const pConverter = &Converter;
+        const bool bStreamed = iFirstMip > 0;
+
+        const bool bDynamic = Texture.bRealtimeChanged; // bRealtime isn't always set
+        const bool bRealtimeP8 = bDynamic && Texture.Format == ETextureFormat::TEXF_P8 && Texture.Palette;
+
+        // Realtime RGBA textures only get mip 0 uploaded, the GPU rebuilds the other mips
+        const bool bGenerateMips = bRealtimeP8 && !bPaletteIndices && Texture.NumMips > 1;
 
         TextureData OutputTexture;
 
@@ -107,29 +542,35 @@ public:
         TextureDesc.Height = Texture.VClamp;
         TextureDesc.MipLevels = Texture.NumMips;
         TextureDesc.ArraySize = 1;
-        TextureDesc.Format = pConverter->GetDXGIFormat();
+        TextureDesc.Format = bSRGB && !bPaletteIndices ? ToSRGB(pConverter->GetDXGIFormat()) : pConverter->GetDXGIFormat();
         TextureDesc.SampleDesc.Count = 1;
         TextureDesc.SampleDesc.Quality = 0;
-        TextureDesc.Usage = bDynamic ? D3D11_USAGE::D3D11_USAGE_DEFAULT : D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
+        TextureDesc.Usage = bDynamic || bStreamed ? D3D11_USAGE::D3D11_USAGE_DEFAULT : D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
         //TextureDesc.Usage = bDynamic ? D3D11_USAGE::D3D11_USAGE_DYNAMIC : D3D11_USAGE::D3D11_USAGE_IMMUTABLE;
-        TextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+        TextureDesc.BindFlags = bGenerateMips ? D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET : D3D11_BIND_SHADER_RESOURCE;
         TextureDesc.CPUAccessFlags = 0;
         //TextureDesc.CPUAccessFlags = bDynamic ? D3D11_CPU_ACCESS_FLAG::D3D11_CPU_ACCESS_WRITE : 0;
-        TextureDesc.MiscFlags = 0;
+        TextureDesc.MiscFlags = bGenerateMips ? D3D11_RESOURCE_MISC_GENERATE_MIPS : 0;
 
         const wchar_t* const pszTexName = Texture.Texture ? Texture.Texture->GetName() : nullptr;
 
         Utils::ThrowIfFailed(
-            m_Device.CreateTexture2D(&TextureDesc, m_ConvertedTextureData.GetSubResourceDataArray(), &OutputTexture.pTexture),
+            m_Device.CreateTexture2D(&TextureDesc, bStreamed ? nullptr : Buffer.GetSubResourceDataArray(), &OutputTexture.pTexture),
             "Failed to create texture '%s'.", pszTexName
         );
         Utils::SetResourceNameW(OutputTexture.pTexture, pszTexName);
 
+        for (INT i = iFirstMip; bStreamed && i < Texture.NumMips; i++)
+        {
+            m_DeviceContext.UpdateSubresource(OutputTexture.pTexture.Get(), i, nullptr, Buffer.GetSubResourceDataSysMem(i - iFirstMip), pConverter->GetStride(*Texture.Mips[i]), 0);
+        }
+
+        // The SRV is limited to the mips that have data
         D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc;
         ShaderResourceViewDesc.Format = TextureDesc.Format;
         ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
-        ShaderResourceViewDesc.Texture2D.MipLevels = Texture.NumMips;
-        ShaderResourceViewDesc.Texture2D.MostDetailedMip = 0;
+        ShaderResourceViewDesc.Texture2D.MipLevels = Texture.NumMips - iFirstMip;
+        ShaderResourceViewDesc.Texture2D.MostDetailedMip = iFirstMip;
 
         Utils::ThrowIfFailed(
             m_Device.CreateShaderResourceView(OutputTexture.pTexture.Get(), &ShaderResourceViewDesc, &OutputTexture.pShaderResourceView),
@@ -139,33 +580,287 @@ public:
 
         OutputTexture.fMultU = 1.0f / (Texture.UClamp * Texture.UScale);
         OutputTexture.fMultV = 1.0f / (Texture.VClamp * Texture.VScale);
+        OutputTexture.bPaletteIndices = bPaletteIndices;
+        OutputTexture.iFirstResidentMip = iFirstMip;
+
+        if (bRealtimeP8)
+        {
+            OutputTexture.pRealtime = CreateRealtimeData(Texture, PolyFlags, TextureDesc.Format, bGenerateMips, pszTexName);
+        }
+
+        for (UINT i = 0; i < TextureDesc.MipLevels; i++)
+        {
+            const UINT iWidth = std::max(TextureDesc.Width >> i, 1u);
+            const UINT iHeight = std::max(TextureDesc.Height >> i, 1u);
+            OutputTexture.iNumBytes += GetMipBytes(pConverter->GetDXGIFormat(), iWidth, iHeight);
+            OutputTexture.iNumUncompressedBytes += GetMipBytes(DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM, iWidth, iHeight);
+        }
 
         return OutputTexture;
     }
 
-    void Update(const FTextureInfo& Source, TextureData& Dest, const DWORD PolyFlags) const
+public:
+
+    void Update(const FTextureInfo& Source, TextureData& Dest, const DWORD PolyFlags)
     {
         assert(Source.bRealtimeChanged);
 
-        IFormatConverter* const pConverter = m_FormatConverters[Source.Format];
-        assert(pConverter); // Should have a converter as it was converted succesfully before
+        const auto startTime = std::chrono::high_resolution_clock::now();
+        m_iNumRealtimeUpdates++;
 
-        pConverter->Convert(Source, PolyFlags);
+        if (Dest.pRealtime)
+        {
+            UpdateRealtime(Source, Dest, PolyFlags);
+        }
+        else
+        {
+            // Palette indices are uploaded as they are, the palette itself is updated by PaletteCache
+            IFormatConverter* const pConverter = Dest.bPaletteIndices ? &m_FormatConverterP8Indices : m_FormatConverters[Source.Format];
+            assert(pConverter); // Should have a converter as it was converted succesfully before
 
-        for (int i = 0; i < Source.NumMips; i++)
+            pConverter->Convert(Source, PolyFlags);
+
+            for (int i = 0; i < Source.NumMips; i++)
+            {
+                m_DeviceContext.UpdateSubresource(Dest.pTexture.Get(), i, nullptr, m_ConvertedTextureData.GetSubResourceDataSysMem(i), pConverter->GetStride(*Source.Mips[i]), 0);
+                m_iNumRealtimeBytes += pConverter->GetStride(*Source.Mips[i]) * Source.Mips[i]->VSize;
+            }
+        }
+
+        m_RealtimeTime += std::chrono::high_resolution_clock::now() - startTime;
+    }
+
+    /// <summary>
+    /// Resets the per-frame realtime texture statistics
+    /// </summary>
+    void NewFrame()
+    {
+        m_iNumRealtimeUpdates = 0;
+        m_iNumRealtimeBytes = 0;
+        m_RealtimeTime = std::chrono::high_resolution_clock::duration::zero();
+
+        // An unusually large texture shouldn't pin its scratch data for the rest of the session
+        if (m_ConvertedTextureData.GetNumBytes() > sm_iMaxScratchBytes)
         {
-            m_DeviceContext.UpdateSubresource(Dest.pTexture.Get(), i, nullptr, m_ConvertedTextureData.GetSubResourceDataSysMem(i), sizeof(DWORD) * Source.Mips[i]->USize, 0);
+            m_ConvertedTextureData.Release();
         }
+        if (m_FormatConverterBC.GetNumSourceBytes() > sm_iMaxScratchBytes)
+        {
+            m_FormatConverterBC.ReleaseSource();
+        }
+    }
+
+    /// <summary>
+    /// Sets compression of textures converted from now on, compressed mips are cached in cacheDirectory unless it's empty
+    /// </summary>
+    void SetCompression(const Compression compression, const std::wstring& cacheDirectory)
+    {
+        m_Compression = compression;
+
+        const bool bBC7Supported = m_Device.GetFeatureLevel() >= D3D_FEATURE_LEVEL_11_0;
+        m_FormatConverterBC.SetHighQuality(compression == Compression::BC7 && bBC7Supported);
+        m_FormatConverterBC.SetCacheDirectory(cacheDirectory);
     }
 
+    Compression GetCompression() const { return m_Compression; }
+
+    /// <summary>
+    /// Creates color textures converted from now on with sRGB formats, so sampling returns linear colors
+    /// </summary>
+    void SetSRGB(const bool bSRGB) { m_bSRGB = bSRGB; }
+    bool GetSRGB() const { return m_bSRGB; }
+
+    //Diagnostics
+    size_t GetNumCompressed() const { return m_FormatConverterBC.GetNumCompressed(); }
+    size_t GetNumLoadedFromCache() const { return m_FormatConverterBC.GetNumLoadedFromCache(); }
+    void ResetStats() { m_FormatConverterBC.ResetStats(); }
+    size_t GetNumRealtimeUpdates() const { return m_iNumRealtimeUpdates; } // Per frame
+    size_t GetNumRealtimeBytes() const { return m_iNumRealtimeBytes; } // Uploaded this frame
+    double GetRealtimeTimeMs() const { return std::chrono::duration<double, std::milli>(m_RealtimeTime).count(); }
+    size_t GetNumScratchBytes() const { return m_ConvertedTextureData.GetNumBytes() + m_FormatConverterBC.GetNumSourceBytes(); }
+
+    /// <summary>
+    /// Expands a synthetic 1024x1024 P8 mip chain with the scalar reference and with the vectorized, threaded kernel
+    /// </summary>
+    /// <returns>true if both results are identical</returns>
+    bool BenchmarkP8Conversion(double& referenceMs, double& simdMs) const { return m_FormatConverterP8.Benchmark(referenceMs, simdMs); }
+
 protected:
+    /// <summary>
+    /// Copy of the last uploaded source, to find the rows that changed, and staging textures for mip 0.
+    /// Uploads alternate between the staging textures so mapping one doesn't wait for the copy of the previous frame.
+    /// </summary>
+    struct RealtimeData
+    {
+        std::array<ComPtr<ID3D11Texture2D>, 2> Staging;
+        unsigned int iNextStaging = 0;
+        bool bGenerateMips = false;
+
+        std::vector<BYTE> PreviousSource;
+        std::array<uint32_t, 256> PreviousPalette;
+    };
+
+    std::shared_ptr<RealtimeData> CreateRealtimeData(const FTextureInfo& Texture, const DWORD PolyFlags, const DXGI_FORMAT Format, const bool bGenerateMips, const wchar_t* const pszTexName)
+    {
+        assert(Texture.Mips[0]);
+        const FMipmapBase& Mip = *Texture.Mips[0];
+
+        auto pRealtime = std::make_shared<RealtimeData>();
+        pRealtime->bGenerateMips = bGenerateMips;
+        pRealtime->PreviousSource.assign(Mip.DataPtr, Mip.DataPtr + Mip.USize * Mip.VSize);
+        GetMaskedPalette(Texture, PolyFlags, pRealtime->PreviousPalette);
+
+        D3D11_TEXTURE2D_DESC StagingDesc;
+        StagingDesc.Width = Mip.USize;
+        StagingDesc.Height = Mip.VSize;
+        StagingDesc.MipLevels = 1;
+        StagingDesc.ArraySize = 1;
+        StagingDesc.Format = Format;
+        StagingDesc.SampleDesc.Count = 1;
+        StagingDesc.SampleDesc.Quality = 0;
+        StagingDesc.Usage = D3D11_USAGE::D3D11_USAGE_STAGING;
+        StagingDesc.BindFlags = 0;
+        StagingDesc.CPUAccessFlags = D3D11_CPU_ACCESS_FLAG::D3D11_CPU_ACCESS_WRITE;
+        StagingDesc.MiscFlags = 0;
+
+        for (auto& pStaging : pRealtime->Staging)
+        {
+            Utils::ThrowIfFailed(
+                m_Device.CreateTexture2D(&StagingDesc, nullptr, &pStaging),
+                "Failed to create staging texture for '%s'.", pszTexName
+            );
+            Utils::SetResourceNameW(pStaging, pszTexName);
+        }
+
+        return pRealtime;
+    }
+
+    /// <summary>
+    /// Uploads the rows of mip 0 that changed since the last update, all of them if the palette changed
+    /// </summary>
+    void UpdateRealtime(const FTextureInfo& Source, TextureData& Dest, const DWORD PolyFlags)
+    {
+        RealtimeData& Realtime = *Dest.pRealtime;
+        assert(Source.Mips[0]);
+        const FMipmapBase& Mip = *Source.Mips[0];
+        const size_t iWidth = Mip.USize;
+        const size_t iHeight = Mip.VSize;
+        assert(Realtime.PreviousSource.size() == iWidth * iHeight);
+
+        std::array<uint32_t, 256> Palette;
+        GetMaskedPalette(Source, PolyFlags, Palette);
+        const bool bPaletteChanged = !Dest.bPaletteIndices && Palette != Realtime.PreviousPalette;
+        Realtime.PreviousPalette = Palette;
+
+        size_t iFirstRow = iHeight;
+        size_t iLastRow = 0;
+        for (size_t y = 0; y < iHeight; y++)
+        {
+            const BYTE* const pRow = Mip.DataPtr + y * iWidth;
+            BYTE* const pPreviousRow = Realtime.PreviousSource.data() + y * iWidth;
+            if (bPaletteChanged || memcmp(pRow, pPreviousRow, iWidth) != 0)
+            {
+                memcpy(pPreviousRow, pRow, iWidth);
+                iFirstRow = std::min(iFirstRow, y);
+                iLastRow = y;
+            }
+        }
+
+        if (iFirstRow > iLastRow)
+        {
+            return;
+        }
+
+        ID3D11Texture2D* const pStaging = Realtime.Staging[Realtime.iNextStaging].Get();
+        Realtime.iNextStaging = (Realtime.iNextStaging + 1) % Realtime.Staging.size();
+
+        D3D11_MAPPED_SUBRESOURCE Mapped;
+        Utils::ThrowIfFailed(
+            m_DeviceContext.Map(pStaging, 0, D3D11_MAP::D3D11_MAP_WRITE, 0, &Mapped),
+            "Failed to map staging texture."
+        );
+
+        for (size_t y = iFirstRow; y <= iLastRow; y++)
+        {
+            const BYTE* const pSource = Mip.DataPtr + y * iWidth;
+            BYTE* const pDest = static_cast<BYTE*>(Mapped.pData) + y * Mapped.RowPitch;
+            if (Dest.bPaletteIndices)
+            {
+                memcpy(pDest, pSource, iWidth);
+            }
+            else
+            {
+                FormatConverterP8::Expand(pSource, iWidth, Palette.data(), reinterpret_cast<uint32_t*>(pDest));
+            }
+        }
+
+        m_DeviceContext.Unmap(pStaging, 0);
+
+        const D3D11_BOX Box = { 0, static_cast<UINT>(iFirstRow), 0, static_cast<UINT>(iWidth), static_cast<UINT>(iLastRow + 1), 1 };
+        m_DeviceContext.CopySubresourceRegion(Dest.pTexture.Get(), 0, 0, static_cast<UINT>(iFirstRow), 0, pStaging, 0, &Box);
+        m_iNumRealtimeBytes += (iLastRow + 1 - iFirstRow) * iWidth * (Dest.bPaletteIndices ? 1 : sizeof(uint32_t));
+
+        if (Realtime.bGenerateMips)
+        {
+            m_DeviceContext.GenerateMips(Dest.pShaderResourceView.Get());
+        }
+        else
+        {
+            // Palette indices can't be averaged, the few smaller mips are uploaded as they are
+            for (INT i = 1; i < Source.NumMips; i++)
+            {
+                m_DeviceContext.UpdateSubresource(Dest.pTexture.Get(), i, nullptr, Source.Mips[i]->DataPtr, Source.Mips[i]->USize, 0);
+                m_iNumRealtimeBytes += Source.Mips[i]->USize * Source.Mips[i]->VSize;
+            }
+        }
+    }
+
+    static void GetMaskedPalette(const FTextureInfo& Texture, const DWORD PolyFlags, std::array<uint32_t, 256>& Palette)
+    {
+        memcpy(Palette.data(), Texture.Palette, sizeof(Palette));
+        if (PolyFlags & PF_Masked)
+        {
+            Palette[0] = 0;
+        }
+    }
+
+    static DXGI_FORMAT ToSRGB(const DXGI_FORMAT Format)
+    {
+        switch (Format)
+        {
+        case DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM: return DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        case DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM: return DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM_SRGB;
+        case DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM: return DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM_SRGB;
+        case DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM: return DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM_SRGB;
+        default: return Format;
+        }
+    }
+
+    static size_t GetMipBytes(const DXGI_FORMAT Format, const UINT iWidth, const UINT iHeight)
+    {
+        switch (Format)
+        {
+        case DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM:
+            return BlockCompressor::GetRowPitch(BlockCompressor::Format::BC1, iWidth) * BlockCompressor::GetNumBlocks(iHeight);
+        case DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM:
+        case DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM:
+            return BlockCompressor::GetRowPitch(BlockCompressor::Format::BC3, iWidth) * BlockCompressor::GetNumBlocks(iHeight);
+        case DXGI_FORMAT::DXGI_FORMAT_R8_UNORM:
+            return iWidth * iHeight;
+        default:
+            return iWidth * iHeight * sizeof(uint32_t);
+        }
+    }
+
     ID3D11Device& m_Device;
     ID3D11DeviceContext& m_DeviceContext;
+    JobSystem& m_JobSystem;
 
     class IFormatConverter;
     
     /// <summary>
     /// Scratch data buffer, used to initialize D3D textures.
+    /// All mips share one arena that only grows, so conversions don't allocate once the largest texture has been seen.
     /// </summary>
     class ConvertedTextureData
     {
@@ -173,37 +868,57 @@ protected:
         typedef uint32_t PixelFormat;
         void Resize(const FTextureInfo& Texture, const IFormatConverter& FormatConverter)
         {
-            m_SubResourceData.clear();
-            m_Mips.clear();
-
             m_SubResourceData.resize(Texture.NumMips);
+            m_MipOffsets.resize(Texture.NumMips + 1);
 
             const bool bWantsBuffer = FormatConverter.WantsBuffer();
-            if (bWantsBuffer)
-            {
-                m_Mips.resize(Texture.NumMips);
-            }
 
+            size_t iArenaSize = 0;
             for (size_t i = 0; i < m_SubResourceData.size(); i++)
             {
                 assert(Texture.Mips[i]);
                 const FMipmapBase& UnrealMip = *Texture.Mips[i];
+                m_MipOffsets[i] = iArenaSize;
                 if (bWantsBuffer)
                 {
-                    m_Mips[i].resize(UnrealMip.USize * UnrealMip.VSize);
-                    m_SubResourceData[i].pSysMem = m_Mips[i].data();
+                    iArenaSize += FormatConverter.GetBufferSize(UnrealMip);
                 }
                 m_SubResourceData[i].SysMemPitch = FormatConverter.GetStride(UnrealMip);
+                m_SubResourceData[i].SysMemSlicePitch = 0;
+            }
+            m_MipOffsets[Texture.NumMips] = iArenaSize;
+
+            if (iArenaSize > m_Arena.size())
+            {
+                m_Arena.resize(iArenaSize);
+            }
+
+            for (size_t i = 0; i < m_SubResourceData.size(); i++)
+            {
+                m_SubResourceData[i].pSysMem = bWantsBuffer ? m_Arena.data() + m_MipOffsets[i] : nullptr;
             }
         }
 
-        PixelFormat* GetMipBuffer(const unsigned int iMipLevel) { return m_Mips[iMipLevel].data(); }
+        PixelFormat* GetMipBuffer(const unsigned int iMipLevel) { return m_Arena.data() + m_MipOffsets[iMipLevel]; }
+        const PixelFormat* GetMipBuffer(const unsigned int iMipLevel) const { return m_Arena.data() + m_MipOffsets[iMipLevel]; }
+        size_t GetMipBufferSize(const unsigned int iMipLevel) const { return m_MipOffsets[iMipLevel + 1] - m_MipOffsets[iMipLevel]; }
         const D3D11_SUBRESOURCE_DATA* GetSubResourceDataArray() const { return m_SubResourceData.data(); }
         const void* GetSubResourceDataSysMem(const unsigned int iMipLevel) const { return m_SubResourceData[iMipLevel].pSysMem; }
-        void SetSubResourceDataSysMem(const unsigned int iMipLevel, void* const p) { m_SubResourceData[iMipLevel].pSysMem = p; }
+        void SetSubResourceDataSysMem(const unsigned int iMipLevel, const void* const p) { m_SubResourceData[iMipLevel].pSysMem = p; }
+        size_t GetNumBytes() const { return m_Arena.capacity() * sizeof(PixelFormat); }
+
+        /// <summary>
+        /// Frees the arena, the next Resize() allocates it again
+        /// </summary>
+        void Release()
+        {
+            std::vector<PixelFormat>().swap(m_Arena);
+            m_SubResourceData.clear();
+        }
 
     private:
-        std::vector<std::vector<PixelFormat>> m_Mips; // Scratch data, not required for all conversions
+        std::vector<PixelFormat> m_Arena; // Scratch data, not required for all conversions
+        std::vector<size_t> m_MipOffsets; // Start of each mip in the arena, the last entry is the end
         std::vector<D3D11_SUBRESOURCE_DATA> m_SubResourceData; // References to Unreal data or converted scratch data
     };
     ConvertedTextureData m_ConvertedTextureData;
@@ -220,6 +935,7 @@ protected:
         virtual UINT GetStride(const FMipmapBase& Mip) const = 0;
         virtual DXGI_FORMAT GetDXGIFormat() const = 0;
         virtual bool WantsBuffer() const = 0; // Whether converter requires scratch space for conversion result
+        virtual size_t GetBufferSize(const FMipmapBase& Mip) const { return Mip.USize * Mip.VSize; } // Scratch space in pixels
     };
 
     class FormatConverterIdentity : public IFormatConverter
@@ -246,59 +962,404 @@ protected:
 
     class FormatConverterP8 : public IFormatConverter
     {
+        static const size_t sm_iChunkSize = 64 * 1024; // Pixels expanded by one task
+        static const size_t sm_iMinParallelSize = 2 * sm_iChunkSize; // Smaller textures aren't worth the workers
+
     public:
-        explicit FormatConverterP8(ConvertedTextureData& Buffer) : m_Buffer(Buffer) {};
+        explicit FormatConverterP8(ConvertedTextureData& Buffer, JobSystem& jobSystem) : m_Buffer(Buffer), m_JobSystem(jobSystem) {};
         virtual void Convert(const FTextureInfo& Texture, const DWORD PolyFlags) override
         {
             assert(Texture.Format == ETextureFormat::TEXF_P8);
             assert(Texture.Palette);
 
-            FColor* const Palette = Texture.Palette;
-            
-            // Palette color 0 is the alpha mask color; make that index black w. alpha 0 (black looks best for the border that gets left after masking)
-            if (PolyFlags & PF_Masked)
-            {
-                Palette[0].R = Palette[0].G = Palette[0].B = Palette[0].A = 0;
-            }
+            const uint32_t* const pPalette = reinterpret_cast<const uint32_t*>(Texture.Palette);
+            MaskPalette(Texture, PolyFlags);
 
             m_Buffer.Resize(Texture, *this);
+
+            // Mips are cut in chunks, large textures are expanded on the workers
+            m_Chunks.clear();
+            size_t iNumPixels = 0;
             for (INT i = 0; i < Texture.NumMips; i++)
             {
                 assert(Texture.Mips[i]);
-                const FMipmapBase& UnrealMip = *Texture.Mips[i];
+                const size_t iMipSize = Texture.Mips[i]->USize * Texture.Mips[i]->VSize;
+                for (size_t iBegin = 0; iBegin < iMipSize; iBegin += sm_iChunkSize)
+                {
+                    m_Chunks.push_back({ i, iBegin, std::min(sm_iChunkSize, iMipSize - iBegin) });
+                }
+                iNumPixels += iMipSize;
+            }
 
-                const auto* const pSourceBegin = UnrealMip.DataPtr;
-                const auto* const pSourceEnd = UnrealMip.DataPtr + UnrealMip.USize * UnrealMip.VSize;
-                auto pDest = m_Buffer.GetMipBuffer(i);
+            auto ExpandChunk = [this, &Texture, pPalette](size_t iChunk)
+            {
+                const Chunk& c = m_Chunks[iChunk];
+                Expand(Texture.Mips[c.iMip]->DataPtr + c.iBegin, c.iCount, pPalette, m_Buffer.GetMipBuffer(c.iMip) + c.iBegin);
+            };
 
-                for (const auto* pSource = pSourceBegin; pSource != pSourceEnd; pSource++, pDest++)
+            if (iNumPixels < sm_iMinParallelSize)
+            {
+                for (size_t i = 0; i < m_Chunks.size(); i++)
                 {
-                    *pDest = reinterpret_cast<uint32_t&>(Palette[*pSource]);
+                    ExpandChunk(i);
                 }
             }
+            else
+            {
+                m_JobSystem.ParallelFor(m_Chunks.size(), ExpandChunk);
+            }
+        }
+
+        /// <summary>
+        /// Palette lookup of iCount pixels, with AVX2 gathers when the CPU has them
+        /// </summary>
+        static void Expand(const BYTE* pSource, size_t iCount, const uint32_t* pPalette, uint32_t* pDest)
+        {
+            static const bool bAVX2 = Utils::HasAVX2();
+            if (bAVX2)
+            {
+                ExpandAVX2(pSource, iCount, pPalette, pDest);
+            }
+            else
+            {
+                ExpandScalar(pSource, iCount, pPalette, pDest);
+            }
+        }
+
+        /// <summary>
+        /// Reference implementation, the other kernels must match it bit for bit
+        /// </summary>
+        static void ExpandReference(const BYTE* pSource, size_t iCount, const uint32_t* pPalette, uint32_t* pDest)
+        {
+            for (const BYTE* pSourceEnd = pSource + iCount; pSource != pSourceEnd; pSource++, pDest++)
+            {
+                *pDest = pPalette[*pSource];
+            }
+        }
+
+        bool Benchmark(double& referenceMs, double& simdMs) const
+        {
+            std::mt19937 Random(1234);
+            std::vector<uint32_t> Palette(256);
+            for (auto& Color : Palette)
+            {
+                Color = Random();
+            }
+
+            std::vector<BYTE> Indices;
+            std::vector<size_t> MipOffsets;
+            for (size_t iSize = 1024; iSize > 0; iSize /= 2)
+            {
+                MipOffsets.push_back(Indices.size());
+                Indices.resize(Indices.size() + iSize * iSize);
+            }
+            MipOffsets.push_back(Indices.size());
+            for (auto& Index : Indices)
+            {
+                Index = static_cast<BYTE>(Random());
+            }
+
+            std::vector<uint32_t> Reference(Indices.size());
+            std::vector<uint32_t> Result(Indices.size());
+
+            auto startTime = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i + 1 < MipOffsets.size(); i++)
+            {
+                ExpandReference(&Indices[MipOffsets[i]], MipOffsets[i + 1] - MipOffsets[i], Palette.data(), &Reference[MipOffsets[i]]);
+            }
+            referenceMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+            startTime = std::chrono::high_resolution_clock::now();
+            const size_t iNumChunks = (Indices.size() + sm_iChunkSize - 1) / sm_iChunkSize;
+            m_JobSystem.ParallelFor(iNumChunks, [&](size_t iChunk)
+            {
+                const size_t iBegin = iChunk * sm_iChunkSize;
+                Expand(&Indices[iBegin], std::min(sm_iChunkSize, Indices.size() - iBegin), Palette.data(), &Result[iBegin]);
+            });
+            simdMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+
+            return Reference == Result;
         }
 
         virtual UINT GetStride(const FMipmapBase& Mip) const override { return Mip.USize * sizeof(ConvertedTextureData::PixelFormat); }
         virtual DXGI_FORMAT GetDXGIFormat() const override { return DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM; }
         virtual bool WantsBuffer() const override { return true; }
+
+        static void MaskPalette(const FTextureInfo& Texture, const DWORD PolyFlags)
+        {
+            // Palette color 0 is the alpha mask color; make that index black w. alpha 0 (black looks best for the border that gets left after masking)
+            if (PolyFlags & PF_Masked)
+            {
+                FColor* const Palette = Texture.Palette;
+                Palette[0].R = Palette[0].G = Palette[0].B = Palette[0].A = 0;
+            }
+        }
+    private:
+        static void ExpandScalar(const BYTE* pSource, size_t iCount, const uint32_t* pPalette, uint32_t* pDest)
+        {
+            size_t i = 0;
+            for (; i + 4 <= iCount; i += 4)
+            {
+                pDest[i + 0] = pPalette[pSource[i + 0]];
+                pDest[i + 1] = pPalette[pSource[i + 1]];
+                pDest[i + 2] = pPalette[pSource[i + 2]];
+                pDest[i + 3] = pPalette[pSource[i + 3]];
+            }
+            ExpandReference(pSource + i, iCount - i, pPalette, pDest + i);
+        }
+
+        static void ExpandAVX2(const BYTE* pSource, size_t iCount, const uint32_t* pPalette, uint32_t* pDest)
+        {
+            const int* const pTable = reinterpret_cast<const int*>(pPalette);
+
+            size_t i = 0;
+            for (; i + 16 <= iCount; i += 16)
+            {
+                const __m128i Indices = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pSource + i));
+                const __m256i Colors0 = _mm256_i32gather_epi32(pTable, _mm256_cvtepu8_epi32(Indices), 4);
+                const __m256i Colors1 = _mm256_i32gather_epi32(pTable, _mm256_cvtepu8_epi32(_mm_srli_si128(Indices, 8)), 4);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDest + i), Colors0);
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(pDest + i + 8), Colors1);
+            }
+            _mm256_zeroupper();
+
+            ExpandScalar(pSource + i, iCount - i, pPalette, pDest + i);
+        }
+
+        struct Chunk
+        {
+            INT iMip;
+            size_t iBegin;
+            size_t iCount;
+        };
+
+        ConvertedTextureData& m_Buffer;
+        JobSystem& m_JobSystem;
+        std::vector<Chunk> m_Chunks; // Reused between conversions
+    };
+
+    /// <summary>
+    /// Passes P8 indices through unchanged, the shader looks them up in the palette row of the texture
+    /// </summary>
+    class FormatConverterP8Indices : public FormatConverterIdentity
+    {
+    public:
+        using FormatConverterIdentity::FormatConverterIdentity;
+        virtual UINT GetStride(const FMipmapBase& Mip) const override { return Mip.USize; }
+        virtual DXGI_FORMAT GetDXGIFormat() const override { return DXGI_FORMAT::DXGI_FORMAT_R8_UNORM; }
+    };
+
+    /// <summary>
+    /// Expands P8 textures and block compresses them on the workers: BC1 for opaque, BC3 for masked, BC7 for everything in high quality mode.
+    /// Compressed mips are kept in a pack per texture contents, so a texture is only compressed once.
+    /// </summary>
+    class FormatConverterBC : public IFormatConverter
+    {
+        static const uint32_t sm_iCacheVersion = 2; // Increment when output of the compressor or the cache key changes
+
+    public:
+        explicit FormatConverterBC(ConvertedTextureData& Buffer, JobSystem& jobSystem) : m_Buffer(Buffer), m_JobSystem(jobSystem), m_Expander(m_Source, jobSystem) {};
+
+        /// <summary>
+        /// Block compressed textures need the size of the top mip to be a multiple of the block size
+        /// </summary>
+        static bool CanCompress(const FTextureInfo& Texture)
+        {
+            return Texture.Format == ETextureFormat::TEXF_P8 && Texture.USize == Texture.UClamp && Texture.VSize == Texture.VClamp && Texture.USize % 4 == 0 && Texture.VSize % 4 == 0;
+        }
+
+        virtual void Convert(const FTextureInfo& Texture, const DWORD PolyFlags) override
+        {
+            assert(CanCompress(Texture));
+
+            FormatConverterP8::MaskPalette(Texture, PolyFlags);
+            m_Format = m_bHighQuality ? BlockCompressor::Format::BC7 : (PolyFlags & PF_Masked) ? BlockCompressor::Format::BC3 : BlockCompressor::Format::BC1;
+
+            const uint64_t iKey = GetCacheKey(Texture);
+            const std::wstring CachePath = GetCachePath(iKey);
+
+            m_pPack.reset();
+            if (!CachePath.empty())
+            {
+                m_pPack = std::make_unique<AssetPack>(CachePath);
+                if (IsPackValid(*m_pPack, Texture, iKey))
+                {
+                    m_bWantsBuffer = false;
+                    m_Buffer.Resize(Texture, *this);
+                    for (INT i = 0; i < Texture.NumMips; i++)
+                    {
+                        m_Buffer.SetSubResourceDataSysMem(i, m_pPack->GetBlob(i).pData);
+                    }
+
+                    m_iNumLoadedFromCache++;
+                    return;
+                }
+                m_pPack.reset();
+            }
+
+            m_Expander.Convert(Texture, PolyFlags);
+
+            m_bWantsBuffer = true;
+            m_Buffer.Resize(Texture, *this);
+
+            // A task is a row of blocks of a mip
+            std::vector<std::pair<INT, size_t>> Tasks;
+            for (INT i = 0; i < Texture.NumMips; i++)
+            {
+                for (size_t iRow = 0; iRow < BlockCompressor::GetNumBlocks(Texture.Mips[i]->VSize); iRow++)
+                {
+                    Tasks.emplace_back(i, iRow);
+                }
+            }
+
+            m_JobSystem.ParallelFor(Tasks.size(), [this, &Texture, &Tasks](size_t iTask)
+            {
+                const auto [iMip, iRow] = Tasks[iTask];
+                const FMipmapBase& UnrealMip = *Texture.Mips[iMip];
+                const size_t iRowPitch = BlockCompressor::GetRowPitch(m_Format, UnrealMip.USize);
+                uint8_t* const pDest = reinterpret_cast<uint8_t*>(m_Buffer.GetMipBuffer(iMip)) + iRow * iRowPitch;
+
+                BlockCompressor::CompressRow(m_Format, m_Source.GetMipBuffer(iMip), UnrealMip.USize, UnrealMip.VSize, iRow, pDest);
+            });
+
+            m_iNumCompressed++;
+
+            if (!CachePath.empty())
+            {
+                WritePack(CachePath, iKey, Texture.NumMips);
+            }
+        }
+
+        virtual UINT GetStride(const FMipmapBase& Mip) const override { return static_cast<UINT>(BlockCompressor::GetRowPitch(m_Format, Mip.USize)); }
+        virtual DXGI_FORMAT GetDXGIFormat() const override
+        {
+            switch (m_Format)
+            {
+            case BlockCompressor::Format::BC1: return DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM;
+            case BlockCompressor::Format::BC3: return DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM;
+            default: return DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM;
+            }
+        }
+        virtual bool WantsBuffer() const override { return m_bWantsBuffer; }
+        virtual size_t GetBufferSize(const FMipmapBase& Mip) const override
+        {
+            return GetStride(Mip) * BlockCompressor::GetNumBlocks(Mip.VSize) / sizeof(ConvertedTextureData::PixelFormat);
+        }
+
+        void SetHighQuality(const bool bHighQuality) { m_bHighQuality = bHighQuality; }
+        bool GetHighQuality() const { return m_bHighQuality; }
+        void SetCacheDirectory(const std::wstring& CacheDirectory) { m_CacheDirectory = CacheDirectory; }
+        const std::wstring& GetCacheDirectory() const { return m_CacheDirectory; }
+
+        /// <summary>
+        /// Expanded RGBA mips are only needed while compressing
+        /// </summary>
+        void ReleaseSource() { m_Source.Release(); }
+        size_t GetNumSourceBytes() const { return m_Source.GetNumBytes(); }
+
+        //Diagnostics
+        size_t GetNumCompressed() const { return m_iNumCompressed; }
+        size_t GetNumLoadedFromCache() const { return m_iNumLoadedFromCache; }
+        void ResetStats() { m_iNumCompressed = m_iNumLoadedFromCache = 0; }
+        void AddStats(const FormatConverterBC& Other)
+        {
+            m_iNumCompressed += Other.m_iNumCompressed;
+            m_iNumLoadedFromCache += Other.m_iNumLoadedFromCache;
+        }
+
     private:
+        uint64_t GetCacheKey(const FTextureInfo& Texture) const
+        {
+            const uint32_t Header[] = { static_cast<uint32_t>(m_Format), static_cast<uint32_t>(Texture.USize), static_cast<uint32_t>(Texture.VSize), static_cast<uint32_t>(Texture.NumMips) };
+            uint64_t iHash = Utils::HashBytes(Header, sizeof(Header));
+            iHash = Utils::HashBytes(Texture.Palette, sizeof(FColor) * 256, iHash);
+            for (INT i = 0; i < Texture.NumMips; i++)
+            {
+                iHash = Utils::HashBytes(Texture.Mips[i]->DataPtr, Texture.Mips[i]->USize * Texture.Mips[i]->VSize, iHash);
+            }
+
+            return iHash;
+        }
+
+        std::wstring GetCachePath(const uint64_t iKey) const
+        {
+            if (m_CacheDirectory.empty())
+                return std::wstring();
+
+            wchar_t szName[32];
+            swprintf_s(szName, L"\\%016llx.bin", iKey);
+            return m_CacheDirectory + szName;
+        }
+
+        bool IsPackValid(const AssetPack& Pack, const FTextureInfo& Texture, const uint64_t iKey) const
+        {
+            if (!Pack.IsOpen() || Pack.GetVersion() != sm_iCacheVersion || Pack.GetKey() != iKey || Pack.GetNumBlobs() != static_cast<size_t>(Texture.NumMips))
+                return false;
+
+            for (INT i = 0; i < Texture.NumMips; i++)
+            {
+                if (Pack.GetBlob(i).Size != GetBufferSize(*Texture.Mips[i]) * sizeof(ConvertedTextureData::PixelFormat))
+                    return false;
+            }
+
+            return true;
+        }
+
+        /// <summary>
+        /// Writes the compressed mips on a worker, the game thread only copies them
+        /// </summary>
+        void WritePack(const std::wstring& Path, const uint64_t iKey, const INT iNumMips)
+        {
+            std::vector<std::vector<ConvertedTextureData::PixelFormat>> Mips;
+            Mips.reserve(iNumMips);
+            for (INT i = 0; i < iNumMips; i++)
+            {
+                const auto* const pMip = m_Buffer.GetMipBuffer(i);
+                Mips.emplace_back(pMip, pMip + m_Buffer.GetMipBufferSize(i));
+            }
+
+            m_JobSystem.Submit([Path, iKey, Mips = std::move(Mips)]
+            {
+                std::vector<AssetPack::Blob> Blobs;
+                for (const auto& Mip : Mips)
+                {
+                    Blobs.push_back({ Mip.data(), Mip.size() * sizeof(ConvertedTextureData::PixelFormat) });
+                }
+                AssetPack::Write(Path, sm_iCacheVersion, iKey, Blobs); // failure only costs compressing again next time
+            });
+        }
+
         ConvertedTextureData& m_Buffer;
+        JobSystem& m_JobSystem;
+
+        // Expanded RGBA mips, input of the compressor
+        ConvertedTextureData m_Source;
+        FormatConverterP8 m_Expander;
+
+        std::unique_ptr<AssetPack> m_pPack; // Keeps cached mips mapped until the texture is created
+
+        BlockCompressor::Format m_Format = BlockCompressor::Format::BC1;
+        bool m_bHighQuality = false;
+        bool m_bWantsBuffer = true;
+        std::wstring m_CacheDirectory;
+
+        size_t m_iNumCompressed = 0;
+        size_t m_iNumLoadedFromCache = 0;
     };
 
     class FormatConverterDXT : public FormatConverterIdentity
     {
     public:
         using FormatConverterIdentity::FormatConverterIdentity;
-        virtual UINT GetStride(const FMipmapBase& Mip) const override { return (Mip.USize + sm_iBlockSizeInPixels - 1) / sm_iBlockSizeInPixels / sm_iBlockSizeInBytes; }
+        virtual UINT GetStride(const FMipmapBase& Mip) const override { return static_cast<UINT>(BlockCompressor::GetRowPitch(BlockCompressor::Format::BC1, Mip.USize)); }
         virtual DXGI_FORMAT GetDXGIFormat() const override { return DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM; }
-    private:
-        static const size_t sm_iBlockSizeInPixels = 4;
-        static const size_t sm_iBlockSizeInBytes = 8;
     };
 
     FormatConverterIdentity m_FormatConverterIdentity = FormatConverterIdentity(m_ConvertedTextureData);
-    FormatConverterP8 m_FormatConverterP8 = FormatConverterP8(m_ConvertedTextureData);
+    FormatConverterP8 m_FormatConverterP8;
     FormatConverterDXT m_FormatConverterDXT = FormatConverterDXT(m_ConvertedTextureData);
+    FormatConverterP8Indices m_FormatConverterP8Indices = FormatConverterP8Indices(m_ConvertedTextureData);
+    FormatConverterBC m_FormatConverterBC;
     std::array<IFormatConverter*, 6> const m_FormatConverters = {
         &m_FormatConverterP8, // TEXF_P8
         &m_FormatConverterIdentity, // TEXF_RGBA7
@@ -308,5 +1369,12 @@ protected:
         nullptr //TEXF_RGBA8
     };
 
+    Compression m_Compression = Compression::None;
+    bool m_bSRGB = false;
+
+    size_t m_iNumRealtimeUpdates = 0;
+    size_t m_iNumRealtimeBytes = 0;
+    std::chrono::high_resolution_clock::duration m_RealtimeTime = std::chrono::high_resolution_clock::duration::zero();
+
     TextureData m_PlaceholderTexture; // Placeholder texture for when unable to convert
 };
\ No newline at end of file
@@ -0,0 +1,318 @@
+﻿module;
+
+#include <D3D11.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <filesystem>
+#include <system_error>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cwctype>
+
+#include <Engine.h>
+
+export module DeusEx.TextureOverrides;
+
+import Utils;
+
+/// <summary>
+/// Replacement textures: pre-compressed DDS files (BC1, BC3 or BC7) at <directory>\<package>\<texture name>.dds, subdirectories of a package are allowed.
+/// The directory is indexed once, a file is memory-mapped only while its texture is created.
+/// </summary>
+export class TextureOverrides
+{
+public:
+    /// <summary>
+    /// Memory-mapped DDS file, the subresources point into the mapping
+    /// </summary>
+    class Image
+    {
+        static const uint32_t sm_iMagic = 0x20534444; // "DDS "
+        static const uint32_t sm_iFourCCDXT1 = 0x31545844;
+        static const uint32_t sm_iFourCCDXT5 = 0x35545844;
+        static const uint32_t sm_iFourCCDX10 = 0x30315844;
+        static const uint32_t sm_iFlagFourCC = 0x4;
+        static const uint32_t sm_iDimensionTexture2D = 3;
+
+        struct PixelFormat
+        {
+            uint32_t Size;
+            uint32_t Flags;
+            uint32_t FourCC;
+            uint32_t RGBBitCount;
+            uint32_t Masks[4];
+        };
+
+        struct Header
+        {
+            uint32_t Size;
+            uint32_t Flags;
+            uint32_t Height;
+            uint32_t Width;
+            uint32_t PitchOrLinearSize;
+            uint32_t Depth;
+            uint32_t MipMapCount;
+            uint32_t Reserved1[11];
+            PixelFormat Format;
+            uint32_t Caps[4];
+            uint32_t Reserved2;
+        };
+
+        struct HeaderDX10
+        {
+            uint32_t Format;
+            uint32_t ResourceDimension;
+            uint32_t MiscFlag;
+            uint32_t ArraySize;
+            uint32_t MiscFlags2;
+        };
+
+    public:
+        /// <summary>
+        /// Maps and parses the file, IsValid() is false if it can't be read or isn't a supported DDS
+        /// </summary>
+        explicit Image(const std::wstring& path)
+        {
+            m_hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (m_hFile == INVALID_HANDLE_VALUE)
+                return;
+
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(m_hFile, &fileSize) || fileSize.QuadPart < static_cast<LONGLONG>(sizeof(uint32_t) + sizeof(Header)))
+                return;
+
+            m_hMapping = CreateFileMappingW(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!m_hMapping)
+                return;
+
+            m_pView = static_cast<const uint8_t*>(MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+            if (!m_pView)
+                return;
+
+            m_bValid = Parse(static_cast<size_t>(fileSize.QuadPart));
+        }
+
+        Image(const Image&) = delete;
+        Image& operator=(const Image&) = delete;
+
+        ~Image()
+        {
+            if (m_pView)
+                UnmapViewOfFile(m_pView);
+            if (m_hMapping)
+                CloseHandle(m_hMapping);
+            if (m_hFile != INVALID_HANDLE_VALUE)
+                CloseHandle(m_hFile);
+        }
+
+        bool IsValid() const { return m_bValid; }
+        DXGI_FORMAT GetFormat() const { return m_Format; } // Always UNORM, sRGB is up to the texture cache
+        UINT GetWidth() const { return m_iWidth; }
+        UINT GetHeight() const { return m_iHeight; }
+        UINT GetNumMips() const { return static_cast<UINT>(m_SubResourceData.size()); }
+        const D3D11_SUBRESOURCE_DATA* GetSubResourceData() const { return m_SubResourceData.data(); }
+        size_t GetNumBytes() const { return m_iNumBytes; }
+
+    protected:
+        bool Parse(const size_t iFileSize)
+        {
+            uint32_t iMagic;
+            memcpy(&iMagic, m_pView, sizeof(iMagic));
+            const Header& header = *reinterpret_cast<const Header*>(m_pView + sizeof(iMagic));
+            if (iMagic != sm_iMagic || header.Size != sizeof(Header) || header.Width == 0 || header.Height == 0 || !(header.Format.Flags & sm_iFlagFourCC))
+                return false;
+
+            size_t iOffset = sizeof(iMagic) + sizeof(Header);
+            switch (header.Format.FourCC)
+            {
+            case sm_iFourCCDXT1:
+                m_Format = DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM;
+                break;
+            case sm_iFourCCDXT5:
+                m_Format = DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM;
+                break;
+            case sm_iFourCCDX10:
+            {
+                if (iFileSize < iOffset + sizeof(HeaderDX10))
+                    return false;
+
+                const HeaderDX10& header10 = *reinterpret_cast<const HeaderDX10*>(m_pView + iOffset);
+                iOffset += sizeof(HeaderDX10);
+                if (header10.ResourceDimension != sm_iDimensionTexture2D || header10.ArraySize > 1)
+                    return false;
+
+                switch (header10.Format)
+                {
+                case DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM:
+                case DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM_SRGB:
+                    m_Format = DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM;
+                    break;
+                case DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM:
+                case DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM_SRGB:
+                    m_Format = DXGI_FORMAT::DXGI_FORMAT_BC3_UNORM;
+                    break;
+                case DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM:
+                case DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM_SRGB:
+                    m_Format = DXGI_FORMAT::DXGI_FORMAT_BC7_UNORM;
+                    break;
+                default:
+                    return false;
+                }
+                break;
+            }
+            default:
+                return false;
+            }
+
+            // Block compressed textures must be a multiple of the block size
+            if (header.Width % 4 != 0 || header.Height % 4 != 0)
+                return false;
+
+            m_iWidth = header.Width;
+            m_iHeight = header.Height;
+
+            const size_t iBlockBytes = m_Format == DXGI_FORMAT::DXGI_FORMAT_BC1_UNORM ? 8 : 16;
+            const UINT iNumMips = std::max(header.MipMapCount, 1u);
+            for (UINT i = 0; i < iNumMips && (m_iWidth >> i) + (m_iHeight >> i) > 0; i++)
+            {
+                const size_t iBlocksX = (std::max(m_iWidth >> i, 1u) + 3) / 4;
+                const size_t iBlocksY = (std::max(m_iHeight >> i, 1u) + 3) / 4;
+                const size_t iRowPitch = iBlocksX * iBlockBytes;
+                const size_t iMipBytes = iRowPitch * iBlocksY;
+                if (iOffset + iMipBytes > iFileSize)
+                    return false;
+
+                m_SubResourceData.push_back({ m_pView + iOffset, static_cast<UINT>(iRowPitch), static_cast<UINT>(iMipBytes) });
+                iOffset += iMipBytes;
+                m_iNumBytes += iMipBytes;
+            }
+
+            return true;
+        }
+
+        HANDLE m_hFile = INVALID_HANDLE_VALUE;
+        HANDLE m_hMapping = nullptr;
+        const uint8_t* m_pView = nullptr;
+
+        bool m_bValid = false;
+        DXGI_FORMAT m_Format = DXGI_FORMAT::DXGI_FORMAT_UNKNOWN;
+        UINT m_iWidth = 0;
+        UINT m_iHeight = 0;
+        size_t m_iNumBytes = 0;
+        std::vector<D3D11_SUBRESOURCE_DATA> m_SubResourceData;
+    };
+
+    TextureOverrides() = default;
+    TextureOverrides(const TextureOverrides&) = delete;
+    TextureOverrides& operator=(const TextureOverrides&) = delete;
+
+    /// <summary>
+    /// Indexes the DDS files of the directory, an empty path disables overrides
+    /// </summary>
+    void SetDirectory(const std::wstring& directory)
+    {
+        m_Index.clear();
+        m_Known.clear();
+        if (directory.empty())
+            return;
+
+        const auto startTime = std::chrono::high_resolution_clock::now();
+
+        std::error_code error;
+        const std::filesystem::path root(directory);
+        for (auto it = std::filesystem::recursive_directory_iterator(root, error); !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error))
+        {
+            const std::filesystem::path& path = it->path();
+            if (!it->is_regular_file(error) || ToLower(path.extension().wstring()) != L".dds")
+                continue;
+
+            // First directory below the root is the package
+            const std::filesystem::path relative = path.lexically_relative(root);
+            if (relative.begin() == relative.end() || std::next(relative.begin()) == relative.end())
+                continue;
+
+            m_Index.emplace(MakeKey(relative.begin()->wstring().c_str(), path.stem().wstring().c_str()), path.wstring());
+        }
+
+        if (!m_Index.empty())
+        {
+            Utils::LogMessagef(L"Indexed %Iu texture overrides in %.2f ms.", m_Index.size(),
+                std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count());
+        }
+    }
+
+    /// <summary>
+    /// Whether there's a replacement for the texture; cheap after the first call for a cache ID
+    /// </summary>
+    bool Has(const FTextureInfo& Texture)
+    {
+        if (m_Index.empty() || !Texture.Texture)
+            return false;
+
+        auto it = m_Known.find(Texture.CacheID);
+        if (it == m_Known.end())
+        {
+            UObject* pPackage = Texture.Texture;
+            while (pPackage->GetOuter())
+                pPackage = pPackage->GetOuter();
+
+            auto itIndex = m_Index.find(MakeKey(pPackage->GetName(), Texture.Texture->GetName()));
+            it = m_Known.emplace(Texture.CacheID, itIndex != m_Index.end() ? &itIndex->second : nullptr).first;
+        }
+        return it->second != nullptr;
+    }
+
+    /// <summary>
+    /// Maps the replacement of the texture, nullptr if there's none. Files that can't be read are dropped from the index with a warning.
+    /// </summary>
+    std::unique_ptr<Image> Open(const FTextureInfo& Texture)
+    {
+        if (!Has(Texture))
+            return nullptr;
+
+        const std::wstring& path = *m_Known[Texture.CacheID];
+        auto pImage = std::make_unique<Image>(path);
+        if (!pImage->IsValid())
+        {
+            Utils::LogWarningf(L"Texture override '%s' is not a BC1, BC3 or BC7 DDS file.", path.c_str());
+            for (auto it = m_Known.begin(); it != m_Known.end(); ++it)
+            {
+                if (it->second == &path)
+                    it->second = nullptr;
+            }
+            return nullptr;
+        }
+
+        m_iNumLoaded++;
+        return pImage;
+    }
+
+    /// <summary>
+    /// Forgets which cache IDs have overrides, cache IDs of a new level can belong to other textures
+    /// </summary>
+    void FlushLevel() { m_Known.clear(); }
+
+    //Diagnostics
+    size_t GetNumIndexed() const { return m_Index.size(); }
+    size_t GetNumLoaded() const { return m_iNumLoaded; }
+
+protected:
+    static std::wstring ToLower(std::wstring str)
+    {
+        std::transform(str.begin(), str.end(), str.begin(), [](const wchar_t c) { return static_cast<wchar_t>(std::towlower(c)); });
+        return str;
+    }
+
+    static std::wstring MakeKey(const wchar_t* const pszPackage, const wchar_t* const pszName)
+    {
+        return ToLower(std::wstring(pszPackage) + L"." + pszName);
+    }
+
+    std::unordered_map<std::wstring, std::wstring> m_Index; // package.name -> path
+    std::unordered_map<QWORD, const std::wstring*> m_Known; // Cache ID -> path in the index or nullptr
+    size_t m_iNumLoaded = 0;
+};
@@ -0,0 +1,28 @@
+#include "DynamicLight.hlsli"
+
+// Accumulates diffuse irradiance of dynamic lights in low resolution.
+// The albedo of the surface is applied later in the composite pass.
+float4 PSMain(const float4 pos : SV_Position) : SV_Target
+{
+    const int scale = (int) DynamicLightControl.x;
+    const int2 gBufferPos = int2(pos.xy) * scale + scale / 2;
+    const float4 normalDepth = TexGBufferNormal.Load(int3(gBufferPos, 0));
+
+    if (normalDepth.w == 0.0f)
+        return float4(0, 0, 0, 0);
+
+    const float3 posView = GetViewPosition(gBufferPos + 0.5f, normalDepth.w);
+
+    PbrM_ShadingCtx shadingCtx;
+    shadingCtx.normal = normalDepth.xyz;
+    shadingCtx.viewDir = normalize(posView);
+
+    PbrM_MatInfo matInfo;
+    matInfo.diffuse = float4(1.0f, 1.0f, 1.0f, 1.0f);
+    matInfo.f0 = float4(0.0f, 0.0f, 0.0f, 1.0f);
+    matInfo.alphaSq = 1.0f;
+    matInfo.occlusion = 1.0f;
+    matInfo.specPower = 0.0f;
+
+    return GetDynamicPixel(posView, shadingCtx, matInfo, true);
+}
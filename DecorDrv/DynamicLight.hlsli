@@ -0,0 +1,37 @@
+#include "Defines.hlsli"
+#include "Common.hlsli"
+
+// G-buffer written by complex surfaces and the result of the low resolution pass
+Texture2D TexGBufferNormal : register(t5);
+Texture2D TexGBufferAlbedo : register(t6);
+Texture2D<float> TexDepth : register(t7);
+Texture2D TexDynamicLight : register(t8);
+
+cbuffer DynamicLightBuffer : register(b4)
+{
+    uint4 DynamicLightControl; // x - resolution divider of the low resolution pass, yz - size of the low resolution target
+};
+
+// Fullscreen triangle, generated from vertex id without vertex buffer
+float4 VSMain(const uint id : SV_VertexID) : SV_Position
+{
+    const float2 uv = float2((id << 1) & 2, id & 2);
+    return float4(uv * float2(2.0f, -2.0f) + float2(-1.0f, 1.0f), 0.0f, 1.0f);
+}
+
+// Restores position in view space from the screen position and depth in view space
+float3 GetViewPosition(const float2 screenPos, const float viewDepth)
+{
+    const float2 ndc = float2(screenPos.x * fRes.z * 2.0f - 1.0f, 1.0f - screenPos.y * fRes.w * 2.0f);
+    return float3(ndc.x * viewDepth / ProjectionMatrix[0][0], ndc.y * viewDepth / ProjectionMatrix[1][1], viewDepth);
+}
+
+// Checks that the surface stored in G-buffer was not covered by something drawn later (ex. meshes)
+bool IsGBufferVisible(const int2 pixelPos, const float viewDepth)
+{
+    const float4 projected = mul(float4(0.0f, 0.0f, viewDepth, 1.0f), ProjectionMatrix);
+    const float expectedDepth = projected.z / projected.w;
+    const float depth = TexDepth.Load(int3(pixelPos, 0));
+
+    return abs(depth - expectedDepth) <= depth * 0.002f; // tolerance for half precision of the stored depth
+}
@@ -0,0 +1,47 @@
+#include "DynamicLight.hlsli"
+
+static const float DEPTH_WEIGHT_EPSILON = 0.001f;
+static const float NORMAL_WEIGHT_POWER = 8.0f;
+
+// Upsamples low resolution dynamic light with a bilateral filter and adds it to the scene
+float4 PSMain(const float4 pos : SV_Position) : SV_Target
+{
+    const int2 pixelPos = int2(pos.xy);
+    const float4 normalDepth = TexGBufferNormal.Load(int3(pixelPos, 0));
+
+    if (normalDepth.w == 0.0f || !IsGBufferVisible(pixelPos, normalDepth.w))
+        discard;
+
+    const int scale = (int) DynamicLightControl.x;
+    const int2 maxLowResPos = int2(DynamicLightControl.yz) - 1;
+
+    const float2 lowResPos = pos.xy / scale - 0.5f;
+    const int2 basePos = int2(floor(lowResPos));
+    const float2 fraction = lowResPos - basePos;
+
+    float3 light = float3(0, 0, 0);
+    float weightSum = 0.0f;
+
+    // Bilinear weights of 4 nearest low resolution texels, corrected by similarity of depth and normal
+    for (uint i = 0; i < 4; ++i)
+    {
+        const int2 offset = int2(i & 1, i >> 1);
+        const int2 samplePos = clamp(basePos + offset, int2(0, 0), maxLowResPos);
+        const float4 sampleNormalDepth = TexGBufferNormal.Load(int3(samplePos * scale + scale / 2, 0));
+
+        const float2 bilinear = offset ? fraction : 1.0f - fraction;
+        const float depthWeight = 1.0f / (DEPTH_WEIGHT_EPSILON + abs(sampleNormalDepth.w - normalDepth.w) / normalDepth.w);
+        const float normalWeight = pow(saturate(dot(sampleNormalDepth.xyz, normalDepth.xyz)), NORMAL_WEIGHT_POWER);
+        const float weight = bilinear.x * bilinear.y * depthWeight * normalWeight;
+
+        light += TexDynamicLight.Load(int3(samplePos, 0)).rgb * weight;
+        weightSum += weight;
+    }
+
+    if (weightSum <= 0.0f)
+        discard;
+
+    const float3 albedo = TexGBufferAlbedo.Load(int3(pixelPos, 0)).rgb;
+
+    return float4(light / weightSum * albedo, 0.0f);
+}
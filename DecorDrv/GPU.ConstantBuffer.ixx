@@ -43,6 +43,8 @@ public:
 
     bool IsDirty() const { return m_bDirty; }
 
+    Utils::MemoryUsage GetMemoryUsage() const { return { sizeof(T), sizeof(T), 1 }; } // m_Data is the CPU copy
+
     void Update()
     {
         assert(m_bDirty);
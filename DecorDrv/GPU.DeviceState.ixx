@@ -202,7 +202,7 @@ protected:
 
         D3D11_BLEND_DESC& BlendDefault = Descs[static_cast<size_t>(BLEND_STATE::DEFAULT)];
         BlendDefault.AlphaToCoverageEnable = FALSE;
-        BlendDefault.IndependentBlendEnable = FALSE;
+        BlendDefault.IndependentBlendEnable = TRUE;
         BlendDefault.RenderTarget[0].BlendEnable = FALSE;
         BlendDefault.RenderTarget[0].SrcBlend = D3D11_BLEND::D3D11_BLEND_ONE;
         BlendDefault.RenderTarget[0].DestBlend = D3D11_BLEND::D3D11_BLEND_ZERO;
@@ -254,6 +254,17 @@ protected:
         BlendWater.RenderTarget[0].DestBlend = D3D11_BLEND::D3D11_BLEND_DEST_ALPHA;
         BlendWater.RenderTarget[0].BlendOp = D3D11_BLEND_OP::D3D11_BLEND_OP_ADD;
 
+        // Additional render targets are G-buffer of deferred dynamic lights, only opaque surfaces are written to it
+        for (size_t i = 0; i < Descs.size(); i++)
+        {
+            for (size_t rt = 1; rt < D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT; rt++)
+            {
+                Descs[i].RenderTarget[rt] = BlendDefault.RenderTarget[0];
+                if (i != static_cast<size_t>(BLEND_STATE::DEFAULT))
+                    Descs[i].RenderTarget[rt].RenderTargetWriteMask = 0;
+            }
+        }
+
         CreateStates(Descs, m_BlendStates, &ID3D11Device::CreateBlendState);
     }
 
@@ -42,6 +42,11 @@ public:
         return m_iReserved;
     }
 
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        return { 0, m_iReserved * sizeof(T), 1 };
+    }
+
     size_t GetNumNewElements() const
     {
         return m_iSize - m_iMapStart;
@@ -1,9 +1,12 @@
 ﻿module;
 
 #include <D3D11.h>
+#include <dxgi1_4.h>
 #include <D3DCompiler.inl>
 #include <wrl\client.h>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
 #include <fstream>
 #include "PostProcess.h"
 
@@ -45,7 +48,7 @@ public:
         IDXGIAdapter1* const pSelectedAdapter = nullptr;
         const D3D_DRIVER_TYPE DriverType = D3D_DRIVER_TYPE::D3D_DRIVER_TYPE_HARDWARE;
 
-        UINT iFlags = D3D11_CREATE_DEVICE_SINGLETHREADED;
+        UINT iFlags = 0; // Not single-threaded, texture cache workers create textures
 #ifdef _DEBUG
         iFlags |= D3D11_CREATE_DEVICE_FLAG::D3D11_CREATE_DEVICE_DEBUG;
 #endif
@@ -146,6 +149,7 @@ public:
 
         m_pBackBufferRTV = nullptr;
         m_pDepthStencilView = nullptr;
+        m_pDepthShaderResourceView = nullptr;
 
         // Set fullscreen resolution
         if (fullScreen)
@@ -261,6 +265,13 @@ public:
     ID3D11Device& GetDevice() { return *m_pDevice.Get(); }
     ID3D11DeviceContext& GetDeviceContext() { return *m_pDeviceContext.Get(); }   
 
+    /// <summary>
+    /// Render target the scene is drawn to (HDR texture or back buffer)
+    /// </summary>
+    ID3D11RenderTargetView* GetRenderTargetView() const { return UseHdr ? m_pHDRTexture->GetRenderTargetView() : m_pBackBufferRTV.Get(); }
+    ID3D11DepthStencilView* GetDepthStencilView() const { return m_pDepthStencilView.Get(); }
+    ID3D11ShaderResourceView* GetDepthShaderResourceView() const { return m_pDepthShaderResourceView.Get(); }
+
     bool GetWindowSize(uint32_t& width, uint32_t& height) const
     {
         assert(m_pSwapChain);
@@ -270,18 +281,77 @@ public:
         return true;
     }
 
+    /// <summary>
+    /// Writes to the back buffer through an sRGB view, so linear shader output is encoded by the output merger
+    /// </summary>
+    void SetSRGB(const bool bSRGB)
+    {
+        if (m_bSRGB == bSRGB)
+        {
+            return;
+        }
+
+        m_bSRGB = bSRGB;
+        if (m_pSwapChain)
+        {
+            m_pDeviceContext->OMSetRenderTargets(0, nullptr, nullptr);
+            CreateBackBufferRTV();
+
+            ID3D11RenderTargetView* const pRenderTargetView = GetRenderTargetView();
+            m_pDeviceContext->OMSetRenderTargets(1, &pRenderTargetView, m_pDepthStencilView.Get());
+        }
+    }
+
+    bool GetSRGB() const { return m_bSRGB; }
+
+    /// <summary>
+    /// Video memory the OS currently grants the process, 0 if the adapter can't tell (before Windows 10)
+    /// </summary>
+    size_t GetVideoMemoryBudget() const
+    {
+        ComPtr<IDXGIAdapter3> pAdapter3;
+        if (!m_pAdapter || FAILED(m_pAdapter.As(&pAdapter3)))
+        {
+            return 0;
+        }
+
+        DXGI_QUERY_VIDEO_MEMORY_INFO Info;
+        if (FAILED(pAdapter3->QueryVideoMemoryInfo(0, DXGI_MEMORY_SEGMENT_GROUP_LOCAL, &Info)))
+        {
+            return 0;
+        }
+
+        return static_cast<size_t>(std::min<UINT64>(Info.Budget, SIZE_MAX));
+    }
+
+    /// <summary>
+    /// Render targets of the backend: swap chain buffers, depth buffer and the HDR texture
+    /// </summary>
+    Utils::MemoryUsage GetRenderTargetMemoryUsage() const
+    {
+        const size_t iNumPixels = static_cast<size_t>(m_SwapChainDesc.BufferDesc.Width) * m_SwapChainDesc.BufferDesc.Height;
+
+        Utils::MemoryUsage Usage;
+        Usage.iGPUBytes = iNumPixels * (m_SwapChainDesc.BufferCount * Utils::GetBytesPerPixel(m_SwapChainDesc.BufferDesc.Format) + Utils::GetBytesPerPixel(DXGI_FORMAT::DXGI_FORMAT_R32_TYPELESS));
+        Usage.iNumObjects = m_SwapChainDesc.BufferCount + 1;
+        if (m_pHDRTexture)
+        {
+            Usage += m_pHDRTexture->GetMemoryUsage();
+        }
+        return Usage;
+    }
+
     void ClearDepth()
     {
         m_pDeviceContext->ClearDepthStencilView(m_pDepthStencilView.Get(), D3D11_CLEAR_FLAG::D3D11_CLEAR_DEPTH | D3D11_CLEAR_FLAG::D3D11_CLEAR_STENCIL, 0.0f, 0);
     }
 
 protected:
-    void CreateRenderTargetViews()
+    void CreateBackBufferRTV()
     {
         assert(m_pSwapChain);
-        assert(m_pDevice);        
+        assert(m_pDevice);
 
-        // Backbuffer
         ComPtr<ID3D11Texture2D> pBackBufferTex;
         Utils::ThrowIfFailed(
             m_pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), reinterpret_cast<void**>(pBackBufferTex.GetAddressOf())),
@@ -289,11 +359,27 @@ protected:
         );
         Utils::SetResourceName(pBackBufferTex, "BackBuffer");
 
+        // Flip model swap chains can't have sRGB buffers, but can be written through an sRGB view
+        D3D11_RENDER_TARGET_VIEW_DESC RenderTargetViewDesc;
+        RenderTargetViewDesc.Format = m_bSRGB ? DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM_SRGB : m_SwapChainDesc.BufferDesc.Format;
+        RenderTargetViewDesc.ViewDimension = D3D11_RTV_DIMENSION::D3D11_RTV_DIMENSION_TEXTURE2D;
+        RenderTargetViewDesc.Texture2D.MipSlice = 0;
+
+        m_pBackBufferRTV.Reset();
         Utils::ThrowIfFailed(
-            m_pDevice->CreateRenderTargetView(pBackBufferTex.Get(), nullptr, &m_pBackBufferRTV),
+            m_pDevice->CreateRenderTargetView(pBackBufferTex.Get(), &RenderTargetViewDesc, &m_pBackBufferRTV),
             "Failed to create RTV for back buffer texture."
         );
         Utils::SetResourceName(m_pBackBufferRTV, "BackBufferRTV");
+    }
+
+    void CreateRenderTargetViews()
+    {
+        assert(m_pSwapChain);
+        assert(m_pDevice);        
+
+        // Backbuffer
+        CreateBackBufferRTV();
 
         // Depth stencil
         D3D11_TEXTURE2D_DESC depthTextureDesc;
@@ -301,11 +387,11 @@ protected:
         depthTextureDesc.Height = m_SwapChainDesc.BufferDesc.Height;
         depthTextureDesc.MipLevels = 1;
         depthTextureDesc.ArraySize = 1;
-        depthTextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_D32_FLOAT;
+        depthTextureDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R32_TYPELESS; // typeless to be able to read depth in shaders
         depthTextureDesc.SampleDesc.Count = 1;
         depthTextureDesc.SampleDesc.Quality = 0;
         depthTextureDesc.Usage = D3D11_USAGE::D3D11_USAGE_DEFAULT;
-        depthTextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_DEPTH_STENCIL;
+        depthTextureDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_DEPTH_STENCIL | D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
         depthTextureDesc.CPUAccessFlags = 0;
         depthTextureDesc.MiscFlags = 0;
 
@@ -316,11 +402,26 @@ protected:
         );
         Utils::SetResourceName(pDepthTexture, "DepthStencil");
 
+        D3D11_DEPTH_STENCIL_VIEW_DESC depthStencilViewDesc = {};
+        depthStencilViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_D32_FLOAT;
+        depthStencilViewDesc.ViewDimension = D3D11_DSV_DIMENSION::D3D11_DSV_DIMENSION_TEXTURE2D;
+
         Utils::ThrowIfFailed(
-            m_pDevice->CreateDepthStencilView(pDepthTexture.Get(), nullptr, m_pDepthStencilView.GetAddressOf()),
+            m_pDevice->CreateDepthStencilView(pDepthTexture.Get(), &depthStencilViewDesc, m_pDepthStencilView.GetAddressOf()),
             "Failed to create depth-stencil view."
         );
         Utils::SetResourceName(m_pDepthStencilView, "DepthStencilView");
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC depthShaderResourceViewDesc = {};
+        depthShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R32_FLOAT;
+        depthShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_TEXTURE2D;
+        depthShaderResourceViewDesc.Texture2D.MipLevels = 1;
+
+        Utils::ThrowIfFailed(
+            m_pDevice->CreateShaderResourceView(pDepthTexture.Get(), &depthShaderResourceViewDesc, m_pDepthShaderResourceView.GetAddressOf()),
+            "Failed to create depth shader resource view."
+        );
+        Utils::SetResourceName(m_pDepthShaderResourceView, "DepthShaderResourceView");
         
         m_pDeviceContext->OMSetRenderTargets(1, m_pBackBufferRTV.GetAddressOf(), m_pDepthStencilView.Get());
     }
@@ -334,7 +435,9 @@ protected:
 
     ComPtr<IDXGISwapChain> m_pSwapChain;
     ComPtr<ID3D11RenderTargetView> m_pBackBufferRTV;
+    bool m_bSRGB = false;
     ComPtr<ID3D11DepthStencilView> m_pDepthStencilView;
+    ComPtr<ID3D11ShaderResourceView> m_pDepthShaderResourceView;
 
     DXGI_SWAP_CHAIN_DESC m_SwapChainDesc;
 
@@ -137,6 +137,15 @@ public:
 
     DXGI_FORMAT GetFormat() const noexcept { return m_format; }
 
+    Utils::MemoryUsage GetMemoryUsage() const noexcept
+    {
+        if (!m_renderTarget)
+            return {};
+
+        const size_t bytesPerPixel = Utils::GetBytesPerPixel(m_format);
+        return { 0, m_width * m_height * bytesPerPixel, 1 };
+    }
+
 private:
     ComPtr<ID3D11Device>                m_device;
     ComPtr<ID3D11Texture2D>             m_renderTarget;
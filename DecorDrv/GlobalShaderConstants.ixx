@@ -9,6 +9,10 @@
 #include <cassert>
 #include <random>
 #include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <wrl\client.h>
 
 #include "Defines.hlsli"
 #include <DeusEx.h>
@@ -16,6 +20,7 @@
 
 export module GlobalShaderConstants;
 
+import Utils;
 import GPU.ConstantBuffer;
 import <simple_json.hpp>;
 
@@ -23,6 +28,7 @@ using DirectX::XMVECTOR;
 using DirectX::XMVECTORU32;
 using DirectX::XMMATRIX;
 using json::JSON;
+using Microsoft::WRL::ComPtr;
 
 export class GlobalShaderConstants
 {
@@ -31,12 +37,15 @@ export class GlobalShaderConstants
     int _currentLevelIndex;
     std::string _currentLevelName;
 
+    // Game time of the current level, used to animate light types
+    double _levelTimeSeconds = 0.0;
+
 public:
     explicit GlobalShaderConstants(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, JSON& settings)
         : m_PerSceneBuffer(Device, DeviceContext, 2, settings)
         , m_PerFrameBuffer(Device, DeviceContext, 0, settings)
         , m_PerTickBuffer(Device, DeviceContext, 1)
-        , m_PerComplexPolyBuffer(Device, DeviceContext, 3)
+        , m_PerComplexPolyBuffer(Device, DeviceContext, 12, settings)
         , _settings(settings)
     {
     }
@@ -62,7 +71,7 @@ public:
 
     void NewTick()
     {
-        m_PerTickBuffer.NewTick();
+        m_PerTickBuffer.NewTick(m_PerSceneBuffer.GetAnimatedLights(), _levelTimeSeconds);
     }
 
     void CheckProjectionChange(const FSceneNode& SceneNode)
@@ -96,6 +105,8 @@ public:
             levelChanged = true;
         }
 
+        _levelTimeSeconds = SceneNode.Level->TimeSeconds;
+
         m_PerSceneBuffer.SetSceneStaticLights(SceneNode, _currentLevelName);
         m_PerFrameBuffer.CheckLevelChange(SceneNode);
 
@@ -135,10 +146,49 @@ public:
         m_PerComplexPolyBuffer.SetComplexPoly(SceneNode, Poly, lightCache);
     }
 
+    /// <summary>
+    /// Offset of the record of the last surface given to SetComplexPoly, vertices of the surface carry it to the shader
+    /// </summary>
+    uint32_t GetComplexPolyOffset() const { return m_PerComplexPolyBuffer.GetOffset(); }
+
     void NewFrame(const DirectX::XMVECTOR& color)
     {
         m_PerFrameBuffer.SetFlashColor(color);
         m_PerFrameBuffer.CheckWaterZone();
+        m_PerComplexPolyBuffer.NewFrame();
+    }
+
+    /// <summary>
+    /// Number of static lights dropped by the per-surface light cap during the current frame
+    /// </summary>
+    size_t GetNumCulledLights() const { return m_PerComplexPolyBuffer.GetNumCulledLights(); }
+
+    /// <summary>
+    /// Constant buffers, the buffer of surface records and their CPU copies
+    /// </summary>
+    Utils::MemoryUsage GetMemoryUsage() const
+    {
+        Utils::MemoryUsage Usage = m_PerSceneBuffer.GetMemoryUsage();
+        Usage += m_PerFrameBuffer.GetMemoryUsage();
+        Usage += m_PerTickBuffer.GetMemoryUsage();
+        Usage += m_PerComplexPolyBuffer.GetMemoryUsage();
+        return Usage;
+    }
+
+    /// <summary>
+    /// Switches complex surfaces between forward dynamic lights and G-buffer output for the low resolution pass
+    /// </summary>
+    void SetDeferredDynamicLights(bool enabled)
+    {
+        m_PerFrameBuffer.SetDeferredDynamicLights(enabled);
+    }
+
+    /// <summary>
+    /// Switches complex surfaces between occlusion maps and occlusion fetched from the raw light bits
+    /// </summary>
+    void SetOcclusionBits(bool enabled)
+    {
+        m_PerFrameBuffer.SetOcclusionBits(enabled);
     }
 
     float GetRFX2() { return m_PerFrameBuffer.GetRFX2(); }
@@ -262,6 +312,36 @@ protected:
         return lightData;
     }
 
+    /// <summary>
+    /// Light parameters needed to animate a static light on CPU once per tick
+    /// </summary>
+    struct AnimatedLight
+    {
+        BYTE LightType;
+        BYTE LightEffect;
+        BYTE LightPeriod;
+        BYTE LightPhase;
+        FRotator Rotation;
+    };
+
+    /// <summary>
+    /// Position of a static light in the StaticLights buffer and its index in the light animation table,
+    /// together with data needed to rank lights of a surface by importance
+    /// </summary>
+    struct StaticLightRef
+    {
+        size_t BufferPos;
+        size_t Id;
+        FVector Location;
+        float Radius;
+        float Luminance;
+    };
+
+    static float GetLuminance(const XMVECTOR& color)
+    {
+        return 0.3f * DirectX::XMVectorGetX(color) + 0.59f * DirectX::XMVectorGetY(color) + 0.11f * DirectX::XMVectorGetZ(color);
+    }
+
     /// <summary>
     /// Prepares and stores constant buffer data
     /// related to the current level only (ex. set of static lights on the current level)
@@ -269,6 +349,7 @@ protected:
     class PerSceneBuffer
     {
         const static size_t MAX_BUF = 3072;
+        static_assert(MAX_BUF >= 3 * MAX_STATIC_LIGHTS, "Every static light takes up to 3 entries");
 
         struct PerScene
         {
@@ -279,7 +360,8 @@ protected:
         int m_CurrentLevelIndex;
 
         ConstantBuffer<PerScene> m_Buffer;
-        std::unordered_map<AActor*, size_t> m_LightCache;
+        std::unordered_map<AActor*, StaticLightRef> m_LightCache;
+        std::vector<AnimatedLight> m_AnimatedLights; // indexed by static light id
         JSON& _settings;
 
         unsigned int _slot;
@@ -309,6 +391,7 @@ protected:
             {
                 size_t bufferPos = 0;
                 m_LightCache.clear();
+                m_AnimatedLights.clear();
 
                 // process all static light sources on current level
                 for (int lightNum = 0; lightNum < SceneNode.Level->Model->Lights.Num(); ++lightNum)
@@ -321,6 +404,13 @@ protected:
                         // if light source is not already processed
                         if (!m_LightCache.contains(lightActor))
                         {
+                            // The animation table of the per-tick buffer has a fixed size
+                            if (m_AnimatedLights.size() >= MAX_STATIC_LIGHTS)
+                            {
+                                Utils::LogWarningf(L"More than %d static lights on the level, the rest are ignored.", MAX_STATIC_LIGHTS);
+                                break; // out of the light loop, surfaces skip lights that aren't in the cache
+                            }
+
                             float correction = 1.0f;
                             auto lightName = GetString(lightActor->GetName());
                             if (settings.hasKey(GlobalStaticLightName))
@@ -329,8 +419,21 @@ protected:
                                 correction *= settings.at(lightName).ToFloat();
 
                             // then process and add processed data for constant buffer
-                            m_LightCache.insert({ lightActor, bufferPos });
                             auto lightData = GetLightData(lightActor, correction);
+
+                            m_LightCache.insert({ lightActor, {
+                                bufferPos,
+                                m_AnimatedLights.size(),
+                                lightActor->Location,
+                                lightActor->WorldLightRadius(),
+                                GetLuminance(lightData[0]) } });
+                            m_AnimatedLights.push_back({
+                                lightActor->LightType,
+                                lightActor->LightEffect,
+                                lightActor->LightPeriod,
+                                lightActor->LightPhase,
+                                lightActor->Rotation });
+
                             for (size_t i = 0; i < lightData.size(); ++i)
                                 m_Buffer.m_Data.StaticLights[bufferPos + i] = lightData[i];
 
@@ -344,15 +447,27 @@ protected:
             }
         }
 
-        const std::unordered_map<AActor*, size_t>& GetLightCache()
+        const std::unordered_map<AActor*, StaticLightRef>& GetLightCache()
         {
             return m_LightCache;
         }
 
+        const std::vector<AnimatedLight>& GetAnimatedLights()
+        {
+            return m_AnimatedLights;
+        }
+
         void UpdateAndBind()
         {
             m_Buffer.UpdateAndBind(_slot);
         }
+
+        Utils::MemoryUsage GetMemoryUsage() const
+        {
+            Utils::MemoryUsage Usage = m_Buffer.GetMemoryUsage();
+            Usage.iCPUBytes += m_AnimatedLights.capacity() * sizeof(AnimatedLight) + m_LightCache.size() * sizeof(decltype(m_LightCache)::value_type);
+            return Usage;
+        }
     }
     m_PerSceneBuffer;
 
@@ -371,7 +486,7 @@ protected:
             XMVECTOR Origin;
             XMVECTOR FlashColor;
             XMVECTOR DynamicLights[MAX_LIGHTS_DATA_SIZE];
-            uint32_t FrameControl; // bit 0 - флаг того, что текущий кадр возможно пересекает водная поверхность
+            uint32_t FrameControl; // bit 0 - флаг того, что текущий кадр возможно пересекает водная поверхность, bit 1 - FRAME_CONTROL_DEFERRED_DYNAMIC_LIGHTS, bit 2 - FRAME_CONTROL_OCCLUSION_BITS
             float ScreenWaterLevel; // Уровень, на который камера погружена в воду (0 - не погружена, 1 - погружена полностью)
         };
 
@@ -759,6 +874,24 @@ protected:
             m_Buffer.MarkAsDirty();
         }
 
+        void SetDeferredDynamicLights(bool enabled)
+        {
+            if (enabled)
+                m_Buffer.m_Data.FrameControl |= FRAME_CONTROL_DEFERRED_DYNAMIC_LIGHTS;
+            else
+                m_Buffer.m_Data.FrameControl &= ~FRAME_CONTROL_DEFERRED_DYNAMIC_LIGHTS;
+            m_Buffer.MarkAsDirty();
+        }
+
+        void SetOcclusionBits(bool enabled)
+        {
+            if (enabled)
+                m_Buffer.m_Data.FrameControl |= FRAME_CONTROL_OCCLUSION_BITS;
+            else
+                m_Buffer.m_Data.FrameControl &= ~FRAME_CONTROL_OCCLUSION_BITS;
+            m_Buffer.MarkAsDirty();
+        }
+
         void CheckWaterZone()
         {
             __try // TO-DO: get rid of exception checking
@@ -778,11 +911,13 @@ protected:
         {
             m_Buffer.UpdateAndBind(_slot);
         }
+
+        Utils::MemoryUsage GetMemoryUsage() const { return m_Buffer.GetMemoryUsage(); }
     }
     m_PerFrameBuffer;
     
     /// <summary>
-    /// Prepares and stores current time in constant buffer
+    /// Prepares and stores current time and state of animated static lights in constant buffer
     /// </summary>
     class PerTickBuffer
     {
@@ -792,6 +927,7 @@ protected:
             float fRandom;
             float fNormRandom;
             float padding;
+            XMVECTOR StaticLightStates[MAX_STATIC_LIGHTS]; // x - brightness multiplier of the light type, yzw - searchlight direction
         };
 
         long long m_InitialTime;
@@ -810,6 +946,60 @@ protected:
 
         unsigned int _slot;
 
+        /// <summary>
+        /// Evaluates brightness multiplier of the light type and direction of the searchlight
+        /// </summary>
+        /// <param name="light">Animated light parameters</param>
+        /// <param name="levelTime">Level time in UE1 light ticks (35 per second)</param>
+        XMVECTOR GetLightState(const AnimatedLight& light, double levelTime)
+        {
+            // One period of the light is 65536 units, the same as a full turn for GMath.SinTab
+            const auto GetPhase = [&](double period) {
+                return static_cast<int>(std::fmod(levelTime * 65536.0 / period, 65536.0)) + (light.LightPhase << 8);
+            };
+            const int phase = GetPhase(light.LightPeriod > 0 ? light.LightPeriod : 1.0);
+
+            float brightness = 1.0f;
+            switch (light.LightType)
+            {
+            case LT_None:
+                brightness = 0.0f;
+                break;
+            case LT_Pulse:
+                brightness = 0.6f + 0.39f * GMath.SinTab(phase);
+                break;
+            case LT_SubtlePulse:
+                brightness = 0.9f + 0.09f * GMath.SinTab(phase);
+                break;
+            case LT_Blink:
+                if (GetPhase(light.LightPeriod + 1.0) & 0x8000)
+                    brightness = 0.0f;
+                break;
+            case LT_Flicker:
+                {
+                    const float random = distribution(generator);
+                    brightness = random < 0.5f ? 0.0f : random;
+                }
+                break;
+            case LT_Strobe:
+                if (distribution(generator) < 0.5f)
+                    brightness = 0.0f;
+                break;
+            }
+
+            FVector direction(0.0f, 0.0f, 0.0f);
+            if (light.LightEffect == LE_Searchlight)
+            {
+                // The searchlight does not rotate if its period is zero
+                FRotator rotation = light.Rotation;
+                if (light.LightPeriod > 0)
+                    rotation.Yaw += phase;
+                direction = rotation.Vector();
+            }
+
+            return DirectX::XMVectorSet(brightness, direction.X, direction.Y, direction.Z);
+        }
+
     public:
         PerTickBuffer(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, unsigned int slot)
             : m_Buffer(Device, DeviceContext), _slot(slot)
@@ -821,11 +1011,19 @@ protected:
         PerTickBuffer(const PerTickBuffer&) = delete;
         PerTickBuffer& operator=(const PerTickBuffer&) = delete;
 
-        void NewTick()
+        void NewTick(const std::vector<AnimatedLight>& lights, double levelTimeSeconds)
         {
             m_Buffer.m_Data.fTimeInSeconds = GetTimeSinceStart();
             m_Buffer.m_Data.fRandom = distribution(generator);
             m_Buffer.m_Data.fNormRandom = normDistribution(generator);
+
+            // Same time base as UE1 uses for light animation: 35 ticks per second
+            const double levelTime = levelTimeSeconds * 35.0;
+
+            const size_t numLights = std::min<size_t>(lights.size(), MAX_STATIC_LIGHTS);
+            for (size_t i = 0; i < numLights; ++i)
+                m_Buffer.m_Data.StaticLightStates[i] = GetLightState(lights[i], levelTime);
+
             m_Buffer.MarkAsDirty();
         }
 
@@ -833,69 +1031,261 @@ protected:
         {
             m_Buffer.UpdateAndBind(_slot);
         }
+
+        Utils::MemoryUsage GetMemoryUsage() const { return m_Buffer.GetMemoryUsage(); }
     }
     m_PerTickBuffer;
 
     /// <summary>
-    /// Prepares and stores constant buffer data
-    /// related to the currently rendered polygon only
+    /// Records of the complex surfaces drawn during the frame, in a buffer the shader reads through the offset of the record in the vertices.
+    /// A record is PolyControl (x - number of static lights, y - index of the shading map, zw - its UClamp and VClamp),
+    /// followed by an entry per static light that reaches the surface (x - occlusion map id, y - position in StaticLights, z - id in StaticLightStates, w - diffuse only).
+    /// Surfaces with different lights and shading maps can share a batch this way.
     /// </summary>
     class PerComplexPolyBuffer
     {
-        struct PerComplexPoly
+        /// <summary>
+        /// Static light that reaches the current surface
+        /// </summary>
+        struct LightCandidate
         {
-            XMVECTORU32 PolyControl;            
-            XMVECTORU32 StaticLightIds[MAX_LIGHTS_INDEX_SIZE]; // list of IDs of static light sources that are visible for the current ComplexPoly
+            uint32_t OcclusionMapId;
+            const StaticLightRef* pLightRef;
+            float Importance;
+            bool DiffuseOnly;
         };
 
-        ConstantBuffer<PerComplexPoly> m_Buffer;
-
+        ID3D11Device& m_Device;
+        ID3D11DeviceContext& m_DeviceContext;
         unsigned int _slot;
+
+        ComPtr<ID3D11Buffer> m_pBuffer;
+        ComPtr<ID3D11ShaderResourceView> m_pSRV;
+        size_t m_iReserved = 0;
+
+        // Records of the frame; the ones before m_iNumUploaded are in the buffer already and referenced by rendered batches
+        std::vector<XMVECTORU32> m_Records;
+        size_t m_iNumUploaded = 0;
+        size_t m_iOffset = 0; // record of the last surface
+
+        // Max number of static lights per surface, the least important lights are dropped
+        size_t m_MaxLights = MAX_LIGHTS_INDEX_SIZE;
+
+        // Lights farther than this fraction of their radius from the surface are shaded without specular (0 - disabled)
+        float m_DiffuseOnlyDistance = 0.0f;
+
+        std::vector<LightCandidate> m_Candidates;
+        size_t m_iNumCulledLights = 0;
+
+        /// <summary>
+        /// Calculates world space bounding box of the BSP nodes of every poly of a facet, they share the surface and its lightmap
+        /// </summary>
+        static FBox GetFacetBounds(UModel& Model, const FSavedPoly& FirstPoly)
+        {
+            FBox bounds(0);
+            for (const FSavedPoly* pPoly = &FirstPoly; pPoly; pPoly = pPoly->Next)
+            {
+                const FBspNode& Node = Model.Nodes(pPoly->iNode);
+                for (int i = 0; i < Node.NumVertices; ++i)
+                    bounds += Model.Points(Model.Verts(Node.iVertPool + i).pVertex);
+            }
+            return bounds;
+        }
+
+        static float GetDistanceToBox(const FVector& point, const FBox& box)
+        {
+            if (!box.IsValid)
+                return 0.0f;
+
+            const FVector closest(
+                Clamp(point.X, box.Min.X, box.Max.X),
+                Clamp(point.Y, box.Min.Y, box.Max.Y),
+                Clamp(point.Z, box.Min.Z, box.Max.Z));
+            return (point - closest).Size();
+        }
         
     public:
-        PerComplexPolyBuffer(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, unsigned int slot)
-            : m_Buffer(Device, DeviceContext), _slot(slot)
-        {}
+        PerComplexPolyBuffer(ID3D11Device& Device, ID3D11DeviceContext& DeviceContext, unsigned int slot, JSON& settings)
+            : m_Device(Device), m_DeviceContext(DeviceContext), _slot(slot)
+        {
+            auto& jsonMaxLights = settings["MaxLightsPerSurface"];
+            if (!jsonMaxLights.IsNull() && jsonMaxLights.ToInt() > 0)
+                m_MaxLights = std::min(static_cast<size_t>(jsonMaxLights.ToInt()), m_MaxLights);
+
+            auto& jsonDiffuseOnlyDistance = settings["DiffuseOnlyLightDistance"];
+            if (!jsonDiffuseOnlyDistance.IsNull())
+                m_DiffuseOnlyDistance = static_cast<float>(jsonDiffuseOnlyDistance.ToFloat());
+
+            m_Candidates.reserve(MAX_LIGHTS_INDEX_SIZE);
+
+            Alloc(16384);
+        }
 
         PerComplexPolyBuffer(const PerComplexPolyBuffer&) = delete;
         PerComplexPolyBuffer& operator=(const PerComplexPolyBuffer&) = delete;
 
-        void SetComplexPoly(const FSceneNode& SceneNode, const FSavedPoly& Poly, const std::unordered_map<AActor*, size_t> &lightCache)
+        void SetComplexPoly(const FSceneNode& SceneNode, const FSavedPoly& Poly, const std::unordered_map<AActor*, StaticLightRef> &lightCache)
         {
             assert(Poly.NumPts >= 3);
 
+            // Surfaces without a shading map get a record without lights
+            const size_t offset = m_Records.size();
+            m_Records.push_back({});
+
             int currSurf = SceneNode.Level->Model->Nodes(Poly.iNode).iSurf;
             if (currSurf > -1)
             {                
                 int lm = SceneNode.Level->Model->Surfs(currSurf).iLightMap;
                 if (lm > -1)
                 {
-                    m_Buffer.m_Data.PolyControl = { 0, 0, 0, 0 };
+                    const auto& lightMap = SceneNode.Level->Model->LightMap(lm);
+                    m_Records[offset] = { 0,
+                        static_cast<uint32_t>(lm),
+                        static_cast<uint32_t>(lightMap.UClamp),
+                        static_cast<uint32_t>(lightMap.VClamp) };
 
-                    int la = SceneNode.Level->Model->LightMap(lm).iLightActors;
+                    int la = lightMap.iLightActors;
                     if (la > -1)
                     {
-                        size_t lightCounter = 0;
+                        const FBox bounds = GetFacetBounds(*SceneNode.Level->Model, Poly);
+                        m_Candidates.clear();
+
+                        uint32_t lightCounter = 0;
 
                         AActor* l = SceneNode.Level->Model->Lights(la);
                         while (l)
                         {
-                            m_Buffer.m_Data.StaticLightIds[lightCounter] = { lightCounter, lightCache.at(l), 0, 0 };
+                            // Lights over the per-level limit aren't cached, they're skipped like lights out of reach
+                            const auto itLight = lightCache.find(l);
+                            if (itLight != lightCache.end())
+                            {
+                                const auto& lightRef = itLight->second;
+
+                                // Lights that don't reach the surface bounds can't contribute to any of its pixels
+                                const float distance = GetDistanceToBox(lightRef.Location, bounds);
+                                if (distance < lightRef.Radius)
+                                {
+                                    m_Candidates.push_back({
+                                        lightCounter,
+                                        &lightRef,
+                                        lightRef.Luminance / std::max(distance * distance, 1.0f),
+                                        m_DiffuseOnlyDistance > 0.0f && distance > m_DiffuseOnlyDistance * lightRef.Radius });
+                                }
+                            }
+
                             l = SceneNode.Level->Model->Lights(++la);
                             ++lightCounter;
                         }
 
-                        m_Buffer.m_Data.PolyControl = { lightCounter, 0, 0, 0 };
-                    }
+                        if (m_Candidates.size() > m_MaxLights)
+                        {
+                            m_iNumCulledLights += m_Candidates.size() - m_MaxLights;
+
+                            // Keep the most important lights in their original order
+                            std::nth_element(m_Candidates.begin(), m_Candidates.begin() + m_MaxLights, m_Candidates.end(),
+                                [](const LightCandidate& a, const LightCandidate& b) { return a.Importance > b.Importance; });
+                            m_Candidates.resize(m_MaxLights);
+                            std::sort(m_Candidates.begin(), m_Candidates.end(),
+                                [](const LightCandidate& a, const LightCandidate& b) { return a.OcclusionMapId < b.OcclusionMapId; });
+                        }
+
+                        for (const auto& candidate : m_Candidates)
+                        {
+                            m_Records.push_back({
+                                candidate.OcclusionMapId,
+                                static_cast<uint32_t>(candidate.pLightRef->BufferPos),
+                                static_cast<uint32_t>(candidate.pLightRef->Id),
+                                candidate.DiffuseOnly ? 1u : 0u });
+                        }
 
-                    m_Buffer.MarkAsDirty();
+                        m_Records[offset].u[0] = static_cast<uint32_t>(m_Candidates.size());
+                    }
                 }                
             }            
+
+            // Consecutive surfaces with the same shading map and lights share one record
+            const size_t size = m_Records.size() - offset;
+            if (offset > 0 && offset - m_iOffset == size && memcmp(&m_Records[m_iOffset], &m_Records[offset], size * sizeof(XMVECTORU32)) == 0)
+                m_Records.resize(offset);
+            else
+                m_iOffset = offset;
         }
 
+        uint32_t GetOffset() const { return static_cast<uint32_t>(m_iOffset); }
+
+        void NewFrame()
+        {
+            m_iNumCulledLights = 0;
+            m_Records.clear();
+            m_iNumUploaded = 0;
+            m_iOffset = 0;
+        }
+
+        size_t GetNumCulledLights() const { return m_iNumCulledLights; }
+
+        /// <summary>
+        /// Appends the records added since the last call to the buffer, records of batches already rendered stay untouched
+        /// </summary>
         void UpdateAndBind()
         {
-            m_Buffer.UpdateAndBind(_slot);
+            if (m_iNumUploaded < m_Records.size())
+            {
+                if (m_Records.size() > m_iReserved)
+                    Grow(m_Records.size() * 2);
+
+                const D3D11_BOX Box = { static_cast<UINT>(m_iNumUploaded * sizeof(XMVECTORU32)), 0, 0, static_cast<UINT>(m_Records.size() * sizeof(XMVECTORU32)), 1, 1 };
+                m_DeviceContext.UpdateSubresource(m_pBuffer.Get(), 0, &Box, &m_Records[m_iNumUploaded], 0, 0);
+                m_iNumUploaded = m_Records.size();
+            }
+
+            ID3D11ShaderResourceView* const pSRV = m_pSRV.Get();
+            m_DeviceContext.PSSetShaderResources(_slot, 1, &pSRV);
+        }
+
+        Utils::MemoryUsage GetMemoryUsage() const { return { m_Records.capacity() * sizeof(XMVECTORU32), m_iReserved * sizeof(XMVECTORU32), 1 }; }
+
+    private:
+        void Alloc(const size_t iNumRecords)
+        {
+            D3D11_BUFFER_DESC BufferDesc = {};
+            BufferDesc.ByteWidth = static_cast<UINT>(iNumRecords * sizeof(XMVECTORU32));
+            BufferDesc.Usage = D3D11_USAGE::D3D11_USAGE_DEFAULT;
+            BufferDesc.BindFlags = D3D11_BIND_FLAG::D3D11_BIND_SHADER_RESOURCE;
+
+            Utils::ThrowIfFailed(
+                m_Device.CreateBuffer(&BufferDesc, nullptr, &m_pBuffer),
+                "Failed to create surface records buffer."
+            );
+            Utils::SetResourceName(m_pBuffer, "SurfaceRecords");
+
+            D3D11_SHADER_RESOURCE_VIEW_DESC ShaderResourceViewDesc = {};
+            ShaderResourceViewDesc.Format = DXGI_FORMAT::DXGI_FORMAT_R32G32B32A32_UINT;
+            ShaderResourceViewDesc.ViewDimension = D3D11_SRV_DIMENSION::D3D11_SRV_DIMENSION_BUFFER;
+            ShaderResourceViewDesc.Buffer.FirstElement = 0;
+            ShaderResourceViewDesc.Buffer.NumElements = static_cast<UINT>(iNumRecords);
+
+            Utils::ThrowIfFailed(
+                m_Device.CreateShaderResourceView(m_pBuffer.Get(), &ShaderResourceViewDesc, &m_pSRV),
+                "Failed to create surface records SRV."
+            );
+            Utils::SetResourceName(m_pSRV, "SurfaceRecords");
+
+            m_iReserved = iNumRecords;
+        }
+
+        /// <summary>
+        /// Moves to a bigger buffer, the records already uploaded are copied on the GPU
+        /// </summary>
+        void Grow(const size_t iNumRecords)
+        {
+            ComPtr<ID3D11Buffer> pOldBuffer(std::move(m_pBuffer));
+            Alloc(iNumRecords);
+
+            if (m_iNumUploaded > 0)
+            {
+                const D3D11_BOX Box = { 0, 0, 0, static_cast<UINT>(m_iNumUploaded * sizeof(XMVECTORU32)), 1, 1 };
+                m_DeviceContext.CopySubresourceRegion(m_pBuffer.Get(), 0, 0, 0, 0, pOldBuffer.Get(), 0, &Box);
+            }
         }
     }
     m_PerComplexPolyBuffer;
@@ -0,0 +1,262 @@
+﻿module;
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+export module JobSystem;
+
+/// <summary>
+/// Pool of worker threads, one job queue per worker. Workers take jobs from their own queue first and steal from the others when it's empty.
+/// Jobs submitted from a worker go to its own queue, others are spread over the queues.
+/// </summary>
+export class JobSystem
+{
+public:
+    using Job = std::function<void()>;
+
+    explicit JobSystem(size_t numThreads = std::max(2u, std::thread::hardware_concurrency()) - 1)
+    {
+        m_Queues.reserve(numThreads);
+        for (size_t i = 0; i < numThreads; ++i)
+            m_Queues.push_back(std::make_unique<Queue>());
+
+        m_Workers.reserve(numThreads);
+        for (size_t i = 0; i < numThreads; ++i)
+            m_Workers.emplace_back(&JobSystem::WorkerLoop, this, i);
+    }
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bStop = true;
+        }
+        m_JobAdded.notify_all();
+
+        for (auto& worker : m_Workers)
+            worker.join();
+    }
+
+    void Submit(Job job)
+    {
+        const size_t queueIndex = tls_pOwner == this ? tls_iWorker : m_iNextQueue++ % m_Queues.size();
+        {
+            // Counted before the job is visible: a worker may take it right after the push and uncount it.
+            // Counted under the sleep mutex, so a sleeping worker can't miss it and Wait() can't return before the job is done.
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_iNumQueued++;
+        }
+        {
+            Queue& queue = *m_Queues[queueIndex];
+            std::lock_guard<std::mutex> lock(queue.Mutex);
+            queue.Jobs.push_back({ std::move(job), Clock::now() });
+        }
+        m_JobAdded.notify_one();
+    }
+
+    /// <summary>
+    /// Runs fn(0..count-1) on the workers and the calling thread, returns when all items are done.
+    /// The calling thread takes items too, so it doesn't wait for unrelated jobs queued before.
+    /// </summary>
+    void ParallelFor(size_t count, const std::function<void(size_t)>& fn)
+    {
+        if (count == 0)
+            return;
+
+        struct Batch
+        {
+            const std::function<void(size_t)>* pFn;
+            size_t Count;
+            std::atomic<size_t> Next = 0;
+            std::atomic<size_t> NumDone = 0;
+            std::mutex Mutex;
+            std::condition_variable Done;
+        };
+
+        // Helpers can start after the batch is finished, they must only touch the shared state then
+        auto pBatch = std::make_shared<Batch>();
+        pBatch->pFn = &fn;
+        pBatch->Count = count;
+
+        auto RunItems = [](Batch& batch)
+        {
+            size_t numDone = 0;
+            for (size_t i = batch.Next++; i < batch.Count; i = batch.Next++)
+            {
+                (*batch.pFn)(i);
+                numDone++;
+            }
+
+            if (numDone > 0 && (batch.NumDone += numDone) == batch.Count)
+            {
+                std::lock_guard<std::mutex> lock(batch.Mutex);
+                batch.Done.notify_all();
+            }
+        };
+
+        const size_t numHelpers = std::min(count - 1, m_Workers.size());
+        for (size_t i = 0; i < numHelpers; ++i)
+            Submit([pBatch, RunItems] { RunItems(*pBatch); });
+
+        RunItems(*pBatch);
+
+        std::unique_lock<std::mutex> lock(pBatch->Mutex);
+        pBatch->Done.wait(lock, [&batch = *pBatch] { return batch.NumDone == batch.Count; });
+    }
+
+    /// <summary>
+    /// Blocks until all submitted jobs are finished
+    /// </summary>
+    void Wait()
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_JobDone.wait(lock, [this] { return m_iNumQueued == 0 && m_iNumRunning == 0; });
+    }
+
+    //Diagnostics
+    size_t GetNumThreads() const { return m_Workers.size(); }
+
+    size_t GetNumPending()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_iNumQueued + m_iNumRunning;
+    }
+
+    size_t GetQueueDepth()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_iNumQueued;
+    }
+
+    // Since ResetStats()
+    size_t GetNumStarted() { std::lock_guard<std::mutex> lock(m_Mutex); return m_iNumStarted; }
+    size_t GetNumStolen() { std::lock_guard<std::mutex> lock(m_Mutex); return m_iNumStolen; }
+    double GetMaxLatencyMs() { std::lock_guard<std::mutex> lock(m_Mutex); return m_fMaxLatencyMs; } // From submission to start
+    double GetAverageLatencyMs()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        return m_iNumStarted > 0 ? m_fTotalLatencyMs / m_iNumStarted : 0.0;
+    }
+
+    void ResetStats()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_iNumStarted = 0;
+        m_iNumStolen = 0;
+        m_fTotalLatencyMs = 0.0;
+        m_fMaxLatencyMs = 0.0;
+    }
+
+protected:
+    using Clock = std::chrono::high_resolution_clock;
+
+    struct QueuedJob
+    {
+        Job Fn;
+        Clock::time_point SubmitTime;
+    };
+
+    struct Queue
+    {
+        std::deque<QueuedJob> Jobs;
+        std::mutex Mutex;
+    };
+
+    /// <summary>
+    /// Takes the oldest job of the worker's queue, or steals the newest job of another queue
+    /// </summary>
+    bool TryTake(const size_t workerIndex, QueuedJob& job, bool& bStolen)
+    {
+        for (size_t i = 0; i < m_Queues.size(); ++i)
+        {
+            Queue& queue = *m_Queues[(workerIndex + i) % m_Queues.size()];
+            std::lock_guard<std::mutex> lock(queue.Mutex);
+            if (queue.Jobs.empty())
+                continue;
+
+            bStolen = i > 0;
+            if (bStolen)
+            {
+                job = std::move(queue.Jobs.back());
+                queue.Jobs.pop_back();
+            }
+            else
+            {
+                job = std::move(queue.Jobs.front());
+                queue.Jobs.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(const size_t workerIndex)
+    {
+        tls_pOwner = this;
+        tls_iWorker = workerIndex;
+
+        for (;;)
+        {
+            QueuedJob job;
+            bool bStolen;
+            if (!TryTake(workerIndex, job, bStolen))
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_JobAdded.wait(lock, [this] { return m_bStop || m_iNumQueued > 0; });
+                if (m_bStop && m_iNumQueued == 0)
+                    return;
+                continue;
+            }
+
+            {
+                const double latencyMs = std::chrono::duration<double, std::milli>(Clock::now() - job.SubmitTime).count();
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_iNumQueued--;
+                m_iNumRunning++;
+                m_iNumStarted++;
+                m_iNumStolen += bStolen;
+                m_fTotalLatencyMs += latencyMs;
+                m_fMaxLatencyMs = std::max(m_fMaxLatencyMs, latencyMs);
+            }
+
+            job.Fn();
+
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_iNumRunning--;
+            }
+            m_JobDone.notify_all();
+        }
+    }
+
+    static inline thread_local JobSystem* tls_pOwner = nullptr;
+    static inline thread_local size_t tls_iWorker = 0;
+
+    std::vector<std::thread> m_Workers;
+    std::vector<std::unique_ptr<Queue>> m_Queues;
+    std::atomic<size_t> m_iNextQueue = 0;
+
+    // Guards the counters and stats; workers sleep on it
+    std::mutex m_Mutex;
+    std::condition_variable m_JobAdded;
+    std::condition_variable m_JobDone;
+    size_t m_iNumQueued = 0;
+    size_t m_iNumRunning = 0;
+    bool m_bStop = false;
+
+    size_t m_iNumStarted = 0;
+    size_t m_iNumStolen = 0;
+    double m_fTotalLatencyMs = 0.0;
+    double m_fMaxLatencyMs = 0.0;
+};
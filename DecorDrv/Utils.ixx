@@ -1,8 +1,12 @@
 ﻿module;
 
 #include <D3DCommon.h>
+#include <dxgiformat.h>
 #include <wrl\client.h>
 #include <Core.h>
+#include <intrin.h>
+#include <cstdint>
+#include <cstring>
 
 export module Utils;
 
@@ -67,6 +71,103 @@ export namespace Utils
         }
     }
     
+    /// <summary>
+    /// Memory held by a cache or renderer: CPU copies of data, GPU resources and the number of those resources
+    /// </summary>
+    struct MemoryUsage
+    {
+        size_t iCPUBytes = 0;
+        size_t iGPUBytes = 0;
+        size_t iNumObjects = 0;
+
+        MemoryUsage& operator+=(const MemoryUsage& Other)
+        {
+            iCPUBytes += Other.iCPUBytes;
+            iGPUBytes += Other.iGPUBytes;
+            iNumObjects += Other.iNumObjects;
+            return *this;
+        }
+    };
+
+    /// <summary>
+    /// Size of a texel of the uncompressed formats used for render targets, 0 for others
+    /// </summary>
+    size_t GetBytesPerPixel(const DXGI_FORMAT Format)
+    {
+        switch (Format)
+        {
+        case DXGI_FORMAT::DXGI_FORMAT_R16G16B16A16_FLOAT:
+            return 8;
+        case DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT::DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+        case DXGI_FORMAT::DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT::DXGI_FORMAT_R10G10B10A2_UNORM:
+        case DXGI_FORMAT::DXGI_FORMAT_R32_TYPELESS:
+        case DXGI_FORMAT::DXGI_FORMAT_R32_FLOAT:
+        case DXGI_FORMAT::DXGI_FORMAT_D32_FLOAT:
+            return 4;
+        default:
+            return 0;
+        }
+    }
+
+    /// <summary>
+    /// 64-bit multiply-rotate hash, 8 bytes per step. Pass the previous result as iHash to hash several blocks.
+    /// </summary>
+    uint64_t HashBytes(const void* const pData, const size_t iSize, uint64_t iHash = 0)
+    {
+        const uint64_t iPrime1 = 0x9E3779B185EBCA87ull;
+        const uint64_t iPrime2 = 0xC2B2AE3D27D4EB4Full;
+        auto Mix = [&iHash, iPrime1, iPrime2](const uint64_t iValue)
+        {
+            iHash ^= _rotl64(iValue * iPrime2, 31) * iPrime1;
+            iHash = _rotl64(iHash, 27) * iPrime1 + 0x85EBCA77C2B2AE63ull;
+        };
+
+        const uint8_t* const pBytes = static_cast<const uint8_t*>(pData);
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= iSize; i += sizeof(uint64_t))
+        {
+            uint64_t iValue;
+            memcpy(&iValue, pBytes + i, sizeof(iValue));
+            Mix(iValue);
+        }
+        if (i < iSize)
+        {
+            uint64_t iValue = 0;
+            memcpy(&iValue, pBytes + i, iSize - i);
+            Mix(iValue);
+        }
+        Mix(iSize);
+
+        // Final avalanche
+        iHash ^= iHash >> 33;
+        iHash *= iPrime2;
+        iHash ^= iHash >> 29;
+        return iHash;
+    }
+
+    /// <summary>
+    /// Whether the CPU and the OS support AVX2, for kernels picked at runtime
+    /// </summary>
+    bool HasAVX2()
+    {
+        int Info[4];
+        __cpuid(Info, 0);
+        if (Info[0] < 7)
+            return false;
+
+        // AVX must be enabled by the OS too
+        __cpuid(Info, 1);
+        const bool bOSXSave = (Info[2] & (1 << 27)) != 0;
+        const bool bAVX = (Info[2] & (1 << 28)) != 0;
+        if (!bOSXSave || !bAVX || (_xgetbv(0) & 6) != 6)
+            return false;
+
+        __cpuidex(Info, 7, 0);
+        return (Info[1] & (1 << 5)) != 0;
+    }
+
     template<typename... Args>
     void LogMessagef(const TCHAR* str, Args... args)
     {
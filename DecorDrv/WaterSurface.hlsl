@@ -4,7 +4,7 @@ PbrM_MatInfo PbrM_ComputeWaterInfo(VSOut input)
 {
     float4 baseColor;
     if (input.TexFlags & 0x00000001)
-        baseColor = TexDiffuse.Sample(SamLinear, input.TexCoord) * float4(0.5f, 0.5f, 0.5f, 1.0f);
+        baseColor = SampleDiffuse(input, true) * float4(0.5f, 0.5f, 0.5f, 1.0f);
     else
         baseColor = float4(1.0f, 1.0f, 1.0f, 1.0f) * float4(0.5f, 0.5f, 0.5f, 1.f);
 
@@ -35,7 +35,7 @@ float4 PSMain(const VSOut input) : SV_Target
 {
     if (input.PolyFlags & PF_Masked)
     {
-        clip(TexDiffuse.Sample(SamPoint, input.TexCoord).a - 0.5f);
+        clip(SampleDiffuse(input, false).a - 0.5f);
     }
     
     PbrM_ShadingCtx shadingCtx;
@@ -45,7 +45,7 @@ float4 PSMain(const VSOut input) : SV_Target
     const PbrM_MatInfo matInfo = PbrM_ComputeWaterInfo(input);
 
     float4 output = GetAdvancedPixel(input, shadingCtx, matInfo);
-    output += GetDynamicPixel(input, shadingCtx, matInfo);
+    output += GetDynamicPixel((float3) input.PosView, shadingCtx, matInfo);
 
     if (input.TexFlags & 0x00000010)
         output += TexFog.Sample(SamLinear, input.TexCoord2).bgra * 2.0f;